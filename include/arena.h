@@ -0,0 +1,42 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define ARENA_ALIGNMENT (_Alignof(max_align_t))	/**< Alignment of every allocation */
+
+/**
+ * Memory block of an arena
+ */
+typedef struct arena_block {
+	struct arena_block *next;	/**< Previously allocated block */
+	size_t used;				/**< Used bytes of \p data */
+	size_t size;				/**< Size of \p data */
+	_Alignas(max_align_t) unsigned char data[];	/**< Allocations */
+} arena_block;
+
+/**
+ * Bump allocator
+ * @details Allocations are carved from blocks and freed all at once with arena_reset().
+ *          After a reset the arena keeps one block large enough for the previous round,
+ *          so rounds of the same size don't call malloc().
+ */
+typedef struct {
+	arena_block *head;		/**< Current block, newest first */
+	size_t block_size;		/**< Size of the next block */
+} arena;
+
+void arena_init(arena *a, size_t block_size);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+void * arena_alloc(arena *a, size_t size);
+char * arena_strdup(arena *a, const char *str);
+char * arena_strndup(arena *a, const char *str, size_t len);
+int arena_sprintf(arena *a, char **out, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+#endif
@@ -3,11 +3,13 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
 
 #include "utils.h"
 #include "http.h"
 #include "errors.h"
 #include "http_request_parser.h"
+#include "timer_wheel.h"
 
 #define PARENT_WRITE_PIPE  0
 #define PARENT_READ_PIPE   1
@@ -21,11 +23,51 @@
 #define CHILD_READ_FD   ( pipes[PARENT_WRITE_PIPE][READ_FD]  )
 #define CHILD_WRITE_FD  ( pipes[PARENT_READ_PIPE][WRITE_FD]  )
 
+#define CGI_READ_BUF_SIZE 2048	/**< Initial size of the output buffer */
+#define CGI_REAP_INTERVAL_MS 10	/**< How often a program that has closed its output is checked for exit */
+
+struct cgi_process;
+
+/**
+ * Called once when a CGI program has finished, failed or timed out.
+ * Get the result with cgi_finish().
+ */
+typedef void (*cgi_done_callback)(struct cgi_process *proc, void *data);
+
 typedef struct {
 	http_request *req;		/**< HTTP Request that performs the CGI call */
 	char *script_filename;	/**< Script full path (e.g. "/var/www/script.php") */
+	timer_wheel *timers;	/**< Worker timer wheel used for the CGI time limit */
 } cgi_parameters;
 
-int cgi_exec(const char *path, cgi_parameters *params, unsigned char **out, http_header ***out_headers, size_t *out_header_count);
+/**
+ * Running CGI program
+ * @details Driven by cgi_handle_events() from the worker event loop
+ */
+typedef struct cgi_process {
+	pid_t pid;					/**< Process ID of the program, -1 once reaped */
+	int out_fd;					/**< Read end of the program output, -1 once closed */
+	int in_fd;					/**< Write end of the program input, -1 once the payload has been written */
+	unsigned char *payload;		/**< Copy of the request payload */
+	size_t payload_len;			/**< Length of \p payload */
+	size_t payload_pos;			/**< Count of payload bytes written */
+	unsigned char *output;		/**< Output read so far */
+	size_t out_len;				/**< Count of bytes in \p output */
+	size_t out_cap;				/**< Capacity of \p output */
+	int status;					/**< Exit status of the program */
+	int error;					/**< 0 or the error that stopped the program */
+	timer_wheel *timers;		/**< Timer wheel of \p timer */
+	uint64_t deadline_ms;		/**< Time the program has to exit by */
+	timer_entry timer;			/**< Limits how long the program may run, then polls for its exit */
+	cgi_done_callback done;		/**< Called when the program has finished */
+	void *done_data;			/**< Data passed to \p done */
+} cgi_process;
+
+int cgi_init(void);
+void cgi_free(void);
+int cgi_start(const char *path, cgi_parameters *params, cgi_done_callback done, void *done_data, cgi_process **out);
+void cgi_handle_events(void);
+int cgi_finish(cgi_process *proc, unsigned char **out, http_header_list *out_headers);
+void cgi_cancel(cgi_process *proc);
 
 #endif
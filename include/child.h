@@ -13,7 +13,8 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/prctl.h>
+#include <arpa/inet.h>
 
-void child_main_loop(int sock, pid_t parent_pid, const char *addr_str);
+void child_main_loop(int server_sock, pid_t parent_pid);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef __CONNECTION_H__
+#define __CONNECTION_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "errors.h"
+#include "timer_wheel.h"
+#include "output_queue.h"
+#include "arena.h"
+#include "http.h"
+#include "http_request_parser.h"
+
+#define CONNECTION_RECV_BUF_SIZE 1024	/**< Initial receive buffer size */
+#define CONNECTION_RECV_BACKLOG_LIMIT (64*1024)	/**< Stop reading at this many buffered bytes while output is pending */
+#define CONNECTION_RECV_MAX (HTTP_REQUEST_MAX_PAYLOAD + 64*1024)	/**< Largest receive buffer, a request with the largest payload fits */
+#define CONNECTION_ARENA_BLOCK_SIZE (8*1024)	/**< Initial size of the request arena */
+
+/**
+ * Client connection
+ */
+typedef struct connection {
+	int sock;							/**< Client socket */
+	char addr_str[INET6_ADDRSTRLEN];	/**< Textual representation of client address (IPv4 or IPv6) */
+
+	char *recv_buf;						/**< Received data waiting for parsing, always null-terminated */
+	size_t recv_len;					/**< Count of bytes in \p recv_buf */
+	size_t recv_cap;					/**< Capacity of \p recv_buf */
+	int read_closed;					/**< True if the remote end closed the connection or reading failed */
+	int read_pending;					/**< True if reading stopped at the backlog limit and data may be left in the socket */
+	int closed;							/**< True if the socket has been closed and the connection waits to be freed */
+
+	int keep_alive;						/**< True if the connection is set to be kept alive */
+	http_parser parser;					/**< Parser state of the request being received */
+	http_request req;					/**< Request being handled, points to \p recv_buf */
+
+	arena arena;						/**< Memory of the current request and its response, reset once the response has been sent */
+	output_queue out;					/**< Response data waiting for the socket to become writable */
+	struct cgi_process *cgi;			/**< CGI program producing the response, NULL if none */
+
+	timer_wheel *timers;				/**< Timer wheel of the worker owning the connection */
+	timer_entry request_timer;			/**< Limits how long receiving one request may take */
+	timer_entry keepalive_timer;		/**< Limits how long a kept alive connection may idle */
+	timer_entry send_timer;				/**< Limits how long the client may stall pending output */
+
+	struct connection *prev;			/**< Previous connection in the worker connection list */
+	struct connection *next;			/**< Next connection in the worker connection list */
+} connection;
+
+connection * connection_create(int sock, timer_wheel *timers);
+void connection_close(connection *conn);
+void connection_free(connection *conn);
+
+int connection_read(connection *conn);
+void connection_consume(connection *conn, size_t count);
+
+int connection_send_iovec(connection *conn, const struct iovec *iov, int iov_count, output_release_callback release, void *release_data);
+int connection_send_file(connection *conn, int fd, off_t offset, off_t len);
+int connection_send_file2(connection *conn, int fd, off_t offset, off_t len, output_release_callback release, void *release_data);
+int connection_flush(connection *conn);
+int connection_output_pending(connection *conn);
+
+void connection_start_recv_timer(connection *conn);
+void connection_reset_keepalive_timer(connection *conn);
+void connection_stop_timers(connection *conn);
+
+#endif
@@ -17,6 +17,9 @@
 #define ERROR_PARSER_NO_HOST_HEADER -5				/**< Missing Host header */
 #define ERROR_PARSER_GET_MORE_DATA -6				/**< Missing some data */
 #define ERROR_PARSER_UNSUPPORTED_FORM_ENCODING -7	/**< Unsupported form encoding, request is still returned */
+#define ERROR_PARSER_TOO_MANY_HEADERS -8			/**< More than HTTP_REQUEST_MAX_HEADERS headers */
+#define ERROR_PARSER_UNSUPPORTED_TRANSFER_ENCODING -9	/**< Payload uses Transfer-Encoding, not supported */
+#define ERROR_PARSER_PAYLOAD_TOO_LARGE -10			/**< Content-Length is above HTTP_REQUEST_MAX_PAYLOAD */
 
 // Errors for read_file()
 #define ERROR_FILE_IO_NO_ACCESS -1	/**< File access denied */
@@ -34,4 +37,9 @@
 #define ERROR_CGI_PROG_PATH_INVALID -3		/**< CGI program path is invalid (file not found or path points to a directory) */
 #define ERROR_CGI_SCRIPT_PATH_INVALID -4	/**< CGI script path is invalid (file not found or path points to a directory) */
 
+// Errors for output_queue_*()
+#define ERROR_OUTPUT_SEND_FAILED -1			/**< Sending to the client failed */
+#define ERROR_OUTPUT_FILE_READ_FAILED -2	/**< Reading the file being sent failed */
+#define ERROR_OUTPUT_ALLOC_FAILED -3		/**< Memory allocation failed */
+
 #endif
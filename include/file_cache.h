@@ -0,0 +1,45 @@
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/inotify.h>
+
+#include "utils.h"
+#include "arena.h"
+#include "mime.h"
+#include "file_io.h"
+
+#define FILE_CACHE_BUCKETS 256	/**< Hash bucket count, a power of two */
+
+/**
+ * Cached resolved file
+ * @details Stays allocated while copies given out by file_cache_open() are in use,
+ *          even after it has been dropped from the cache
+ */
+typedef struct file_cache_entry {
+	char *key;					/**< Path the file was resolved from */
+	resolved_file file;			/**< Resolved file, the entry owns the descriptor and the path */
+	char type[MIME_TYPE_MAX];	/**< Content-Type, \p file points to this */
+	const char *name;			/**< Last component of the file path */
+	int is_index;				/**< Was the key resolved to an index file */
+	int wd;						/**< inotify watch of the directory containing the file */
+	int refs;					/**< Count of copies in use */
+	int cached;					/**< Is the entry in the cache, 0 once dropped */
+	struct file_cache_entry *hash_next;	/**< Next entry in the hash bucket */
+	struct file_cache_entry *lru_prev;	/**< More recently used entry */
+	struct file_cache_entry *lru_next;	/**< Less recently used entry */
+} file_cache_entry;
+
+int file_cache_init(const char *root);
+void file_cache_free(void);
+int file_cache_open(arena *a, char *path, resolved_file *out);
+int file_cache_find_encodings(resolved_file *file);
+int file_cache_watch(const char *path);
+void file_cache_handle_events(void);
+
+#endif
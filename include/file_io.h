@@ -2,9 +2,38 @@
 #define __FILE_IO_H__
 
 #include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "utils.h"
+#include "arena.h"
+#include "mime.h"
+#include "http_date.h"
+#include "http.h"
+
+/**
+ * File resolved for a request
+ * @details Opened and checked once, later stages use the descriptor and the status instead of the path
+ */
+typedef struct {
+	int fd;					/**< Open read-only descriptor, -1 if the file isn't open */
+	char *path;				/**< Filesystem path, index file name included */
+	off_t size;				/**< File size in bytes */
+	struct timespec mtime;	/**< Modification time */
+	dev_t dev;				/**< Device of the file */
+	ino_t ino;				/**< Inode of the file */
+	const char *type;		/**< Content-Type, valid until the next resolved_file_open() */
+	char last_modified[HTTP_DATE_LEN + 1];	/**< Last-Modified value */
+	char etag[HTTP_ETAG_MAX];	/**< Strong ETag value */
+	int encodings;			/**< HTTP_ENCODING_* flags of the precompressed siblings of the file, -1 until looked up */
+	int encoding;			/**< HTTP_ENCODING_* flag of the content, 0 if it isn't compressed */
+	void (*release)(void *data);	/**< Called by resolved_file_close() instead of closing \p fd, may be NULL */
+	void *release_data;		/**< Data passed to \p release */
+} resolved_file;
 
 ssize_t read_file(const char *path, unsigned char **out);
-int get_file_size(const char *path, off_t *file_size);
+int resolved_file_open(arena *a, char *path, resolved_file *out);
+int resolved_file_read(const resolved_file *file, unsigned char *buf);
+int resolved_file_find_encodings(const resolved_file *file);
+void resolved_file_close(resolved_file *file);
 
 #endif
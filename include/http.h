@@ -4,10 +4,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include "utils.h"
 #include "errors.h"
+#include "http_header.h"
+#include "arena.h"
+#include "http_date.h"
+#include "mime.h"
 
 #define METHOD_GET "GET"
 #define METHOD_HEAD "HEAD"
@@ -18,53 +24,72 @@
 #define METHOD_OPTIONS "OPTIONS"
 #define METHOD_TRACE "TRACE"
 
+#define HTTP_REQUEST_MAX_HEADERS 64	/**< Maximum count of request headers */
+#define HTTP_REQUEST_MAX_PAYLOAD (8*1024*1024)	/**< Maximum request payload length in bytes */
+#define HTTP_RESPONSE_IOV_COUNT 3	/**< Maximum count of I/O vector entries for one response */
+#define HTTP_STATUS_CODE_MAX 599	/**< Largest status code */
+#define HTTP_ETAG_MAX 80			/**< Size of a buffer for a generated ETag with a content coding appended, null byte included */
+#define HTTP_RANGE_MAX 16			/**< Maximum count of ranges served for one request */
+
+#define HTTP_ENCODING_BR 0x1		/**< Brotli content coding, "br" */
+#define HTTP_ENCODING_ZSTD 0x2		/**< Zstandard content coding, "zstd" */
+#define HTTP_ENCODING_GZIP 0x4		/**< Gzip content coding, "gzip" */
+#define HTTP_ENCODING_COUNT 3		/**< Count of content codings, flags are 1 << index in preference order */
+#define HTTP_ENCODING_ALL ((1 << HTTP_ENCODING_COUNT) - 1)	/**< Flags of all content codings */
+
 /**
  * Flags for http_response_set_content2()
  */
 enum SET_CONTENT_FLAGS {
-	CONTENT_SET_CONTENT_TYPE = 1	/**< Automatically set Content-Type */
+	CONTENT_SET_CONTENT_TYPE = 1,	/**< Automatically set Content-Type */
+	CONTENT_TAKE_OWNERSHIP = 2,		/**< Use the given content without copying it, the response frees it */
+	CONTENT_STATIC = 4				/**< Use the given content without copying or freeing it, it must outlive the response */
 };
 
-/**
- * HTTP Header
- */
-typedef struct {
-	char *name;		/**< Header name/key */
-	char *value;	/**< Header value */
-} http_header;
-
 /**
  * HTTP Request
+ * @details Strings point to the buffer the request was parsed from, nothing is allocated for
+ *          up to #HTTP_HEADER_LIST_INLINE headers
  */
 typedef struct {
 	char *method;				/**< Method (e.g. GET, POST, PUT, ...) */
 	char *path;					/**< Path (e.g. "/", "index.html", ...) */
-	http_header **headers;		/**< List of headers */
-	size_t header_count;		/**< Header count */
+	http_header_list headers;	/**< Headers, at most #HTTP_REQUEST_MAX_HEADERS */
 	int keep_alive;				/**< Is the Connection header value "keep-alive" */
 	char *query_str;			/**< Query string */
 	char *payload;				/**< Possible payload data */
 	size_t payload_len;			/**< Payload data size */
-
-	size_t _header_cap;			/**< Header list capacity ("private") */
 } http_request;
 
+/**
+ * Byte range of a resource
+ */
+typedef struct {
+	off_t first;	/**< Offset of the first byte */
+	off_t last;		/**< Offset of the last byte, inclusive */
+} http_byte_range;
+
 /**
  * HTTP Response
  */
 typedef struct {
-	char *method;				/**< Request method */
-	char *fs_path;				/**< Possible requested file absolute filesystem path */
+	char *method;				/**< Request method, allocated from the response arena if there is one */
+	char *fs_path;				/**< Possible requested file absolute filesystem path, allocated like \p method */
 	unsigned int status;		/**< Numeric status code (e.g. 200, 404, 500, ...) */
-	http_header **headers;		/**< List of headers */
-	size_t header_count;		/**< Header count */
+	http_header_list headers;	/**< Headers, strings owned by the list */
 	size_t content_length;		/**< Content length in bytes */
 	unsigned char *content;		/**< Response content */
 	int keep_alive;				/**< Should the Connection header value be "keep-alive" */
 	int no_payload;				/**< Should the response contain payload (0: yes, 1: no) */
-	time_t if_mod_since_time;	/**< Timestamp provided by possible If-Modified-Since header */
-
-	size_t _header_cap;			/**< Header list capacity ("private") */
+	time_t last_modified;		/**< Modification time of the served file for Last-Modified, -1 if none */
+
+	char *_head;				/**< Rendered headers ("private") */
+	size_t _head_len;			/**< Length of \p _head ("private") */
+	const char *_status_line;	/**< Prepared status line of the status entry ("private") */
+	size_t _status_len;			/**< Length of \p _status_line ("private") */
+	size_t _conn_offset;		/**< Offset of the Connection header in \p _head ("private") */
+	arena *_arena;				/**< Arena the response was allocated from or NULL ("private") */
+	int _free_content;			/**< Is \p content allocated with malloc() ("private") */
 } http_response;
 
 /**
@@ -74,6 +99,10 @@ typedef struct {
 	unsigned int status;	/**< Status code */
 	char *reason;			/**< Textual reason */
 	char *err_msg;			/**< Textual error message for error page */
+	char *status_line;		/**< Status line, rendered by http_status_init() */
+	size_t status_line_len;	/**< Length of \p status_line */
+	char *error_page;		/**< Error page if \p err_msg is set, rendered by http_status_init() */
+	size_t error_page_len;	/**< Length of \p error_page */
 } http_status_entry;
 
 /**
@@ -82,35 +111,42 @@ typedef struct {
 extern http_status_entry status_entries[];
 
 // Status entries =============================================================
+void http_status_init(void);
 http_status_entry * http_status_get_entry(unsigned int status);
 
-// HTTP Header ================================================================
-http_header * http_header_create(char *name, char *value);
-void http_header_free(http_header *header);
-
 // HTTP Request ===============================================================
-http_request * http_request_create(void);
-
-http_request * http_request_create2(char *method, char *path, char *query);
+void http_request_init(http_request *req);
+void http_request_clear(http_request *req);
 
 int http_request_add_header(http_request *req, http_header *header);
 int http_request_add_header2(http_request *req, char *header_name, char *header_value);
 
 http_header * http_request_get_header(http_request *req, char *header_name);
+http_header * http_request_get_known_header(http_request *req, http_header_id id);
 
 int http_request_header_exists(http_request *req, char *header_name);
 
 int http_request_remove_header(http_request *req, char *header_name);
 
-void http_request_free(http_request *req);
+size_t http_etag_format(ino_t ino, off_t size, const struct timespec *mtime, char *out);
+int http_request_check_preconditions(http_request *req, const char *etag, time_t last_modified);
+int http_request_if_range_matches(http_request *req, const char *etag, time_t last_modified);
+int http_request_get_ranges(http_request *req, off_t size, http_byte_range *ranges, int max);
+int http_request_choose_encoding(http_request *req, int available);
+
+const char * http_encoding_name(int encoding);
+const char * http_encoding_suffix(int encoding);
+size_t http_encoding_strip_suffix(const char *name, size_t len);
 
 // HTTP Response ==============================================================
 http_response * http_response_create(unsigned int status);
+http_response * http_response_create2(unsigned int status, arena *a);
 
 int http_response_add_header(http_response *resp, http_header *header);
-int http_response_add_header2(http_response *resp, char *header_name, char *header_value);
+int http_response_add_header2(http_response *resp, const char *header_name, const char *header_value);
 
 http_header * http_response_get_header(http_response *resp, char *header_name);
+http_header * http_response_get_known_header(http_response *resp, http_header_id id);
 
 int http_response_header_exists(http_response *resp, char *header_name);
 
@@ -121,8 +157,9 @@ int http_response_set_content2(http_response *resp, unsigned const char *content
 
 void http_response_free(http_response *resp);
 
-int http_response_get_start_string(http_response *resp, char **out);
-int http_response_string(http_response *resp, char **out);
+int http_response_get_iovec(http_response *resp, struct iovec *iov);
+int http_response_get_prebuilt(http_response *resp, char *out, size_t cap);
+int http_prebuilt_finish(char *head, size_t head_len, int keep_alive, struct iovec *iov);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,17 @@
+#ifndef __HTTP_DATE_H__
+#define __HTTP_DATE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+
+#define HTTP_DATE_LEN 29	/**< Length of an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT" */
+
+size_t http_date_format(time_t t, char *out);
+int http_date_parse(const char *str, size_t len, time_t *out);
+const char * http_date_now(void);
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef __HTTP_HEADER_H__
+#define __HTTP_HEADER_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "utils.h"
+#include "errors.h"
+
+#define HTTP_HEADER_LIST_INLINE 16				/**< Count of headers a list holds without allocating */
+#define HTTP_HEADER_LIST_STRINGS_INLINE 512		/**< Bytes of copied header strings a list holds without allocating */
+#define HTTP_HEADER_LIST_STRING_BLOCK 1024		/**< Minimum size of an allocated string block */
+#define HTTP_HEADER_LIST_MAX 0xffff				/**< Maximum count of headers in a list */
+#define HTTP_HEADER_LIST_OTHER_SLOTS 128		/**< Size of the hash table of other header names, a power of two */
+
+/**
+ * Well-known header names
+ * @details Recognized with a perfect hash when the header is added, so lookups don't compare strings
+ */
+typedef enum {
+	HTTP_HEADER_OTHER = -1,			/**< Not a well-known header */
+	HTTP_HEADER_ACCEPT,
+	HTTP_HEADER_ACCEPT_ENCODING,
+	HTTP_HEADER_ACCEPT_LANGUAGE,
+	HTTP_HEADER_ACCEPT_RANGES,
+	HTTP_HEADER_AUTHORIZATION,
+	HTTP_HEADER_CACHE_CONTROL,
+	HTTP_HEADER_CONNECTION,
+	HTTP_HEADER_CONTENT_ENCODING,
+	HTTP_HEADER_CONTENT_LENGTH,
+	HTTP_HEADER_CONTENT_RANGE,
+	HTTP_HEADER_CONTENT_TYPE,
+	HTTP_HEADER_COOKIE,
+	HTTP_HEADER_DATE,
+	HTTP_HEADER_ETAG,
+	HTTP_HEADER_EXPECT,
+	HTTP_HEADER_HOST,
+	HTTP_HEADER_IF_MATCH,
+	HTTP_HEADER_IF_MODIFIED_SINCE,
+	HTTP_HEADER_IF_NONE_MATCH,
+	HTTP_HEADER_IF_RANGE,
+	HTTP_HEADER_IF_UNMODIFIED_SINCE,
+	HTTP_HEADER_LAST_MODIFIED,
+	HTTP_HEADER_LOCATION,
+	HTTP_HEADER_RANGE,
+	HTTP_HEADER_REFERER,
+	HTTP_HEADER_SERVER,
+	HTTP_HEADER_STATUS,
+	HTTP_HEADER_TRANSFER_ENCODING,
+	HTTP_HEADER_UPGRADE,
+	HTTP_HEADER_USER_AGENT,
+	HTTP_HEADER_VARY,
+	HTTP_HEADER_KNOWN_COUNT			/**< Count of well-known headers, must be last */
+} http_header_id;
+
+/**
+ * HTTP Header
+ */
+typedef struct {
+	char *name;			/**< Header name/key */
+	char *value;		/**< Header value */
+	size_t name_len;	/**< Length of \p name */
+	size_t value_len;	/**< Length of \p value */
+	http_header_id id;	/**< Well-known header or #HTTP_HEADER_OTHER */
+} http_header;
+
+/**
+ * Block of copied header strings, used when the inline string space runs out
+ */
+typedef struct http_string_block {
+	struct http_string_block *next;	/**< Previously allocated block */
+	size_t len;						/**< Used bytes of \p data */
+	size_t cap;						/**< Size of \p data */
+	char data[];					/**< Strings */
+} http_string_block;
+
+/**
+ * Header list
+ * @details Headers are stored inline, more than #HTTP_HEADER_LIST_INLINE of them go to one allocated
+ *          array. Copied strings are bump-allocated from inline space and blocks that are only
+ *          freed with the list. Well-known headers are found from their slots, other names from
+ *          a case-insensitive hash table. An all-zero list is a valid empty list.
+ */
+typedef struct {
+	size_t count;										/**< Header count */
+	unsigned short slots[HTTP_HEADER_KNOWN_COUNT];		/**< Index + 1 of the first header of each well-known header, 0 if missing */
+	unsigned short others[HTTP_HEADER_LIST_OTHER_SLOTS];	/**< Index + 1 of the first header of other names, open addressing, 0 if unused */
+	size_t other_count;									/**< Count of names in \p others */
+	int others_full;									/**< Were names left out of \p others, they have to be searched */
+	http_header _inline[HTTP_HEADER_LIST_INLINE];		/**< First headers ("private") */
+	http_header *_overflow;								/**< Headers after the inline ones ("private") */
+	size_t _overflow_cap;								/**< Capacity of \p _overflow ("private") */
+	char _strings[HTTP_HEADER_LIST_STRINGS_INLINE];		/**< Inline string space ("private") */
+	size_t _strings_len;								/**< Used bytes of \p _strings ("private") */
+	http_string_block *_blocks;							/**< Allocated string blocks, newest first ("private") */
+} http_header_list;
+
+http_header_id http_header_lookup(const char *name, size_t len);
+
+void http_header_list_init(http_header_list *list);
+void http_header_list_clear(http_header_list *list);
+
+http_header * http_header_list_at(http_header_list *list, size_t index);
+
+int http_header_list_add(http_header_list *list, const http_header *header);
+int http_header_list_add_view(http_header_list *list, const http_header *header);
+
+http_header * http_header_list_get(http_header_list *list, const char *name);
+http_header * http_header_list_get_known(http_header_list *list, http_header_id id);
+
+int http_header_list_remove(http_header_list *list, const char *name);
+
+#endif
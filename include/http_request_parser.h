@@ -4,9 +4,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "utils.h"
 #include "http.h"
+#include "http_scan.h"
+
+#define HTTP_PARSER_MAX_LINES (HTTP_REQUEST_MAX_HEADERS + 1)	/**< Maximum count of header block lines, status line included */
 
 /**
  * HTTP Parser status
@@ -16,11 +20,44 @@ typedef enum {
 	PARSER_STATUS_CR,			/**< Current position contains Carriage Return */
 	PARSER_STATUS_LF,			/**< Current position contains Line Feed */
 	PARSER_STATUS_LINE,			/**< One line complete */
-	PARSER_STATUS_HEADER_END	/**< Headers read */
+	PARSER_STATUS_HEADER_END,	/**< Headers read */
+	PARSER_STATUS_PAYLOAD		/**< Headers read, waiting for the payload */
 } PARSER_STATUS;
 
-int http_request_parse_header_lines(const char *request, size_t len, char ***header_lines, char **end_pos_out);
-int http_request_parse_headers(char **lines, size_t line_count, http_header ***out_headers);
-int http_request_parse(const char *request, size_t len, http_request **out);
+/**
+ * Line of a header block, points to the parsed buffer
+ */
+typedef struct {
+	char *ptr;		/**< Line start, null-terminated in place */
+	size_t len;		/**< Line length without the line ending */
+} http_line;
+
+/**
+ * Line of a header block as offsets, stays valid when the buffer is reallocated
+ */
+typedef struct {
+	size_t start;	/**< Offset of the line start */
+	size_t len;		/**< Line length without the line ending */
+} http_line_offset;
+
+/**
+ * Resumable header block parser
+ * @details Keeps its position between calls, so data received in pieces is scanned only once
+ */
+typedef struct {
+	PARSER_STATUS status;					/**< Parser state */
+	size_t pos;								/**< Offset of the next byte to scan */
+	size_t line_start;						/**< Offset of the current line start */
+	size_t line_count;						/**< Count of complete lines in \p lines */
+	http_line_offset lines[HTTP_PARSER_MAX_LINES];	/**< Complete lines */
+	size_t end_pos;							/**< Offset of the last character of the header block */
+	size_t payload_len;						/**< Payload length given with Content-Length */
+} http_parser;
+
+void http_parser_init(http_parser *parser);
+
+int http_request_parse_header_lines(http_parser *parser, char *request, size_t len, http_line *lines, char **end_pos_out);
+int http_request_parse_headers(http_line *lines, size_t line_count, http_header_list *headers, size_t max_headers);
+int http_request_parse(http_parser *parser, char *request, size_t len, http_request *req);
 
-#endif
\ No newline at end of file
+#endif
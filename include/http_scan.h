@@ -0,0 +1,13 @@
+#ifndef __HTTP_SCAN_H__
+#define __HTTP_SCAN_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+size_t http_scan_any(const char *buf, size_t len, char c1, char c2, char c3);
+const char * http_scan_impl_name(void);
+
+#endif
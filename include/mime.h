@@ -0,0 +1,43 @@
+#ifndef __MIME_H__
+#define __MIME_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <magic.h>
+
+#include "utils.h"
+
+#define MIME_TYPE_MAX 128		/**< Maximum length of a detected type, null byte included */
+#define MIME_CACHE_SIZE 256		/**< Count of detected file types cached per process, a power of two */
+
+/**
+ * Extension table entry
+ */
+typedef struct {
+	char *ext;		/**< Lowercase extension without the dot, NULL if the slot is free */
+	char *type;		/**< Media type */
+} mime_ext_entry;
+
+/**
+ * Detected type of a file, valid while the file keeps its inode and mtime
+ */
+typedef struct {
+	dev_t dev;					/**< Device of the file */
+	ino_t ino;					/**< Inode of the file, 0 if the entry is free */
+	struct timespec mtime;		/**< Modification time of the file when detected */
+	char type[MIME_TYPE_MAX];	/**< Detected type */
+} mime_cache_entry;
+
+int mime_init(const char *types_path);
+
+const char * mime_type_by_extension(const char *path);
+const char * mime_type_by_file(const char *path, int fd, const struct stat *st);
+const char * mime_type_by_buffer(const unsigned char *buf, size_t len);
+
+#endif
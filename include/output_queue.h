@@ -0,0 +1,72 @@
+#ifndef __OUTPUT_QUEUE_H__
+#define __OUTPUT_QUEUE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "utils.h"
+#include "errors.h"
+
+#define OUTPUT_SEGMENT_IOV_MAX 4	/**< Maximum count of I/O vector entries in one memory segment */
+#define OUTPUT_WRITEV_IOV_MAX 64	/**< Maximum count of I/O vector entries gathered for one sendmsg() */
+
+/**
+ * Called when a segment has been sent or dropped, with the data given when queueing it
+ */
+typedef void (*output_release_callback)(void *data);
+
+/**
+ * Output segment types
+ */
+typedef enum {
+	OUTPUT_SEGMENT_MEMORY,	/**< Data in memory, one or more buffers */
+	OUTPUT_SEGMENT_FILE		/**< Range of a file, sent with sendfile() */
+} output_segment_type;
+
+/**
+ * Queued output segment
+ */
+typedef struct output_segment {
+	output_segment_type type;		/**< Segment type */
+
+	struct iovec iov[OUTPUT_SEGMENT_IOV_MAX];	/**< Memory segment buffers, advanced as data is sent */
+	int iov_count;					/**< Count of entries in \p iov */
+	int iov_index;					/**< First entry of \p iov with data left to send */
+	output_release_callback release;	/**< Called when the segment is released, may be NULL */
+	void *release_data;				/**< Data passed to \p release */
+
+	int fd;							/**< File segment descriptor, closed when the segment is released if \p release is NULL */
+	off_t file_offset;				/**< Offset of the next file byte to send */
+	off_t file_remaining;			/**< Count of file bytes left to send */
+
+	struct output_segment *next;	/**< Next segment in the queue */
+} output_segment;
+
+/**
+ * Output queue
+ * @details Response data waiting to be written to a non-blocking socket, in order
+ */
+typedef struct {
+	output_segment *head;	/**< First segment, sent next */
+	output_segment *tail;	/**< Last segment */
+} output_queue;
+
+void output_queue_init(output_queue *q);
+void output_queue_clear(output_queue *q);
+int output_queue_empty(output_queue *q);
+
+int output_queue_add_iovec(output_queue *q, const struct iovec *iov, int iov_count, output_release_callback release, void *release_data);
+int output_queue_add_buffer(output_queue *q, char *buf, size_t len);
+int output_queue_add_file(output_queue *q, int fd, off_t offset, off_t len);
+int output_queue_add_file2(output_queue *q, int fd, off_t offset, off_t len, output_release_callback release, void *release_data);
+
+int output_queue_flush(output_queue *q, int sock);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __SHARED_CACHE_H__
+#define __SHARED_CACHE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "arena.h"
+#include "mime.h"
+#include "http_date.h"
+#include "http.h"
+#include "file_io.h"
+
+#define SHARED_CACHE_SLOT_SIZE (16 * 1024)	/**< Size of one slot, headers and body included */
+#define SHARED_CACHE_WAYS 4					/**< Slots a path may be stored in */
+#define SHARED_CACHE_PATH_MAX 256			/**< Maximum length of a stored path, null byte included */
+#define SHARED_CACHE_HEAD_MAX 512			/**< Room for the prebuilt response head in a slot */
+
+/**
+ * File stored in shared memory
+ * @details Holds the content and the headers of a small file, and optionally the whole prebuilt
+ *          response head. Readers don't lock, they copy the slot and check that \p seq didn't change meanwhile.
+ *          Writers make \p seq odd for the duration of the update.
+ */
+typedef struct {
+	_Atomic uint32_t seq;		/**< Even when stable, odd while a writer updates the slot */
+	_Atomic pid_t writer;		/**< Process updating the slot, 0 if none */
+	_Atomic uint32_t used;		/**< Does the slot hold a file */
+	uint64_t hash;				/**< Hash of \p key */
+	_Atomic uint64_t stored_ms;	/**< Time of storing, the oldest slot of a set is replaced first */
+	dev_t dev;					/**< Device of the file */
+	ino_t ino;					/**< Inode of the file */
+	off_t size;					/**< Body length */
+	struct timespec mtime;		/**< Modification time of the file */
+	size_t key_len;				/**< Length of \p key */
+	size_t path_len;			/**< Length of \p path */
+	size_t head_len;			/**< Length of the prebuilt head, 0 if there is none */
+	int is_index;				/**< Was the key resolved to an index file */
+	int encodings;				/**< HTTP_ENCODING_* flags of the precompressed siblings */
+	int encoding;				/**< HTTP_ENCODING_* flag of the content, part of the key */
+	char key[SHARED_CACHE_PATH_MAX];	/**< Path the file was resolved from */
+	char path[SHARED_CACHE_PATH_MAX];	/**< Filesystem path of the file */
+	char type[MIME_TYPE_MAX];			/**< Content-Type */
+	char last_modified[HTTP_DATE_LEN + 1];	/**< Last-Modified value */
+	char etag[HTTP_ETAG_MAX];			/**< ETag value */
+	_Alignas(max_align_t) unsigned char data[];	/**< Prebuilt head followed by the file content */
+} shared_cache_slot;
+
+#define SHARED_CACHE_BODY_MAX (SHARED_CACHE_SLOT_SIZE - offsetof(shared_cache_slot, data) - SHARED_CACHE_HEAD_MAX)	/**< Largest file that fits in a slot */
+
+int shared_cache_init(size_t size);
+int shared_cache_fits(const char *key, const resolved_file *file);
+int shared_cache_get(arena *a, const char *key, int encoding, resolved_file *out, unsigned char **body, char **head, size_t *head_len);
+void shared_cache_put(const char *key, const resolved_file *file, const unsigned char *body, const char *head, size_t head_len);
+void shared_cache_invalidate(int wd, const char *name);
+void shared_cache_invalidate_all(void);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TIMER_WHEEL_TICK_MS 10		/**< Timer resolution in milliseconds */
+#define TIMER_WHEEL_LEVELS 4		/**< Count of wheel levels */
+#define TIMER_WHEEL_LEVEL_BITS 6	/**< log2 of slots per level */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_LEVEL_BITS)	/**< Slots per level */
+
+typedef struct timer_entry timer_entry;
+
+/**
+ * Timer expiry callback
+ */
+typedef void (*timer_callback)(timer_entry *timer, void *data);
+
+/**
+ * Timer, usually embedded in the structure it times
+ */
+struct timer_entry {
+	timer_entry *prev;			/**< Previous timer in the same slot */
+	timer_entry *next;			/**< Next timer in the same slot */
+	uint64_t expires;			/**< Expiry tick */
+	int level;					/**< Wheel level of the slot holding the timer */
+	int slot;					/**< Slot holding the timer */
+	int armed;					/**< True if the timer is in the wheel */
+	timer_callback callback;	/**< Function to call on expiry */
+	void *data;					/**< User data passed to \p callback */
+};
+
+/**
+ * Hierarchical timer wheel
+ * @details Level 0 has one slot per tick, every next level covers
+ *          \ref TIMER_WHEEL_SLOTS times the span of the previous one.
+ *          Timers on higher levels cascade down as time advances.
+ */
+typedef struct {
+	uint64_t current;										/**< Next tick to process */
+	size_t count;											/**< Count of armed timers */
+	uint64_t occupied[TIMER_WHEEL_LEVELS];					/**< Bitmap of non-empty slots per level */
+	timer_entry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];	/**< Slot lists */
+} timer_wheel;
+
+void timer_wheel_init(timer_wheel *tw, uint64_t now_ms);
+void timer_wheel_advance(timer_wheel *tw, uint64_t now_ms);
+int timer_wheel_next_timeout(timer_wheel *tw, uint64_t now_ms);
+
+void timer_init(timer_entry *timer, timer_callback callback, void *data);
+void timer_arm(timer_wheel *tw, timer_entry *timer, uint64_t expires_ms);
+void timer_cancel(timer_wheel *tw, timer_entry *timer);
+
+#endif
@@ -2,6 +2,7 @@
 #define __UTILS_H__
 
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
@@ -13,20 +14,26 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
-#include <magic.h>
 
 #include "errors.h"
+#include "arena.h"
 
 #define SERVER_IDENT "zhttpd/0.1-alpha"
 #define LISTEN_PORT 8080
-#define LISTEN_LIMIT 100
+#define LISTEN_LIMIT 1024	// Default listen backlog, see -b
+#define WORKER_COUNT 0	// Worker process count, 0 means one per online CPU core
+#define WORKER_MIN_LIFETIME_MS 1000	// A worker exiting sooner is respawned after a delay
+#define WORKER_RESPAWN_DELAY_MAX_MS 30000	// Longest respawn delay, it doubles with each quick exit
 #define MAX_EPOLL_EVENTS 64
 #define REQUEST_TIMEOUT_SECONDS 60	// For testing, normal value should be something like 10
 #define REQUEST_KEEPALIVE_TIMEOUT_SECONDS 10
 #define CGI_READ_TIMEOUT_SECONDS 30	// CGI process time limit
+#define SEND_TIMEOUT_SECONDS 30	// Time limit for the client to accept more response data
+#define SENDFILE_CHUNK_SIZE (8 * 1024 * 1024)	// Max bytes per sendfile() call
 #define WEBROOT "/var/www-zhttpd/"
-
-#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S %Z"
+#define FILE_CACHE_MAX_FDS 128	// Static files kept open per worker
+#define SHARED_CACHE_SIZE (32 * 1024 * 1024)	// Memory shared by the workers for small static files, 0 disables
+#define MIME_TYPES_PATH "/etc/mime.types"	// Extension to Content-Type mappings, built-in ones are used if missing
 
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
@@ -57,7 +64,8 @@ void zhttpd_log(LOG_LEVEL level, const char *format, ...);
 
 int make_socket_nonblocking(int sockfd);
 
-int current_datetime_string(char **out);
+uint64_t monotonic_time_ms(void);
+
 int current_datetime_string2(char **out, const char *format);
 
 int split_line(const char *in, size_t in_len, char delim, char ***out);
@@ -67,12 +75,11 @@ void split_line_free(char **words, size_t len);
 char * string_to_lowercase(char *str);
 char * string_to_uppercase(char *str);
 
-int create_real_path(const char *webroot, size_t webroot_len, const char *path, size_t path_len, char **out);
+int create_real_path(arena *a, const char *webroot, size_t webroot_len, const char *path, size_t path_len, char **out);
 
-int libmagic_get_mimetype(const unsigned char *buf, size_t buf_len, char **out);
-int libmagic_get_mimetype2(const char *path, char **out);
 
 int url_decode(const char *in, size_t in_len, char **out);
+int url_decode_in_place(char *str, size_t len);
 int url_encode(const char *in, size_t in_len, char **out);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include "arena.h"
+
+/**
+ * @brief Initialize arena
+ * @details Initializes empty \ref arena, the first block is allocated on first use
+ *
+ * @param a Arena to initialize
+ * @param block_size Size of a block, larger allocations get a block of their own
+ */
+void arena_init(arena *a, size_t block_size) {
+	a->head = NULL;
+	a->block_size = block_size;
+}
+
+/**
+ * @brief Reset arena
+ * @details Frees all allocations at once. If the previous round needed several blocks,
+ *          they are replaced with one block that fits them all.
+ *
+ * @param a Arena to reset
+ */
+void arena_reset(arena *a) {
+	if (a->head == NULL) return;
+	if (a->head->next == NULL) {
+		// One block, just reuse it
+		a->head->used = 0;
+		return;
+	}
+
+	size_t total = 0;
+	while (a->head != NULL) {
+		arena_block *next = a->head->next;
+		total += a->head->size;
+		free(a->head);
+		a->head = next;
+	}
+	if (total > a->block_size) a->block_size = total;
+}
+
+/**
+ * @brief Free arena
+ * @details Frees all blocks of the arena. The arena can be used again afterwards.
+ *
+ * @param a Arena to free
+ */
+void arena_free(arena *a) {
+	while (a->head != NULL) {
+		arena_block *next = a->head->next;
+		free(a->head);
+		a->head = next;
+	}
+}
+
+/**
+ * @brief Allocate memory from arena
+ * @details Allocates \p size bytes aligned to #ARENA_ALIGNMENT. The memory isn't zeroed and
+ *          stays valid until the arena is reset.
+ *
+ * @param a Arena to allocate from
+ * @param size Count of bytes to allocate
+ * @return Pointer to the memory or NULL on error
+ */
+void * arena_alloc(arena *a, size_t size) {
+	size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+	arena_block *block = a->head;
+	if (block != NULL && size <= block->size - block->used) {
+		void *p = &block->data[block->used];
+		block->used += size;
+		return p;
+	}
+
+	size_t block_size = size > a->block_size ? size : a->block_size;
+	block = malloc(sizeof(arena_block) + block_size);
+	if (block == NULL) return NULL;
+	block->used = size;
+	block->size = block_size;
+	if (a->head != NULL && size > a->block_size) {
+		// Oversized block, keep allocating from the current one
+		block->next = a->head->next;
+		a->head->next = block;
+	} else {
+		block->next = a->head;
+		a->head = block;
+	}
+	return block->data;
+}
+
+/**
+ * @brief Copy string to arena
+ *
+ * @param a Arena to allocate from
+ * @param str String to copy
+ * @return The copy or NULL on error
+ */
+char * arena_strdup(arena *a, const char *str) {
+	return arena_strndup(a, str, strlen(str));
+}
+
+/**
+ * @brief Copy string to arena
+ * @details Copies \p len bytes of \p str and adds a null byte
+ *
+ * @param a Arena to allocate from
+ * @param str String to copy
+ * @param len Length of \p str
+ * @return The copy or NULL on error
+ */
+char * arena_strndup(arena *a, const char *str, size_t len) {
+	char *copy = arena_alloc(a, len + 1);
+	if (copy == NULL) return NULL;
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+/**
+ * @brief Print formatted string to arena
+ * @details Like asprintf(), but the string is allocated from the arena
+ *
+ * @param a Arena to allocate from
+ * @param[out] out Pointer to non-allocated memory where the result will be written
+ * @param format printf() format string
+ * @return Length of \p out or < 0 on error
+ */
+int arena_sprintf(arena *a, char **out, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (len < 0) return -1;
+
+	char *str = arena_alloc(a, len + 1);
+	if (str == NULL) return -1;
+	va_start(args, format);
+	vsnprintf(str, len + 1, format, args);
+	va_end(args);
+
+	*out = str;
+	return len;
+}
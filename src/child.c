@@ -1,15 +1,22 @@
 #include "child.h"
+#include "connection.h"
 #include "utils.h"
 #include "http.h"
 #include "http_request_parser.h"
 #include "file_io.h"
+#include "file_cache.h"
+#include "shared_cache.h"
 #include "cgi.h"
 
 volatile sig_atomic_t run_child_main_loop = 1;	// True (1) if the main loop should be running
 
-static int sock;					// Socket to use
-static int keep_conn_alive = 0;		// True if the connection is set to be kept alive
-static time_t keepalive_timer = 0;	// Keepalive timer
+static connection *connections = NULL;			// Open connections of this worker
+static connection *closed_connections = NULL;	// Closed connections waiting to be freed
+static timer_wheel timers;						// Request, keep-alive and CGI timers of this worker
+static int reserve_fd = -1;				// Descriptor released when the process runs out of them
+static char file_cache_tag;					// Epoll data of the file cache change notifications
+static char cgi_tag;						// Epoll data of the CGI program pipes
+static uint64_t boundary_state;				// Generator state of multipart boundaries
 
 static void sigint_handler(int signal) {
 	// Parent died or someone wants this process to stop
@@ -17,85 +24,352 @@ static void sigint_handler(int signal) {
 	run_child_main_loop = 0;
 }
 
-// Basically copied from http://beej.us/guide/bgnet/output/html/singlepage/bgnet.html#sendall
-static int sendall(int s, char *buf, int len) {
-	int total = 0;
-	int bytes_left = len;
-	int n;
+/**
+ * Request waiting for its CGI program, allocated from the connection arena
+ */
+typedef struct {
+	connection *conn;		/**< Connection of the request */
+	char *method;			/**< Request method */
+	char *script_filename;	/**< Script full path */
+	time_t script_mtime;	/**< Modification time of the script */
+} cgi_request;
 
-	while (total < len) {
-		n = send(s, buf+total, bytes_left, 0);
-		if (n == -1 && errno != EWOULDBLOCK && errno != EAGAIN) {
-			// Send failed
-			break;
-		}
-		total += n;
-		bytes_left -= n;
-		usleep(100);
-	}
+static void cgi_done(cgi_process *proc, void *data);
 
-	return n == -1 ? -1 : total;
+/**
+ * @brief Release sent response
+ * @details Output queue release callback for responses queued with send_response()
+ * 
+ * @param data Response to free
+ */
+static void release_response(void *data) {
+	http_response_free(data);
 }
 
-static void reset_keepalive_timer(void) {
-	keepalive_timer = time(NULL);
+/**
+ * @brief Send HTTP response
+ * @details Queues the status line, headers and possible body of the response for sending
+ *          with one writev(), without copying the body. The connection takes ownership
+ *          of the response and frees it once it has been sent.
+ * 
+ * @param conn Connection to respond to
+ * @param resp Response to send
+ * @return 0 if sent, 1 if sending continues later or < 0 on error
+ */
+static int send_response(connection *conn, http_response *resp) {
+	struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+	int iov_count = http_response_get_iovec(resp, iov);
+	if (iov_count < 0) {
+		http_response_free(resp);
+		return iov_count;
+	}
+	return connection_send_iovec(conn, iov, iov_count, release_response, resp);
 }
 
 /**
  * @brief Send HTTP response with given status code
  * @details Sends HTTP response with given non-OK (200) status code
  * 
- * @param req Request
- * @param sock Socket
+ * @param conn Connection to respond to
+ * @param req Request, may be NULL if the request couldn't be parsed
  * @param status HTTP status code
- * @return Sent byte count on success or < 0 on error
+ * @return 0 if sent, 1 if sending continues later or < 0 on error
  */
-static int send_error_response(http_request *req, int sock, int status) {
-	http_response *resp = http_response_create(status);
-	resp->method = strdup(req->method);
-	if (strcmp(req->method, METHOD_HEAD) == 0) resp->no_payload = 1;
+static int send_error_response(connection *conn, http_request *req, int status) {
+	http_response *resp = http_response_create2(status, &conn->arena);
+	if (resp == NULL) return ERROR_RESPONSE_ARGUMENT;
 	if (req != NULL) {
-		resp->keep_alive = req->keep_alive;
+		resp->method = arena_strdup(&conn->arena, req->method);
+		if (strcmp(req->method, METHOD_HEAD) == 0) resp->no_payload = 1;
+		resp->keep_alive = conn->keep_alive;
 	} else {
+		resp->method = METHOD_GET;
 		resp->keep_alive = 0;
 	}
-	char *resp_str;
-	int len = http_response_string(resp, &resp_str);
-	int write_res = 0;
-	if (len >= 0) {
-		write_res = sendall(sock, resp_str, len);
-		free(resp_str);
+	return send_response(conn, resp);
+}
+
+/**
+ * @brief Send prebuilt response
+ * @details Sends a file from the shared cache with its prebuilt head. Only the date is
+ *          updated, the head, the Connection header and the body go out with one writev().
+ * 
+ * @param conn Connection to respond to
+ * @param req Request with passed preconditions, only GET and HEAD requests can use the prebuilt head
+ * @param file File from the shared cache
+ * @param body File content
+ * @param head Prebuilt head, modified in place
+ * @param head_len Length of \p head
+ * @return 0 if handled, < 0 if the request needs a full response
+ */
+static int send_prebuilt_response(connection *conn, http_request *req, resolved_file *file, unsigned char *body, char *head, size_t head_len) {
+	int is_head = strcmp(req->method, METHOD_HEAD) == 0;
+	if (!is_head && strcmp(req->method, METHOD_GET) != 0) return -1;
+
+	struct iovec iov[3];
+	int iov_count = http_prebuilt_finish(head, head_len, conn->keep_alive, iov);
+	if (!is_head && file->size > 0) {
+		iov[iov_count].iov_base = body;
+		iov[iov_count].iov_len = file->size;
+		iov_count++;
+	}
+	// Everything is in the connection arena
+	if (connection_send_iovec(conn, iov, iov_count, NULL, NULL) < 0) {
+		zhttpd_log(LOG_ERROR, "Response sending failed!");
 	}
-	http_response_free(resp);
-	return write_res;
+	return 0;
+}
+
+/**
+ * @brief Open precompressed sibling
+ * @details Replaces the file with its precompressed version, which keeps the Content-Type
+ *          of the file. The file is kept if the sibling can't be opened anymore. The encoded
+ *          representation gets an ETag of its own, the sibling requested by name keeps the plain one.
+ *          It has no prebuilt head, the headers are built for each response.
+ * 
+ * @param conn Connection of the request
+ * @param file Resolved file, replaced on success
+ * @param encoding HTTP_ENCODING_* flag of an existing sibling
+ * @param[in,out] body Whole content if it's in memory
+ * @return 0 on success, < 0 on error
+ */
+static int open_encoded_sibling(connection *conn, resolved_file *file, int encoding, unsigned char **body) {
+	char *path;
+	if (arena_sprintf(&conn->arena, &path, "%s%s", file->path, http_encoding_suffix(encoding)) < 0) return ERROR_FILE_IO_GENERAL;
+	const char *type = arena_strdup(&conn->arena, file->type);
+	if (type == NULL) return ERROR_FILE_IO_GENERAL;
+
+	resolved_file sibling;
+	unsigned char *sibling_body = NULL;
+	char *sibling_head = NULL;
+	size_t sibling_head_len = 0;
+	if (shared_cache_get(&conn->arena, path, encoding, &sibling, &sibling_body, &sibling_head, &sibling_head_len) < 0) {
+		int ret = file_cache_open(&conn->arena, path, &sibling);
+		if (ret < 0) return ret;
+		// Append the coding inside the quotes, a stored variant already has it
+		size_t etag_len = strlen(sibling.etag);
+		snprintf(sibling.etag + etag_len - 1, HTTP_ETAG_MAX - etag_len + 1, "-%s\"", http_encoding_name(encoding));
+	}
+	sibling.type = type;
+	sibling.encodings = file->encodings;
+	sibling.encoding = encoding;
+
+	resolved_file_close(file);
+	*file = sibling;
+	*body = sibling_body;
+	return 0;
+}
+
+/**
+ * @brief Keep file open
+ * @details Output queue release callback for file segments followed by others from the same file
+ * 
+ * @param data Unused
+ */
+static void keep_file(void *data) {
+	(void)data;
+}
+
+/**
+ * @brief Send "416 Range Not Satisfiable"
+ * @details Responds with the size of the file in Content-Range, see RFC 7233 Section 4.4
+ * 
+ * @param conn Connection to respond to
+ * @param req Request
+ * @param file Requested file, closed
+ * @return 0 if sent, 1 if sending continues later or < 0 on error
+ */
+static int send_unsatisfiable_response(connection *conn, http_request *req, resolved_file *file) {
+	char content_range[32];
+	snprintf(content_range, sizeof(content_range), "bytes */%lu", file->size);
+	resolved_file_close(file);
+
+	http_response *resp = http_response_create2(416, &conn->arena);
+	if (resp == NULL) return ERROR_RESPONSE_ARGUMENT;
+	resp->method = arena_strdup(&conn->arena, req->method);
+	resp->keep_alive = conn->keep_alive;
+	http_response_add_header2(resp, "Content-Range", content_range);
+	return send_response(conn, resp);
+}
+
+/**
+ * @brief Send byte ranges
+ * @details Sends "206 Partial Content" with one range as is or more as multipart/byteranges.
+ *          Content in memory is sent from there, otherwise each range is queued as a
+ *          zero-copy file segment between the part headers.
+ * 
+ * @param conn Connection to respond to
+ * @param req GET request with passed preconditions
+ * @param file Requested file, released by this function
+ * @param body Whole content if it's in memory, NULL otherwise
+ * @param ranges Satisfiable ranges
+ * @param range_count Count of \p ranges, at least 1
+ * @return 0 if sent, 1 if sending continues later or < 0 on error
+ */
+static int send_range_response(connection *conn, http_request *req, resolved_file *file, unsigned char *body, http_byte_range *ranges, int range_count) {
+	arena *a = &conn->arena;
+	http_response *resp = http_response_create2(206, a);
+	if (resp == NULL) {
+		resolved_file_close(file);
+		return ERROR_RESPONSE_ARGUMENT;
+	}
+	resp->method = arena_strdup(a, req->method);
+	resp->keep_alive = conn->keep_alive;
+	resp->fs_path = file->path;
+	resp->last_modified = file->mtime.tv_sec;
+
+	char **part_heads = NULL;	// Part headers of a multipart response
+	int *part_head_lens = NULL;
+	char *closing = NULL;		// Closing delimiter of a multipart response
+	int closing_len = 0;
+	off_t content_len = 0;
+	char *value;
+	int ret = 0;
+
+	if (range_count == 1) {
+		content_len = ranges[0].last - ranges[0].first + 1;
+		if (arena_sprintf(a, &value, "bytes %ld-%ld/%lu", (long)ranges[0].first, (long)ranges[0].last, file->size) < 0) ret = ERROR_RESPONSE_ARGUMENT;
+		else http_response_add_header2(resp, "Content-Range", value);
+		http_response_add_header2(resp, "Content-Type", file->type);
+	} else {
+		// Random boundary, so it shouldn't appear in the content
+		boundary_state ^= boundary_state << 13;
+		boundary_state ^= boundary_state >> 7;
+		boundary_state ^= boundary_state << 17;
+		char boundary[17];
+		snprintf(boundary, sizeof(boundary), "%016lx", (unsigned long)boundary_state);
+
+		part_heads = arena_alloc(a, range_count * sizeof(char *));
+		part_head_lens = arena_alloc(a, range_count * sizeof(int));
+		if (part_heads == NULL || part_head_lens == NULL) ret = ERROR_RESPONSE_ARGUMENT;
+		for (int i = 0; i < range_count && ret == 0; i++) {
+			part_head_lens[i] = arena_sprintf(a, &part_heads[i], "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%lu\r\n\r\n",
+				boundary, file->type, (long)ranges[i].first, (long)ranges[i].last, file->size);
+			if (part_head_lens[i] < 0) ret = ERROR_RESPONSE_ARGUMENT;
+			content_len += part_head_lens[i] + ranges[i].last - ranges[i].first + 1;
+		}
+		if (ret == 0) closing_len = arena_sprintf(a, &closing, "\r\n--%s--\r\n", boundary);
+		if (closing_len < 0) ret = ERROR_RESPONSE_ARGUMENT;
+		content_len += closing_len;
+		if (ret == 0 && arena_sprintf(a, &value, "multipart/byteranges; boundary=%s", boundary) >= 0) {
+			http_response_add_header2(resp, "Content-Type", value);
+		}
+	}
+	if (ret < 0) {
+		http_response_free(resp);
+		resolved_file_close(file);
+		return ret;
+	}
+
+	char cont_len_str[20] = {0};
+	snprintf(cont_len_str, 20, "%ld", (long)content_len);
+	http_response_add_header2(resp, "Content-Length", cont_len_str);
+	http_response_add_header2(resp, "Accept-Ranges", "bytes");
+	if (file->encoding != 0) http_response_add_header2(resp, "Content-Encoding", http_encoding_name(file->encoding));
+	if (file->encodings > 0) http_response_add_header2(resp, "Vary", "Accept-Encoding");
+	http_response_add_header2(resp, "Last-Modified", file->last_modified);
+	http_response_add_header2(resp, "ETag", file->etag);
+
+	// Queue everything first, then send it with as few system calls as possible
+	struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+	int iov_count = http_response_get_iovec(resp, iov);
+	if (iov_count < 0) {
+		http_response_free(resp);
+		resolved_file_close(file);
+		return iov_count;
+	}
+	if (conn->closed) {
+		http_response_free(resp);
+		resolved_file_close(file);
+		return ERROR_OUTPUT_SEND_FAILED;
+	}
+	ret = output_queue_add_iovec(&conn->out, iov, iov_count, release_response, resp);
+
+	int file_queued = 0;	// Is the last file segment, which releases the file, queued
+	for (int i = 0; i < range_count && ret == 0; i++) {
+		off_t len = ranges[i].last - ranges[i].first + 1;
+		if (part_heads != NULL) {
+			struct iovec part = { .iov_base = part_heads[i], .iov_len = part_head_lens[i] };
+			ret = output_queue_add_iovec(&conn->out, &part, 1, NULL, NULL);
+			if (ret < 0) break;
+		}
+		if (body != NULL) {
+			struct iovec part = { .iov_base = body + ranges[i].first, .iov_len = len };
+			ret = output_queue_add_iovec(&conn->out, &part, 1, NULL, NULL);
+		} else if (i < range_count - 1) {
+			ret = output_queue_add_file2(&conn->out, file->fd, ranges[i].first, len, keep_file, NULL);
+		} else {
+			file_queued = 1;
+			ret = output_queue_add_file2(&conn->out, file->fd, ranges[i].first, len, file->release, file->release_data);
+		}
+	}
+	if (ret == 0 && closing != NULL) {
+		struct iovec part = { .iov_base = closing, .iov_len = closing_len };
+		ret = output_queue_add_iovec(&conn->out, &part, 1, NULL, NULL);
+	}
+
+	if (!file_queued) resolved_file_close(file);
+	if (ret < 0) {
+		// A missing part would break the response, drop all of it
+		output_queue_clear(&conn->out);
+		conn->keep_alive = 0;
+		return ret;
+	}
+	return connection_flush(conn);
 }
 
 /**
  * @brief Handle HTTP request
  * @details Handles given HTTP request and responds to it
  * 
+ * @param conn Connection the request was received from
  * @param req Request to handle
  */
-static void handle_http_request(http_request *req) {
+static void handle_http_request(connection *conn, http_request *req) {
 
 	// Check for supported method
 	char *m = req->method;
 	if (strcmp(m, METHOD_GET) != 0 && strcmp(m, METHOD_POST) != 0 && strcmp(m, METHOD_HEAD) != 0) {
 		// Not supported method
 		// Send "501 Not Implemented"
-		send_error_response(req, sock, 501);
+		send_error_response(conn, req, 501);
 		return;
 	}
 
 	// Concatenate file path and prevent free filesystem access
 	char *final_path;
-	int rp_ret = create_real_path(WEBROOT, strlen(WEBROOT), req->path, strlen(req->path), &final_path);
+	int rp_ret = create_real_path(&conn->arena, WEBROOT, strlen(WEBROOT), req->path, strlen(req->path), &final_path);
 	if (rp_ret < 0) {
 		// Invalid path, send "400 Bad Request"
-		send_error_response(req, sock, 400);
+		send_error_response(conn, req, 400);
 
 	} else {
-		// Valid path
+		// Valid path. Small static files are served from memory shared by the workers,
+		// others are opened once and later stages use the descriptor and its status.
+		resolved_file file;
+		unsigned char *body = NULL;	// Whole content if it's in memory
+		char *head = NULL;			// Prebuilt response head if it's in memory
+		size_t head_len = 0;
+		int open_ret = 0;
+		if (shared_cache_get(&conn->arena, final_path, 0, &file, &body, &head, &head_len) < 0) {
+			open_ret = file_cache_open(&conn->arena, final_path, &file);
+		}
+		if (open_ret < 0) {
+			if (open_ret == ERROR_FILE_IO_NO_ACCESS) {
+				// Respond with "403 Forbidden"
+				send_error_response(conn, req, 403);
+
+			} else if (open_ret == ERROR_FILE_IO_NO_ENT || open_ret == ERROR_FILE_IS_DIR) {
+				// File not found, respond with "404 File Not Found"
+				send_error_response(conn, req, 404);
+
+			} else {
+				// I/O error, response with "500 Internal Server Error"
+				send_error_response(conn, req, 500);
+			}
+			return;
+		}
+		final_path = file.path;
 		zhttpd_log(LOG_INFO, "Client requests file: \"%s\"", final_path);
 
 		// Get file extension
@@ -107,214 +381,633 @@ static void handle_http_request(http_request *req) {
 		}
 
 		if (ext != NULL && strcmp(ext, "php") == 0) {
-			// Run PHP script
+			// Run PHP script, the interpreter opens it by path. The worker serves other
+			// connections while it runs, cgi_done() responds once it has finished.
 			zhttpd_log(LOG_INFO, "File is runnable PHP file!");
+			cgi_request *creq = arena_alloc(&conn->arena, sizeof(cgi_request));
+			if (creq != NULL) {
+				creq->conn = conn;
+				creq->method = arena_strdup(&conn->arena, req->method);
+				creq->script_filename = arena_strdup(&conn->arena, final_path);
+				creq->script_mtime = file.mtime.tv_sec;
+			}
+			resolved_file_close(&file);
+
+			int cgi_ret = ERROR_CGI_EXEC_FAILED;
+			if (creq != NULL && creq->method != NULL && creq->script_filename != NULL) {
+				cgi_parameters params = {
+					.req = req,
+					.script_filename = creq->script_filename,
+					.timers = &timers
+				};
+				cgi_ret = cgi_start("/usr/bin/php5-cgi", &params, cgi_done, creq, &conn->cgi);
+			}
 
-			cgi_parameters params = {
-				.req = req,
-				.script_filename = final_path
-			};
-			unsigned char *php_out;
-			http_header **cgi_headers;
-			size_t cgi_header_count;
-			int cgi_ret = cgi_exec("/usr/bin/php5-cgi", &params, &php_out, &cgi_headers, &cgi_header_count);
+			if (cgi_ret == ERROR_CGI_SCRIPT_PATH_INVALID) {
+				// Script path invalid, send "404 Not Found"
+				send_error_response(conn, req, 404);
 
-			if (cgi_ret < 0 && cgi_ret != ERROR_CGI_STATUS_NONZERO && cgi_ret != ERROR_CGI_SCRIPT_PATH_INVALID) {
+			} else if (cgi_ret < 0) {
 				// Failed
 				zhttpd_log(LOG_ERROR, "PHP execution failed!");
 				// Send "500 Internal Server Error"
-				send_error_response(req, sock, 500);
+				send_error_response(conn, req, 500);
+			}
 
-			} else if (cgi_ret == ERROR_CGI_SCRIPT_PATH_INVALID) {
-				// Script path invalid, send "404 Not Found"
-				send_error_response(req, sock, 404);
+		} else {
 
-			} else if (cgi_ret == ERROR_CGI_STATUS_NONZERO) {
-				// TODO: Handle non-zero status code
-				// For now just send "500 Internal Server Error" instead
-				free(php_out);
-				send_error_response(req, sock, 500);
+			// Send a precompressed version if the client accepts one. Siblings are looked up
+			// only for such clients, PHP scripts never get here.
+			int encoding = 0;
+			if (http_request_choose_encoding(req, HTTP_ENCODING_ALL) != 0) {
+				encoding = http_request_choose_encoding(req, file_cache_find_encodings(&file));
+			}
+			if (encoding != 0 && open_encoded_sibling(conn, &file, encoding, &body) == 0) {
+				final_path = file.path;
+				head = NULL;
+				zhttpd_log(LOG_DEBUG, "Sending %s encoded file", http_encoding_name(file.encoding));
+			}
 
-			} else {
-				// Execution successful, send response
-				// Set headers
-				int flags = CONTENT_SET_CONTENT_TYPE;
-				int status_code = -1;
-
-				for (size_t i = 0; i < cgi_header_count; i++) {
-					http_header *h = cgi_headers[i];
-					char *h_name = string_to_lowercase(h->name);
-					if (strcmp(h_name, "content-type") == 0) {
-						flags = 0;	// Don't guess Content-Type when it's already provided
-					}
-					if (strcmp(h_name, "status") == 0) {
-						// CGI script wants to set the status code
-						// Get status code
-						errno = 0;
-						status_code = strtol(h->value, NULL, 0);
-						if (errno != 0) {
-							zhttpd_log(LOG_ERROR, "CGI status header parsing failed!");
-							status_code = -1;
-						}
-					}
-					free(h_name);
-				}
+			zhttpd_log(LOG_DEBUG, "File size: %lu bytes", file.size);
 
-				http_response *resp = http_response_create((status_code != -1 ? status_code : 200));
-				resp->method = strdup(req->method);
-				resp->keep_alive = keep_conn_alive;
-				resp->fs_path = strdup(final_path);
-				if (strcmp(req->method, METHOD_HEAD) == 0) resp->no_payload = 1;	// This is a HEAD response
-				// Add headers to response
-				for (size_t i = 0; i < cgi_header_count; i++) {
-					http_header *h = cgi_headers[i];
-					char *h_name = string_to_lowercase(h->name);
-					if (strcmp(h_name, "status") != 0) {
-						http_response_add_header(resp, h);
-					}
-					free(h_name);
-					http_header_free(h);
+			// Evaluate conditional headers before preparing any content
+			int cond_status = http_request_check_preconditions(req, file.etag, file.mtime.tv_sec);
+			if (cond_status == 412) {
+				resolved_file_close(&file);
+				// Send "412 Precondition Failed"
+				send_error_response(conn, req, 412);
+				return;
+			}
+
+			// Ranges of the current representation, see RFC 7233 Section 3
+			if (cond_status == 0 && strcmp(req->method, METHOD_GET) == 0 && http_request_if_range_matches(req, file.etag, file.mtime.tv_sec)) {
+				http_byte_range ranges[HTTP_RANGE_MAX];
+				int range_count = http_request_get_ranges(req, file.size, ranges, HTTP_RANGE_MAX);
+				if (range_count == 0) {
+					// Send "416 Range Not Satisfiable"
+					send_unsatisfiable_response(conn, req, &file);
+					return;
 				}
-				free(cgi_headers);
-				// Set content
-				http_response_set_content2(resp, php_out, cgi_ret, flags);
-				free(php_out);
-				char *resp_str;
-				int len = http_response_string(resp, &resp_str);
-				if (len >= 0) {
-					if (sendall(sock, resp_str, len) == -1) {
-						zhttpd_log(LOG_ERROR, "Sendall failed!");
-						perror("sendall");
+				if (range_count > 0) {
+					if (send_range_response(conn, req, &file, body, ranges, range_count) < 0) {
+						zhttpd_log(LOG_ERROR, "Response sending failed!");
 					}
-					free(resp_str);
+					return;
 				}
-				http_response_free(resp);
 			}
 
-		} else {
+			if (cond_status == 0 && head != NULL && send_prebuilt_response(conn, req, &file, body, head, head_len) == 0) return;
 
-			off_t file_size;
-			int size_ret = get_file_size(final_path, &file_size);
-			if (size_ret < 0) {
-				free(final_path);
-				// Error
-				if (size_ret == ERROR_FILE_IO_NO_ACCESS) {
-					// Respond with "403 Forbidden"
-					send_error_response(req, sock, 403);
-
-				} else if (size_ret == ERROR_FILE_IO_NO_ENT || size_ret == ERROR_FILE_IS_DIR) {
-					// File not found, respond with "404 File Not Found"
-					send_error_response(req, sock, 404);
-
-				} else if (size_ret == ERROR_FILE_IO_GENERAL) {
-					// I/O error, response with "500 Internal Server Error"
-					send_error_response(req, sock, 500);
+			int store = 0;	// Should the file be shared with the other workers
+			if (cond_status == 0 && body == NULL && shared_cache_fits(final_path, &file)) {
+				// Small file, send it from memory
+				body = arena_alloc(&conn->arena, file.size + 1);
+				if (body != NULL && resolved_file_read(&file, body) == 0) {
+					// The stored headers depend on the siblings
+					file_cache_find_encodings(&file);
+					store = 1;
+				} else {
+					body = NULL;
 				}
+			}
+
+			http_response *resp = http_response_create2(cond_status == 304 ? 304 : 200, &conn->arena);
+			if (resp == NULL) {
+				zhttpd_log(LOG_ERROR, "Response sending failed!");
+				resolved_file_close(&file);
 				return;
 			}
+			resp->method = arena_strdup(&conn->arena, req->method);
+			resp->keep_alive = conn->keep_alive;
+			resp->fs_path = final_path;
+			resp->last_modified = file.mtime.tv_sec;
+			// HEAD and "304 Not Modified" responses have no body
+			if (strcmp(req->method, METHOD_HEAD) == 0 || cond_status == 304) resp->no_payload = 1;
+
+			if (cond_status != 304) {
+				// Set Content-Length
+				char cont_len_str[20] = {0};
+				snprintf(cont_len_str, 20, "%lu", file.size);
+				http_response_add_header2(resp, "Content-Length", cont_len_str);
 
-			zhttpd_log(LOG_DEBUG, "File size: %lu bytes", file_size);
-
-			http_response *resp = http_response_create(200);
-			resp->method = strdup(req->method);
-			resp->keep_alive = keep_conn_alive;
-			resp->fs_path = strdup(final_path);
-			if (strcmp(req->method, METHOD_HEAD) == 0) resp->no_payload = 1;	// This is a HEAD response
-
-			// Set Content-Length
-			char cont_len_str[20] = {0};
-			snprintf(cont_len_str, 20, "%lu", file_size);
-			http_response_add_header2(resp, "Content-Length", cont_len_str);
-
-			// Set Content-Type
-			// TODO: Check case-insensitively
-			if (ext != NULL && (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0)) {
-				http_response_add_header2(resp, "Content-Type", "text/html");
-			} else if (ext != NULL && strcmp(ext, "css") == 0) {
-				http_response_add_header2(resp, "Content-Type", "text/css");
-			} else {
-				// Guess Content-Type
-				char *cont_type;
-				if (libmagic_get_mimetype2(final_path, &cont_type) == -1) {
-					// Failed
-					zhttpd_log(LOG_ERROR, "Content-Type guessing failed!");
-					http_response_free(resp);
-					// Send "500 Internal Server Error"
-					send_error_response(req, sock, 500);
-					return;
-				}
 				// Set Content-Type
-				http_response_add_header2(resp, "Content-Type", cont_type);
-				free(cont_type);
+				http_response_add_header2(resp, "Content-Type", file.type);
+				if (file.encoding != 0) http_response_add_header2(resp, "Content-Encoding", http_encoding_name(file.encoding));
+				http_response_add_header2(resp, "Accept-Ranges", "bytes");
 			}
 
-			// Check if the request contains If-Modified-Since
-			http_header *if_mod_since_h = http_request_get_header(req, "If-Modified-Since");
-			if (if_mod_since_h != NULL) {
-				// Convert textual time representation to time_t
-				struct tm if_mod_since_tm;
-				if (strptime(if_mod_since_h->value, HTTP_DATE_FORMAT, &if_mod_since_tm) == NULL) {
-					// strptime failed
-					zhttpd_log(LOG_ERROR, "If-Modified-Since date parsing failed!");
-				} else {
-					// strptime succeeded
-					resp->if_mod_since_time = timegm(&if_mod_since_tm);
-				}
+			// The content depends on Accept-Encoding if there are precompressed versions
+			if (file.encodings > 0) http_response_add_header2(resp, "Vary", "Accept-Encoding");
+
+			// Set validators
+			http_response_add_header2(resp, "Last-Modified", file.last_modified);
+			http_response_add_header2(resp, "ETag", file.etag);
+
+			// Content from memory goes with the headers, a file is queued after them
+			if (body != NULL && cond_status == 0) http_response_set_content2(resp, body, file.size, CONTENT_STATIC);
+			struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+			int iov_count = http_response_get_iovec(resp, iov);
+			int no_payload = resp->no_payload;
+			if (iov_count < 0) http_response_free(resp);
+
+			if (store) {
+				// Share the file and the head of the full response, encoded variants build their headers
+				char head_buf[SHARED_CACHE_HEAD_MAX];
+				int prebuilt_len = -1;
+				if (iov_count >= 0 && file.encoding == 0) prebuilt_len = http_response_get_prebuilt(resp, head_buf, sizeof(head_buf));
+				shared_cache_put(final_path, &file, body, head_buf, prebuilt_len > 0 ? prebuilt_len : 0);
+				resolved_file_close(&file);
 			}
 
-			char *resp_start_str;
-			int len = http_response_get_start_string(resp, &resp_start_str);
-
-			if (sendall(sock, resp_start_str, len) == -1) {
+			if (iov_count < 0 || connection_send_iovec(conn, iov, iov_count, release_response, resp) < 0) {
 				// Send failed
 				zhttpd_log(LOG_ERROR, "Response sending failed!");
-				perror("sendall");
-			}
-			free(resp_start_str);
-
-			// Send possible content
-			if (resp->no_payload == 0) {
-
-				// Read file in chunks
-				// TODO: Move this to http.c ?
-				FILE *f = fopen(final_path, "r");
-				char buf[2048] = {0};
-				int read_bytes = 0;
-				while ((read_bytes = fread(buf, sizeof(char), 2048, f)) > 0) {
-					if (sendall(sock, buf, read_bytes) == -1) {
-						zhttpd_log(LOG_ERROR, "Response sending failed!");
-						perror("file sendall");
-						break;
-					}
+				resolved_file_close(&file);
+
+			} else if (no_payload == 0 && file.fd != -1) {
+				// Send content, zero-copy and queued after the headers. The queue releases the file.
+				int file_fd = file.fd;
+				file.fd = -1;
+				if (connection_send_file2(conn, file_fd, 0, file.size, file.release, file.release_data) < 0) {
+					zhttpd_log(LOG_ERROR, "Response sending failed!");
 				}
-				if (feof(f) == 0 && ferror(f) != 0) {
-					// Error
-					zhttpd_log(LOG_ERROR, "File reading failed!");
-					perror("fread");
+			} else {
+				resolved_file_close(&file);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Close client connection
+ * @details Removes the connection from the worker list and closes it.
+ *          Freeing is deferred to free_closed_connections(), because pending
+ *          epoll events may still refer to the connection.
+ * 
+ * @param conn Connection to close
+ */
+static void close_connection(connection *conn) {
+	if (conn->closed) return;
+	if (conn->cgi != NULL) {
+		// Nobody is waiting for the output anymore
+		cgi_cancel(conn->cgi);
+		conn->cgi = NULL;
+	}
+	if (conn->prev != NULL) conn->prev->next = conn->next;
+	if (conn->next != NULL) conn->next->prev = conn->prev;
+	if (connections == conn) connections = conn->next;
+	connection_close(conn);
+
+	conn->prev = NULL;
+	conn->next = closed_connections;
+	closed_connections = conn;
+}
+
+/**
+ * @brief Free closed connections
+ * @details Frees connections closed with close_connection()
+ */
+static void free_closed_connections(void) {
+	while (closed_connections != NULL) {
+		connection *next = closed_connections->next;
+		connection_free(closed_connections);
+		closed_connections = next;
+	}
+}
+
+/**
+ * @brief Finish request
+ * @details Starts waiting for the next request on kept alive connections and closes
+ *          the others, once the response has been produced and sent completely. Requests the client
+ *          sent before closing its end are still served.
+ * 
+ * @param conn Connection to use
+ */
+static void finish_request(connection *conn) {
+	if (conn->closed || connection_output_pending(conn) || conn->cgi != NULL) return;
+
+	if (!conn->keep_alive || (conn->read_closed && conn->recv_len == 0)) {
+		close_connection(conn);
+	} else {
+		// Everything allocated for the request has been released with the response
+		arena_reset(&conn->arena);
+
+		zhttpd_log(LOG_DEBUG, "Starting keepalive timer");
+		// The request timer starts again with the next request
+		timer_cancel(&timers, &conn->request_timer);
+		connection_reset_keepalive_timer(conn);
+	}
+}
+
+/**
+ * @brief Request timer callback
+ * @details Responds with "408 Request Timeout" and closes the connection
+ * 
+ * @param timer Expired timer
+ * @param data Connection
+ */
+static void request_timeout(timer_entry *timer, void *data) {
+	connection *conn = data;
+	// Send "408 Request Timeout"
+	zhttpd_log(LOG_INFO, "Client request timeout");
+	conn->keep_alive = 0;
+	send_error_response(conn, NULL, 408);
+	// Closed by finish_request() once the response has been sent
+	finish_request(conn);
+}
+
+/**
+ * @brief Keep-alive timer callback
+ * @details Closes idle kept alive connection
+ * 
+ * @param timer Expired timer
+ * @param data Connection
+ */
+static void keepalive_timeout(timer_entry *timer, void *data) {
+	connection *conn = data;
+	zhttpd_log(LOG_INFO, "Client connection keep-alive timeout");
+	close_connection(conn);
+}
+
+/**
+ * @brief Send timer callback
+ * @details Closes connection whose client stopped accepting data
+ * 
+ * @param timer Expired timer
+ * @param data Connection
+ */
+static void send_timeout(timer_entry *timer, void *data) {
+	connection *conn = data;
+	zhttpd_log(LOG_INFO, "Client didn't accept data in %d seconds", SEND_TIMEOUT_SECONDS);
+	close_connection(conn);
+}
+
+/**
+ * @brief Add accepted connection
+ * @details Creates \ref connection for an accepted socket and adds it to the worker epoll set
+ * 
+ * @param cli_sock Accepted non-blocking client socket
+ * @param in_addr Client address
+ * @param efd Worker epoll instance
+ */
+static void add_connection(int cli_sock, struct sockaddr_storage *in_addr, int efd) {
+	connection *conn = connection_create(cli_sock, &timers);
+	if (conn == NULL) {
+		zhttpd_log(LOG_ERROR, "Connection creation failed!");
+		close(cli_sock);
+		return;
+	}
+
+	// Get address info
+	void *sin_addr;
+	if (in_addr->ss_family == AF_INET) {
+		// IPv4
+		sin_addr = &(((struct sockaddr_in *)in_addr)->sin_addr);
+	} else if (in_addr->ss_family == AF_INET6) {
+		// IPv6
+		sin_addr = &(((struct sockaddr_in6 *)in_addr)->sin6_addr);
+	} else {
+		zhttpd_log(LOG_ERROR, "Unknown socket family %d!", in_addr->ss_family);
+		connection_free(conn);
+		return;
+	}
+	if (inet_ntop(in_addr->ss_family, sin_addr, conn->addr_str, sizeof(conn->addr_str)) == NULL) {
+		zhttpd_log(LOG_ERROR, "Getting address string failed!");
+		perror("inet_ntop");
+		connection_free(conn);
+		return;
+	}
+	zhttpd_log(LOG_DEBUG, "Client address: %s", conn->addr_str);
+
+	struct epoll_event event = {0};
+	event.data.ptr = conn;
+	// Edge-triggered, EPOLLOUT only reports when a full socket buffer drains
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, cli_sock, &event) == -1) {
+		zhttpd_log(LOG_ERROR, "Epoll control failed!");
+		perror("child epoll_ctl");
+		connection_free(conn);
+		return;
+	}
+
+	// Add to the worker list
+	conn->next = connections;
+	if (connections != NULL) connections->prev = conn;
+	connections = conn;
+
+	timer_init(&conn->request_timer, request_timeout, conn);
+	timer_init(&conn->keepalive_timer, keepalive_timeout, conn);
+	timer_init(&conn->send_timer, send_timeout, conn);
+	connection_start_recv_timer(conn);
+}
+
+/**
+ * @brief Accept new connections
+ * @details Accepts all pending connections from the server socket
+ * 
+ * @param server_sock Listening non-blocking server socket
+ * @param efd Worker epoll instance
+ */
+static void accept_connections(int server_sock, int efd) {
+	while (1) {
+		struct sockaddr_storage in_addr = {0};
+		socklen_t in_len = sizeof(in_addr);
+
+		int cli_sock = accept4(server_sock, (struct sockaddr *)&in_addr, &in_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cli_sock == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// Backlog drained, or another worker was faster
+				break;
+			} else if (errno == EINTR || errno == ECONNABORTED) {
+				// Try the next one
+				continue;
+			} else if ((errno == EMFILE || errno == ENFILE) && reserve_fd != -1) {
+				/* Out of file descriptors. The connection would stay in the backlog and
+				 * wake us up again immediately, so use the reserved descriptor to
+				 * accept and drop it.
+				 */
+				zhttpd_log(LOG_ERROR, "Out of file descriptors, dropping connection!");
+				close(reserve_fd);
+				cli_sock = accept(server_sock, NULL, NULL);
+				if (cli_sock != -1) close(cli_sock);
+				reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				continue;
+			}
+			zhttpd_log(LOG_ERROR, "Connection accepting failed!");
+			perror("accept4");
+			break;
+		}
+		zhttpd_log(LOG_INFO, "New connection accepted");
+
+		add_connection(cli_sock, &in_addr, efd);
+	}
+}
+
+/**
+ * @brief Process received data
+ * @details Parses, handles and responds to the requests in the receive buffer in order.
+ *          Pipelined requests are served back to back, but only one response is queued
+ *          at a time: processing waits while the previous response is still being produced
+ *          by a CGI program or sent.
+ * 
+ * @param conn Connection to use
+ */
+static void process_received_data(connection *conn) {
+	while (!conn->closed && !connection_output_pending(conn) && conn->cgi == NULL) {
+
+		if (conn->recv_len == 0) {
+			if (conn->read_closed) close_connection(conn);
+			return;
+		}
+
+		http_request *req = &conn->req;
+		int ret = http_request_parse(&conn->parser, conn->recv_buf, conn->recv_len, req);
+		if (ret < 0) {
+			// Request parsing failed, do something about that
+
+			if (ret == ERROR_PARSER_GET_MORE_DATA) {
+				// Need more data
+				zhttpd_log(LOG_DEBUG, "Need more data to parse the request");
+				if (conn->read_closed) {
+					close_connection(conn);
+				} else if (conn->recv_len + 1 >= CONNECTION_RECV_MAX) {
+					// The payload is limited, so the header block doesn't fit in the buffer
+					send_error_response(conn, NULL, 431);
+					conn->keep_alive = 0;
+					connection_consume(conn, conn->recv_len);
+				} else if (!conn->request_timer.armed) {
+					// A pipelined request has started
+					connection_start_recv_timer(conn);
 				}
-				fclose(f);
+				return;
+			}
+
+			zhttpd_log(LOG_ERROR, "Request parsing failed with error code %d", ret);
+			if (ret == ERROR_PARSER_MALFORMED_REQUEST || ret == ERROR_PARSER_NO_HOST_HEADER || ret == ERROR_PARSER_UNSUPPORTED_PROTOCOL) {
+				// Malformed request or HTTP/1.1 request without Host header
+				send_error_response(conn, NULL, 400);
+
+			} else if (ret == ERROR_PARSER_URI_TOO_LONG) {
+				send_error_response(conn, NULL, 414);
+
+			} else if (ret == ERROR_PARSER_TOO_MANY_HEADERS) {
+				send_error_response(conn, NULL, 431);
+
+			} else if (ret == ERROR_PARSER_PAYLOAD_TOO_LARGE) {
+				// Content-Length above the limit, the payload isn't read
+				send_error_response(conn, NULL, 413);
 
+			} else if (ret == ERROR_PARSER_INVALID_METHOD) {
+				// Unsupported method
+				send_error_response(conn, NULL, 405);
+
+			} else if (ret == ERROR_PARSER_UNSUPPORTED_FORM_ENCODING) {
+				// Unsupported form encoding
+				http_header *cont_type_h = http_request_get_known_header(req, HTTP_HEADER_CONTENT_TYPE);
+				char *form_encoding = cont_type_h != NULL ? cont_type_h->value : "(none)";
+				zhttpd_log(LOG_WARN, "Request is using unsupported form encoding \"%s\"!", form_encoding);
+				// Respond with "501 Not Implemented" for now
+				send_error_response(conn, NULL, 501);
+
+			} else if (ret == ERROR_PARSER_UNSUPPORTED_TRANSFER_ENCODING) {
+				// Chunked payloads aren't supported
+				send_error_response(conn, NULL, 501);
 			}
-			http_response_free(resp);
+
+			// The next request can't be found reliably after an error, close after responding
+			conn->keep_alive = 0;
+			connection_consume(conn, conn->recv_len);
+
+		} else {
+			// Request parsing successful!
+			// No timeouts while handling, CGI programs are limited with their own timer
+			connection_stop_timers(conn);
+
+			zhttpd_log(LOG_DEBUG, "New HTTP request:");
+			zhttpd_log(LOG_DEBUG, "  Method: %s", req->method);
+			zhttpd_log(LOG_DEBUG, "  Path: %s", req->path);
+			if (req->query_str != NULL) zhttpd_log(LOG_DEBUG, "  Query: %s", req->query_str);
+			zhttpd_log(LOG_DEBUG, "  %u header(s):", req->headers.count);
+			for (size_t i = 0; i < req->headers.count; i++) {
+				http_header *h = http_header_list_at(&req->headers, i);
+				zhttpd_log(LOG_DEBUG, "    %s: \"%s\"", h->name, h->value);
+			}
+
+			// HTTP/1.1 connections are kept alive unless the client wants to close
+			http_header *conn_h = http_request_get_known_header(req, HTTP_HEADER_CONNECTION);
+			conn->keep_alive = (conn_h == NULL || strcasecmp(conn_h->value, "close") != 0);
+			req->keep_alive = conn->keep_alive;
+			if (conn->keep_alive) {
+				zhttpd_log(LOG_DEBUG, "Keeping connection alive");
+			}
+
+			// Handle the request and respond to it
+			handle_http_request(conn, req);
+
+			// Keep possible pipelined requests
+			connection_consume(conn, ret);
 		}
 
-		free(final_path);
+		// Handling the data ends =========================================================
+		zhttpd_log(LOG_DEBUG, "Received data handled");
+
+		finish_request(conn);
+	}
+}
+
+/**
+ * @brief Handle incoming data
+ * @details Reads available data from the connection and handles and responds to complete requests
+ * 
+ * @param conn Connection that has data to be read
+ */
+static void handle_connection_data(connection *conn) {
+	zhttpd_log(LOG_DEBUG, "Incoming data");
+
+	// Start recv timer if this is the beginning of a new request
+	if (!conn->request_timer.armed && !connection_output_pending(conn) && conn->cgi == NULL) {
+		connection_start_recv_timer(conn);
+	}
+
+	connection_read(conn);
+	connection_reset_keepalive_timer(conn);
+
+	process_received_data(conn);
+}
+
+/**
+ * @brief Handle writable connection
+ * @details Continues sending pending output and handles requests received meanwhile
+ * 
+ * @param conn Connection that can be written to
+ */
+static void handle_connection_writable(connection *conn) {
+	if (!connection_output_pending(conn)) return;
+
+	if (connection_flush(conn) < 0) {
+		close_connection(conn);
+		return;
+	}
+	finish_request(conn);
+	process_received_data(conn);
+
+	if (conn->read_pending && !conn->closed && !connection_output_pending(conn)) {
+		// Reading stopped at the backlog limit, continue now that the responses have been sent
+		handle_connection_data(conn);
+	}
+}
+
+/**
+ * @brief Send CGI response
+ * @details Responds with the output of a finished CGI program
+ * 
+ * @param conn Connection to respond to
+ * @param creq Request that started the program
+ * @param cgi_ret Result of cgi_finish()
+ * @param php_out Output of the program, the response takes it
+ * @param cgi_headers Headers set by the program
+ */
+static void send_cgi_response(connection *conn, cgi_request *creq, int cgi_ret, unsigned char *php_out, http_header_list *cgi_headers) {
+	int status_code = -1;
+	if (cgi_ret < 0) {
+		if (cgi_ret == ERROR_CGI_STATUS_NONZERO) {
+			// TODO: Handle non-zero status code
+			// For now just send "500 Internal Server Error" instead
+			free(php_out);
+		} else {
+			// Failed
+			zhttpd_log(LOG_ERROR, "PHP execution failed!");
+		}
+		// Send "500 Internal Server Error"
+		status_code = 500;
+	}
+
+	// Set headers
+	int flags = CONTENT_SET_CONTENT_TYPE;
+	for (size_t i = 0; cgi_ret >= 0 && i < cgi_headers->count; i++) {
+		http_header *h = http_header_list_at(cgi_headers, i);
+		if (h->id == HTTP_HEADER_CONTENT_TYPE) {
+			flags = 0;	// Don't guess Content-Type when it's already provided
+		}
+		if (h->id == HTTP_HEADER_STATUS) {
+			// CGI script wants to set the status code
+			// Get status code
+			errno = 0;
+			status_code = strtol(h->value, NULL, 0);
+			if (errno != 0) {
+				zhttpd_log(LOG_ERROR, "CGI status header parsing failed!");
+				status_code = -1;
+			}
+		}
+	}
+
+	http_response *resp = http_response_create2((status_code != -1 ? status_code : 200), &conn->arena);
+	if (resp == NULL) {
+		if (cgi_ret >= 0) free(php_out);
+		return;
+	}
+	resp->method = creq->method;
+	resp->keep_alive = conn->keep_alive;
+	if (strcmp(creq->method, METHOD_HEAD) == 0) resp->no_payload = 1;	// This is a HEAD response
+	if (cgi_ret >= 0) {
+		// Execution successful
+		resp->fs_path = creq->script_filename;
+		resp->last_modified = creq->script_mtime;
+		// Add headers to response
+		for (size_t i = 0; i < cgi_headers->count; i++) {
+			http_header *h = http_header_list_at(cgi_headers, i);
+			if (h->id != HTTP_HEADER_STATUS) {
+				http_response_add_header(resp, h);
+			}
+		}
+		// Set content, the response takes the output as is
+		http_response_set_content2(resp, php_out, cgi_ret, flags | CONTENT_TAKE_OWNERSHIP);
+	}
+	// Whatever the socket doesn't take now is sent on EPOLLOUT
+	if (send_response(conn, resp) < 0) {
+		zhttpd_log(LOG_ERROR, "Response sending failed!");
+	}
+}
+
+/**
+ * @brief CGI done callback
+ * @details Responds to the request that started the program and continues with
+ *          the requests the client sent meanwhile
+ * 
+ * @param proc Finished program
+ * @param data Request that started the program
+ */
+static void cgi_done(cgi_process *proc, void *data) {
+	cgi_request *creq = data;
+	connection *conn = creq->conn;
+	conn->cgi = NULL;
+
+	unsigned char *php_out = NULL;
+	http_header_list cgi_headers;
+	http_header_list_init(&cgi_headers);
+	int cgi_ret = cgi_finish(proc, &php_out, &cgi_headers);
+	send_cgi_response(conn, creq, cgi_ret, php_out, &cgi_headers);
+	http_header_list_clear(&cgi_headers);
+
+	// Continue like after any other response
+	finish_request(conn);
+	process_received_data(conn);
+	if (conn->read_pending && !conn->closed && !connection_output_pending(conn)) {
+		handle_connection_data(conn);
 	}
 }
 
 /**
  * @brief Child process main loop
- * @details Reads data from given socket and handles and responds to requests.
+ * @details Runs the worker event loop. Accepts connections from the shared server socket
+ *          and handles and responds to requests on all of them.
  * 
- * @param in_sock Socket to monitor
+ * @param server_sock Listening server socket shared by all workers
  * @param parent_pid Process ID of the parent process
- * @param addr_str Textual representation of client address (IPv4 or IPv6)
  */
-void child_main_loop(int in_sock, pid_t parent_pid, const char *addr_str) {
-
-	sock = in_sock;	// Set global socket variable
+void child_main_loop(int server_sock, pid_t parent_pid) {
 
-	zhttpd_log(LOG_INFO, "Child process started to handle the connection");
+	zhttpd_log(LOG_INFO, "Worker process started to handle connections");
 
 	// Return SIGCHLD handler to default for the child process
 	struct sigaction sigchdl_sigaction = {
@@ -339,6 +1032,16 @@ void child_main_loop(int in_sock, pid_t parent_pid, const char *addr_str) {
 		abort();
 	}
 
+	// Writing to a connection closed by the client must not kill the whole worker
+	struct sigaction sigpipe_sigaction = {
+		.sa_handler = SIG_IGN
+	};
+	if (sigaction(SIGPIPE, &sigpipe_sigaction, NULL) == -1) {
+		zhttpd_log(LOG_CRIT, "Child SIGPIPE signal handler registering failed!");
+		perror("sigaction");
+		abort();
+	}
+
 	// Set SIGINT handler
 	struct sigaction sigint_sigaction = {
 		.sa_handler = sigint_handler
@@ -349,232 +1052,121 @@ void child_main_loop(int in_sock, pid_t parent_pid, const char *addr_str) {
 		abort();
 	}
 
-	// Get current time for recv timeout
-	time_t recv_start = time(NULL);
-
-	// Make given socket nonblocking
-	if (make_socket_nonblocking(sock) == -1) abort();
-
 	struct epoll_event event = {0};
 	struct epoll_event *events = calloc(MAX_EPOLL_EVENTS, sizeof(event));
-	int efd = epoll_create1(0);
+	int efd = epoll_create1(EPOLL_CLOEXEC);
 	if (efd == -1) {
 		zhttpd_log(LOG_CRIT, "Epoll init failed!");
 		perror("child epoll_create1");
 		abort();
 	}
 
-	event.data.fd = sock;
-	event.events = EPOLLIN | EPOLLET;
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &event) == -1) {
-		zhttpd_log(LOG_CRIT, "Epoll control failed!");
-		perror("child epoll_ctl");
-		abort();
+	// The server socket is the only entry without connection data
+	// EPOLLEXCLUSIVE (Linux >= 4.5) wakes up only one of the idle workers per new connection
+	event.data.ptr = NULL;
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, server_sock, &event) == -1) {
+		event.events = EPOLLIN;
+		if (errno != EINVAL || epoll_ctl(efd, EPOLL_CTL_ADD, server_sock, &event) == -1) {
+			zhttpd_log(LOG_CRIT, "Epoll control failed!");
+			perror("child epoll_ctl");
+			abort();
+		}
 	}
 
-	int handled = 0;			// False
-	int request_num = 1;		// True
-	int recv_timer_started = 1;	// True
+	// Keep static files open between requests, inotify tells when they change
+	int cache_fd = file_cache_init(WEBROOT);
+	if (cache_fd != -1) {
+		event.data.ptr = &file_cache_tag;
+		event.events = EPOLLIN;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, cache_fd, &event) == -1) {
+			// Without notifications cached files could go stale
+			zhttpd_log(LOG_ERROR, "File cache disabled, epoll control failed!");
+			perror("child epoll_ctl");
+			file_cache_free();
+		}
+	}
 
-	// Main event loop
-	zhttpd_log(LOG_DEBUG, "Child event loop starting");
+	// CGI programs run alongside the connections, their pipes are watched in a set of their own
+	int cgi_fd = cgi_init();
+	if (cgi_fd != -1) {
+		event.data.ptr = &cgi_tag;
+		event.events = EPOLLIN;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, cgi_fd, &event) == -1) {
+			zhttpd_log(LOG_ERROR, "CGI disabled, epoll control failed!");
+			perror("child epoll_ctl");
+			cgi_free();
+		}
+	}
 
-	unsigned int buf_size = 1024;
-	unsigned int got_bytes = 0;
-	unsigned int recv_buf_size = buf_size;
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-	char *received = calloc(recv_buf_size, sizeof(char));
+	timer_wheel_init(&timers, monotonic_time_ms());
+	boundary_state = ((uint64_t)getpid() << 32) ^ monotonic_time_ms() ^ 0x9e3779b97f4a7c15ULL;
+
+	// Main event loop
+	zhttpd_log(LOG_DEBUG, "Child event loop starting");
 
 	while (run_child_main_loop) {
 
-		int n = epoll_wait(efd, events, MAX_EPOLL_EVENTS, 0);
+		// Block until there's something to do or the next timer expires
+		int n = epoll_wait(efd, events, MAX_EPOLL_EVENTS, timer_wheel_next_timeout(&timers, monotonic_time_ms()));
+		if (n == -1 && errno != EINTR) {
+			zhttpd_log(LOG_ERROR, "Child epoll_wait failed!");
+			perror("epoll_wait");
+		}
 		for (int i = 0; i < n; i++) {
+			connection *conn = events[i].data.ptr;
 
-			if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) || (!(events[i].events & EPOLLIN))) {
-				// Error
-				zhttpd_log(LOG_ERROR, "Child Epoll wait failed!");
-				close(events[i].data.fd);
-				run_child_main_loop = 0;	// Stop main child loop
-				break;
-			
-			} else {
-				// We have data to be read!
-				zhttpd_log(LOG_DEBUG, "Incoming data");
-				int done = 0;
-				char *buf = NULL;
-
-				// Start recv timer if this isn't the first request
-				if (keep_conn_alive && !recv_timer_started) {
-					recv_start = time(NULL);
-					recv_timer_started = 1;
-				}
-
-				while (1) {
-					ssize_t count = 0;
-
-					buf = calloc(buf_size, sizeof(char));
-					count = read(events[i].data.fd, buf, buf_size);
-
-					if (count == -1) {
-						// Error
-						if (errno != EAGAIN) {
-							zhttpd_log(LOG_ERROR, "Data reading failed!");
-							perror("child read");
-							done = 1;
-						}
-						break;
-					} else if (count == 0) {
-						// Remote closed
-						zhttpd_log(LOG_INFO, "Remote end closed the connection");
-						done = 1;
-						break;
-					}
-
-					// Handle received data
-					// Check if the received data fits into the final buffer
-					while (recv_buf_size < got_bytes + count) {
-						// Doesn't fit, resize buffer
-						recv_buf_size *= 2;
-						received = realloc(received, recv_buf_size * sizeof(char));
-					}
-					// Copy received data to the final buffer
-					memcpy(&received[got_bytes], buf, count);
-					free(buf);	// Free temp recv buffer
-					buf = NULL;
-					got_bytes += count;
-				}
-				if (buf != NULL) free(buf);
-
-				// Add zero byte
-				// Resize the final recv data to fit
-				received = realloc(received, (got_bytes + 1) * sizeof(char));
-				recv_buf_size = got_bytes+1;
-				received[got_bytes] = '\0';
-
-				if (done) {
-					close(events[i].data.fd);
-					run_child_main_loop = 0;	// Stop the main child loop
-				}
+			if (conn == NULL) {
+				// New connection(s)
+				accept_connections(server_sock, efd);
 
-				// Receiving ends
-				// Handle final received data here ================================================
-
-				reset_keepalive_timer();
-
-				http_request *req;
-				int ret = http_request_parse(received, got_bytes, &req);
-				if (ret < 0) {
-					// Request parsing failed, do something about that
-
-					if (ret == ERROR_PARSER_GET_MORE_DATA) {
-						// Need more data
-						zhttpd_log(LOG_DEBUG, "Need more data to parse the request");
-						continue;
-					} else {
-						zhttpd_log(LOG_ERROR, "Request parsing failed with error code %d", ret);
-						if (ret == ERROR_PARSER_MALFORMED_REQUEST || ret == ERROR_PARSER_NO_HOST_HEADER) {
-							// Malformed request or HTTP/1.1 request without Host header
-							send_error_response(NULL, sock, 400);
-
-						} else if (ret == ERROR_PARSER_INVALID_METHOD) {
-							// Unsupported method
-							send_error_response(NULL, sock, 405);
-
-						} else if (ret == ERROR_PARSER_UNSUPPORTED_FORM_ENCODING) {
-							// Unsupported form encoding
-							http_header *cont_type_h = http_request_get_header(req, "Content-Type");
-							char *form_encoding = cont_type_h->value;
-							zhttpd_log(LOG_WARN, "Request is using unsupported form encoding \"%s\"!", form_encoding);
-							http_request_free(req);	// Request is still set in this case
-							// Respond with "501 Not Implemented" for now
-							send_error_response(NULL, sock, 501);
-						}
-					}
+			} else if (events[i].data.ptr == &file_cache_tag) {
+				// Served files changed
+				file_cache_handle_events();
 
-				} else {
-					// Request parsing successful!
-
-					zhttpd_log(LOG_DEBUG, "New HTTP request:");
-					zhttpd_log(LOG_DEBUG, "  Method: %s", req->method);
-					zhttpd_log(LOG_DEBUG, "  Path: %s", req->path);
-					if (req->query_str != NULL) zhttpd_log(LOG_DEBUG, "  Query: %s", req->query_str);
-					zhttpd_log(LOG_DEBUG, "  %u header(s):", req->header_count);
-					for (size_t i = 0; i < req->header_count; i++) {
-						http_header *h = req->headers[i];
-						zhttpd_log(LOG_DEBUG, "    %s: \"%s\"", h->name, h->value);
-					}
+			} else if (events[i].data.ptr == &cgi_tag) {
+				// CGI programs can be written to or have output
+				cgi_handle_events();
 
-					// Search for Connection header to possibly set keep-alive
-					http_header *conn_h = http_request_get_header(req, "Connection");
-					if (conn_h != NULL) {
-						char *value = string_to_lowercase(conn_h->value);
-						if (strcmp(value, "keep-alive") == 0) {
-							keep_conn_alive = 1;	// Set to true
-							req->keep_alive = 1;
-						}
-						free(value);
-						if (keep_conn_alive) {
-							zhttpd_log(LOG_DEBUG, "Client wants to keep connection alive");
-							reset_keepalive_timer();
-						}
-					}
+			} else if (conn->closed) {
+				// Closed while handling previous events
+				continue;
 
-					// Handle the request and respond to it
-					handle_http_request(req);
+			} else if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) {
+				// Error
+				zhttpd_log(LOG_ERROR, "Child Epoll wait failed!");
+				close_connection(conn);
 
-					// We're done with the request, free it
-					http_request_free(req);
+			} else {
+				if (events[i].events & EPOLLOUT) {
+					// Socket buffer has room for pending output
+					handle_connection_writable(conn);
 				}
-
-				// Handling the data ends =========================================================
-				free(received);
-				received = NULL;
-				got_bytes = 0;
-				zhttpd_log(LOG_DEBUG, "Received data handled");
-
-				handled = 1;
-				if (keep_conn_alive) {
-					zhttpd_log(LOG_DEBUG, "Starting keepalive timer");
-					reset_keepalive_timer();
-					request_num++;
-					recv_buf_size = buf_size;
-					received = calloc(recv_buf_size, sizeof(char));
-				} else {
-					run_child_main_loop = 0;
+				if ((events[i].events & EPOLLIN) && !conn->closed) {
+					// We have data to be read!
+					handle_connection_data(conn);
 				}
 			}
 		}
-		usleep(5000);
-
-		if (handled == 0 && time(NULL) - recv_start >= REQUEST_TIMEOUT_SECONDS) {
-			// Receive timeout
-			// Send "408 Request Timeout"
-			zhttpd_log(LOG_INFO, "Client request timeout");
-
-			send_error_response(NULL, sock, 408);
-			run_child_main_loop = 0;
-		}
-
-		if (keep_conn_alive && time(NULL) - keepalive_timer >= REQUEST_KEEPALIVE_TIMEOUT_SECONDS) {
-			// Keep-alive timeout
-			// Just close connection for now
-			/* TODO: Have some kind of "processing" variable that indicates if
-			 *       data processing is in progress and reset the timer in that case.
-			 */
-			zhttpd_log(LOG_INFO, "Client connection keep-alive timeout");
-
-			run_child_main_loop = 0;
-		}
 
+		// Expire timers and free the connections closed on this round
+		timer_wheel_advance(&timers, monotonic_time_ms());
+		free_closed_connections();
 	}
 	zhttpd_log(LOG_INFO, "Child request handler process closing");
 
-	if (received != NULL) free(received);
+	// Close remaining connections
+	while (connections != NULL) {
+		close_connection(connections);
+	}
+	free_closed_connections();
+	file_cache_free();
+	cgi_free();
 	free(events);
-
-	// Close socket
-	shutdown(sock, SHUT_RDWR);
-	close(sock);
+	close(efd);
+	if (reserve_fd != -1) close(reserve_fd);
 
 	// We're done!
-}
\ No newline at end of file
+}
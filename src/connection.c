@@ -0,0 +1,292 @@
+#include "connection.h"
+
+/**
+ * @brief Create connection
+ * @details Creates new \ref connection for an accepted client socket
+ * 
+ * @param sock Client socket
+ * @param timers Timer wheel for the connection timers. Timer callbacks must be set with timer_init() by the caller.
+ * @return New \ref connection or NULL on error
+ */
+connection * connection_create(int sock, timer_wheel *timers) {
+	connection *conn = calloc(1, sizeof(connection));
+	if (conn == NULL) return NULL;
+	conn->sock = sock;
+	conn->recv_cap = CONNECTION_RECV_BUF_SIZE;
+	conn->recv_buf = calloc(conn->recv_cap, sizeof(char));
+	if (conn->recv_buf == NULL) {
+		free(conn);
+		return NULL;
+	}
+	conn->recv_len = 0;
+	conn->read_closed = 0;
+	conn->read_pending = 0;
+	conn->closed = 0;
+	conn->keep_alive = 0;
+	http_parser_init(&conn->parser);
+	http_request_init(&conn->req);
+	arena_init(&conn->arena, CONNECTION_ARENA_BLOCK_SIZE);
+	output_queue_init(&conn->out);
+	conn->cgi = NULL;
+	conn->timers = timers;
+	conn->prev = NULL;
+	conn->next = NULL;
+	timer_init(&conn->request_timer, NULL, conn);
+	timer_init(&conn->keepalive_timer, NULL, conn);
+	timer_init(&conn->send_timer, NULL, conn);
+
+	return conn;
+}
+
+/**
+ * @brief Close connection
+ * @details Stops the connection timers and closes the client socket.
+ *          The \ref connection itself stays valid until connection_free().
+ * 
+ * @param conn Connection to close
+ */
+void connection_close(connection *conn) {
+	if (conn->closed) return;
+	connection_stop_timers(conn);
+	output_queue_clear(&conn->out);
+	// Closing the socket also removes it from epoll sets
+	shutdown(conn->sock, SHUT_RDWR);
+	close(conn->sock);
+	conn->closed = 1;
+}
+
+/**
+ * @brief Free connection
+ * @details Closes the connection if needed and frees the \ref connection
+ * 
+ * @param conn Connection to free
+ */
+void connection_free(connection *conn) {
+	if (conn == NULL) return;
+	connection_close(conn);
+	http_request_clear(&conn->req);
+	arena_free(&conn->arena);
+	free(conn->recv_buf);
+	free(conn);
+}
+
+/**
+ * @brief Read available data
+ * @details Reads all currently available data from the socket to the receive buffer.
+ *          Sets \p read_closed if the remote end closed the connection or reading failed.
+ *          While output is pending or being produced, stops at #CONNECTION_RECV_BACKLOG_LIMIT buffered bytes
+ *          and sets \p read_pending, so a client pipelining requests without reading the
+ *          responses can't make the buffer grow without limit. The buffer never grows beyond
+ *          #CONNECTION_RECV_MAX bytes, reading stops there the same way.
+ * 
+ * @param conn Connection to read from
+ * @return Count of bytes read
+ */
+int connection_read(connection *conn) {
+	int total = 0;
+
+	conn->read_pending = 0;
+	while (1) {
+		if (conn->recv_len >= CONNECTION_RECV_BACKLOG_LIMIT && (connection_output_pending(conn) || conn->cgi != NULL)) {
+			// Continue once the client has taken the pending responses
+			conn->read_pending = 1;
+			break;
+		}
+
+		// Keep room for the null byte
+		if (conn->recv_len + 1 >= conn->recv_cap) {
+			if (conn->recv_cap >= CONNECTION_RECV_MAX) {
+				// Full, the requests in the buffer have to be handled first
+				conn->read_pending = 1;
+				break;
+			}
+			// Doesn't fit, resize buffer
+			size_t cap = conn->recv_cap * 2 < CONNECTION_RECV_MAX ? conn->recv_cap * 2 : CONNECTION_RECV_MAX;
+			char *buf = realloc(conn->recv_buf, cap * sizeof(char));
+			if (buf == NULL) {
+				zhttpd_log(LOG_ERROR, "Receive buffer allocation failed!");
+				conn->read_closed = 1;
+				break;
+			}
+			conn->recv_buf = buf;
+			conn->recv_cap = cap;
+		}
+
+		ssize_t count = read(conn->sock, &conn->recv_buf[conn->recv_len], conn->recv_cap - conn->recv_len - 1);
+		if (count == -1) {
+			// Error
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				zhttpd_log(LOG_ERROR, "Data reading failed!");
+				perror("connection read");
+				conn->read_closed = 1;
+			}
+			break;
+		} else if (count == 0) {
+			// Remote closed
+			zhttpd_log(LOG_INFO, "Remote end closed the connection");
+			conn->read_closed = 1;
+			break;
+		}
+		conn->recv_len += count;
+		total += count;
+	}
+
+	conn->recv_buf[conn->recv_len] = '\0';
+	return total;
+}
+
+/**
+ * @brief Consume received data
+ * @details Discards handled data from the start of the receive buffer
+ *          and resets the parser for the next request
+ * 
+ * @param conn Connection to use
+ * @param count Count of bytes to discard, the rest is kept for the next request
+ */
+void connection_consume(connection *conn, size_t count) {
+	if (count > conn->recv_len) count = conn->recv_len;
+	// Move possible pipelined requests to the start
+	memmove(conn->recv_buf, &conn->recv_buf[count], conn->recv_len - count);
+	conn->recv_len -= count;
+	conn->recv_buf[conn->recv_len] = '\0';
+	http_parser_init(&conn->parser);
+}
+
+/**
+ * @brief Send buffers
+ * @details Queues the buffers of \p iov for sending and sends as much as the socket accepts right away,
+ *          gathered into one system call. The rest is sent by connection_flush() when the socket
+ *          becomes writable again. The buffers must stay valid until \p release is called.
+ * 
+ * @param conn Connection to use
+ * @param iov Buffers to send
+ * @param iov_count Count of entries in \p iov, at most #OUTPUT_SEGMENT_IOV_MAX
+ * @param release Function to call when the buffers aren't needed anymore, may be NULL
+ * @param release_data Data passed to \p release
+ * @return 0 if everything was sent, 1 if sending continues later or < 0 on error
+ */
+int connection_send_iovec(connection *conn, const struct iovec *iov, int iov_count, output_release_callback release, void *release_data) {
+	if (conn->closed) {
+		if (release != NULL) release(release_data);
+		return ERROR_OUTPUT_SEND_FAILED;
+	}
+	int ret = output_queue_add_iovec(&conn->out, iov, iov_count, release, release_data);
+	if (ret < 0) return ret;
+	return connection_flush(conn);
+}
+
+/**
+ * @brief Send file
+ * @details Queues \p len bytes of \p fd from \p offset for sending without copying them
+ *          to userspace, after any previously queued data. Sends as much as the socket
+ *          accepts right away, the rest is sent by connection_flush() when the socket
+ *          becomes writable again. The connection takes ownership of \p fd.
+ *          Actually calls connection_send_file2() without a release callback.
+ * 
+ * @param conn Connection to use
+ * @param fd File to send
+ * @param offset Offset of the first byte to send
+ * @param len Count of bytes to send
+ * @return 0 if everything was sent, 1 if sending continues later or < 0 on error
+ */
+int connection_send_file(connection *conn, int fd, off_t offset, off_t len) {
+	return connection_send_file2(conn, fd, offset, len, NULL, NULL);
+}
+
+/**
+ * @brief Send file with release callback
+ * @details Like connection_send_file(), but \p release is called instead of closing \p fd
+ *          once the range has been sent or dropped
+ * 
+ * @param conn Connection to use
+ * @param fd File to send
+ * @param offset Offset of the first byte to send
+ * @param len Count of bytes to send
+ * @param release Function to call when the file isn't needed anymore, may be NULL
+ * @param release_data Data passed to \p release
+ * @return 0 if everything was sent, 1 if sending continues later or < 0 on error
+ */
+int connection_send_file2(connection *conn, int fd, off_t offset, off_t len, output_release_callback release, void *release_data) {
+	if (conn->closed) {
+		if (release != NULL) {
+			release(release_data);
+		} else {
+			close(fd);
+		}
+		return ERROR_OUTPUT_SEND_FAILED;
+	}
+	int ret = output_queue_add_file2(&conn->out, fd, offset, len, release, release_data);
+	if (ret < 0) return ret;
+	return connection_flush(conn);
+}
+
+/**
+ * @brief Continue sending
+ * @details Sends queued output until the socket buffer fills up or the queue is empty.
+ *          While output is pending, the send timer limits how long the client may stall.
+ *          On error the queued output is dropped and the connection is set not to be kept alive.
+ * 
+ * @param conn Connection to use
+ * @return 0 if everything was sent, 1 if sending continues later or < 0 on error
+ */
+int connection_flush(connection *conn) {
+	if (conn->closed) return ERROR_OUTPUT_SEND_FAILED;
+
+	int ret = output_queue_flush(&conn->out, conn->sock);
+	if (ret == 1) {
+		// Wait for EPOLLOUT, but not forever
+		timer_arm(conn->timers, &conn->send_timer, monotonic_time_ms() + SEND_TIMEOUT_SECONDS * 1000);
+	} else {
+		timer_cancel(conn->timers, &conn->send_timer);
+		if (ret < 0) {
+			// Can't continue on this connection
+			output_queue_clear(&conn->out);
+			conn->keep_alive = 0;
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Check for pending output
+ * @details Checks if the connection has response data waiting for the socket to become writable
+ * 
+ * @param conn Connection to use
+ * @return 1 if output is pending, 0 otherwise
+ */
+int connection_output_pending(connection *conn) {
+	return !output_queue_empty(&conn->out);
+}
+
+/**
+ * @brief Start request receive timer
+ * @details Starts the timer limiting how long receiving a request may take
+ * 
+ * @param conn Connection to use
+ */
+void connection_start_recv_timer(connection *conn) {
+	timer_arm(conn->timers, &conn->request_timer, monotonic_time_ms() + REQUEST_TIMEOUT_SECONDS * 1000);
+}
+
+/**
+ * @brief Reset keep-alive timer
+ * @details Restarts the idle timer if the connection is kept alive
+ * 
+ * @param conn Connection to use
+ */
+void connection_reset_keepalive_timer(connection *conn) {
+	if (!conn->keep_alive) return;
+	timer_arm(conn->timers, &conn->keepalive_timer, monotonic_time_ms() + REQUEST_KEEPALIVE_TIMEOUT_SECONDS * 1000);
+}
+
+/**
+ * @brief Stop connection timers
+ * @details Cancels all running timers of the connection, e.g. while a request is being handled
+ * 
+ * @param conn Connection to use
+ */
+void connection_stop_timers(connection *conn) {
+	timer_cancel(conn->timers, &conn->request_timer);
+	timer_cancel(conn->timers, &conn->keepalive_timer);
+	timer_cancel(conn->timers, &conn->send_timer);
+}
@@ -5,129 +5,110 @@
  */
 http_status_entry status_entries[] = {
 	{200, "OK",                    NULL},
+	{206, "Partial Content",       NULL},
 	{500, "Internal Server Error", "Unknown server error."},
 	{501, "Not Implemented",       "Sorry, the server doesn't know how to handle the request."},
 	{302, "Moved Temporarily",     "The resource has been moved temporarily to another location."},
-	{304, "Not Modified",          "The resource hasn't been modified since given date."},
+	{304, "Not Modified",          NULL},
 	{400, "Bad Request",           "Received request was malformed."},
 	{403, "Forbidden",             "File access forbidden."},
 	{404, "Not Found",             "Requested file not found."},
 	{405, "Method Not Allowed",    "Request contained unknown method."},
 	{408, "Request Time-out",      "No enough data received in a reasonable timeframe."},
+	{412, "Precondition Failed",   "The resource doesn't match the conditions of the request."},
+	{413, "Payload Too Large",     "Request payload is too large."},
+	{414, "URI Too Long",          "Requested URI is too long."},
+	{416, "Range Not Satisfiable", "Requested range is outside of the resource."},
+	{431, "Request Header Fields Too Large", "Request contained too many headers."},
 	{0, NULL, NULL}	// Guard entry, must be last
 };
 
+static unsigned char status_index[HTTP_STATUS_CODE_MAX + 1];	// Position + 1 of each code in status_entries, 0 if missing
+static int status_ready = 0;	// True once http_status_init() has run
+
 /**
- * @brief Get HTTP status entry
- * @details Gets corresponding status entry for status code
- *
- * @param status Status code
- * @return Status entry or NULL on error
+ * @brief Prepare HTTP status entries
+ * @details Indexes \ref status_entries by code and renders the status line and error page
+ *          of every entry once. Call before forking, so the workers share the result.
  */
-http_status_entry * http_status_get_entry(unsigned int status) {
-	int pos = 0;
-	while (1) {
-		http_status_entry entry = status_entries[pos];
-		if (entry.status == 0 && entry.reason == NULL && entry.err_msg == NULL) {
-			break;	// Found last (guard) entry
+void http_status_init(void) {
+	if (status_ready) return;
+	for (int pos = 0; status_entries[pos].reason != NULL; pos++) {
+		http_status_entry *entry = &status_entries[pos];
+		status_index[entry->status] = pos + 1;
+
+		int len = asprintf(&entry->status_line, "HTTP/1.1 %u %s\r\n", entry->status, entry->reason);
+		if (len < 0) {
+			zhttpd_log(LOG_CRIT, "Rendering status line %u failed!", entry->status);
+			exit(1);
 		}
-		if (entry.status == status) {
-			// Found correct entry
-			return &(status_entries[pos]);
+		entry->status_line_len = len;
+
+		if (entry->err_msg == NULL) continue;
+		len = asprintf(&entry->error_page,
+			"<!DOCTYPE html><html><head>\n \
+			<title>%d %s</title>\n \
+			</head><body>\n \
+			<h1>%d %s</h1>\n \
+			<p>%s<br /></p>\n \
+			<hr>\n \
+			<address>%s on port %d</address>\n</body></html>\n",
+			entry->status, entry->reason, entry->status, entry->reason, entry->err_msg, SERVER_IDENT, LISTEN_PORT
+		);
+		if (len < 0) {
+			zhttpd_log(LOG_CRIT, "Rendering error page %u failed!", entry->status);
+			exit(1);
 		}
-		pos++;
+		entry->error_page_len = len;
 	}
-	return NULL;	// Not found
+	status_ready = 1;
 }
 
 /**
- * @brief Create HTTP header
- * @details Creates new \ref http_header with given name and value
- * 
- * @param name Header name
- * @param value Header value
- * 
- * @return New HTTP header or NULL on error
+ * @brief Get HTTP status entry
+ * @details Gets corresponding status entry for status code by indexing
+ *
+ * @param status Status code
+ * @return Status entry or NULL on error
  */
-http_header * http_header_create(char *name, char *value) {
-	if (name == NULL || value == NULL) return NULL;
-
-	http_header *h = calloc(1, sizeof(http_header));
-	h->name = strdup(name);
-	h->value = strdup(value);
-
-	return h;
+http_status_entry * http_status_get_entry(unsigned int status) {
+	if (!status_ready) http_status_init();
+	if (status > HTTP_STATUS_CODE_MAX || status_index[status] == 0) return NULL;	// Not found
+	return &status_entries[status_index[status] - 1];
 }
 
 /**
- * @brief Free HTTP header
- * @details Frees \ref http_header
+ * @brief Initialize HTTP request
+ * @details Initializes \ref http_request to an empty request
  * 
- * @param header HTTP header to free
+ * @param req Request to initialize
  */
-void http_header_free(http_header *header) {
-	free(header->name);
-	free(header->value);
-	free(header);
-}
-
-/**
- * @brief Create new HTTP request
- * @details Creates new \ref http_request
- * @return New \ref http_request or NULL on error
- */
-http_request * http_request_create() {
-	http_request *req = calloc(1, sizeof(http_request));
-	if (req == NULL) return NULL;
+void http_request_init(http_request *req) {
 	req->method = NULL;
 	req->path = NULL;
 	req->query_str = NULL;
 	req->payload = NULL;
-	req->header_count = 0;
+	req->keep_alive = 0;
 	req->payload_len = 0;
-	req->_header_cap = 1;
-	req->headers = calloc(req->_header_cap, sizeof(http_header*));
-	if (req->headers == NULL) {
-		free(req);
-		return NULL;
-	}
-
-	return req;
+	http_header_list_init(&req->headers);
 }
 
 /**
- * @brief Create new HTTP request
- * @details Creates new \ref http_request with method and path
+ * @brief Clear HTTP request
+ * @details Resets initialized \ref http_request to an empty request. The strings point to
+ *          the parsed buffer, only the memory of a long header list is freed.
  * 
- * @param method Request method (e.g. GET, POST, PUT, ...)
- * @param path Request path (e.g. "/", "/foo/bar.html")
- * @param query Request query string (e.g. "foo=bar&val=baz&c=3")
- * 
- * @return New \ref http_request or NULL on error
+ * @param req Request to clear
  */
-http_request * http_request_create2(char *method, char *path, char *query) {
-	if (method == NULL || path == NULL) return NULL;
-	
-	http_request *req = calloc(1, sizeof(http_request));
-	req->method = strdup(method);
-	req->path = strdup(path);
-	if (query != NULL) {
-		req->query_str = strdup(query);
-	} else {
-		req->query_str = NULL;
-	}
-	req->payload = NULL;
-	req->header_count = 0;
-	req->payload_len = 0;
-	req->_header_cap = 1;
-	req->headers = calloc(req->_header_cap, sizeof(http_header*));
-
-	return req;
+void http_request_clear(http_request *req) {
+	http_header_list_clear(&req->headers);
+	http_request_init(req);
 }
 
 /**
  * @brief Add header to HTTP request
- * @details Adds given \ref http_header to the given \ref http_request
+ * @details Adds given \ref http_header to the given \ref http_request.
+ *          The header strings aren't copied.
  * 
  * @param req Request to use
  * @param header Header to add
@@ -135,24 +116,16 @@ http_request * http_request_create2(char *method, char *path, char *query) {
  * @return 0 on success, < 0 on error
  */
 int http_request_add_header(http_request *req, http_header *header) {
-	// Copy header
-	http_header *new_header = http_header_create(header->name, header->value);
-	if (new_header == NULL) {
+	if (req->headers.count == HTTP_REQUEST_MAX_HEADERS) {
 		return ERROR_HEADER_CREATE_FAILED;
 	}
-	if (req->header_count + 1 > req->_header_cap) {
-		// Realloc headers
-		req->_header_cap *= 2;
-		req->headers = realloc(req->headers, req->_header_cap * sizeof(http_header*));
-	}
-	req->headers[req->header_count++] = new_header;
-
-	return 0;
+	return http_header_list_add_view(&req->headers, header);
 }
 
 /**
  * @brief Add header to HTTP request
- * @details Adds a new \ref http_header to the given \ref http_request
+ * @details Adds a new \ref http_header to the given \ref http_request.
+ *          The strings aren't copied and must stay valid while the request is used.
  * 
  * @param req Request to use
  * @param header_name New header name
@@ -160,13 +133,13 @@ int http_request_add_header(http_request *req, http_header *header) {
  * @return 0 on success, < 0 on error
  */
 int http_request_add_header2(http_request *req, char *header_name, char *header_value) {
-	http_header *header = http_header_create(header_name, header_value);
-	if (header == NULL) return ERROR_HEADER_CREATE_FAILED;
-	// This wastes memory (because http_request_add_header copies the http_header), but works for now
-	// TODO: Redo
-	int ret = http_request_add_header(req, header);
-	http_header_free(header);
-	return ret;
+	http_header header = {
+		.name = (char *)header_name,
+		.value = (char *)header_value,
+		.name_len = strlen(header_name),
+		.value_len = strlen(header_value)
+	};
+	return http_request_add_header(req, &header);
 }
 
 /**
@@ -179,29 +152,20 @@ int http_request_add_header2(http_request *req, char *header_name, char *header_
  * @return Pointer to the header or NULL if not found
  */
 http_header * http_request_get_header(http_request *req, char *header_name) {
-	http_header *h_tmp = NULL;
-	// Convert "needle" name to lowercase
-	char *header_name_needle_lower = string_to_lowercase(header_name);
-	// Loop through headers
-	for (size_t i = 0; i < req->header_count; i++) {
-		http_header *h = req->headers[i];
-		// Convert current header name to lowercase
-		char *header_name_lower = string_to_lowercase(h->name);
-		if (strcmp(header_name_needle_lower, header_name_lower) == 0) {
-			// Found
-			h_tmp = h;
-			free(header_name_lower);
-			break;
-		}
-		free(header_name_lower);
-	}
-	free(header_name_needle_lower);
-	if (h_tmp != NULL) {
-		// Header found, return
-		return h_tmp;
-	}
-	// No match
-	return NULL;
+	return http_header_list_get(&req->headers, header_name);
+}
+
+/**
+ * @brief Get well-known header from request
+ * @details Gets the header from its slot without comparing names
+ * 
+ * @param req Request to use
+ * @param id Header identifier
+ * 
+ * @return Pointer to the header or NULL if not found
+ */
+http_header * http_request_get_known_header(http_request *req, http_header_id id) {
+	return http_header_list_get_known(&req->headers, id);
 }
 
 /**
@@ -214,19 +178,7 @@ http_header * http_request_get_header(http_request *req, char *header_name) {
  * @return 1 if header exists, 0 otherwise
  */
 int http_request_header_exists(http_request *req, char *header_name) {
-	char *name = string_to_lowercase(header_name);
-	for (size_t i = 0; i < req->header_count; i++) {
-		http_header *h = req->headers[i];
-		char *cur_name = string_to_lowercase(h->name);
-		if (strcmp(cur_name, name) == 0) {
-			free(cur_name);
-			free(name);
-			return 1;	// True
-		}
-		free(cur_name);
-	}
-	free(name);
-	return 0;	// False
+	return http_request_get_header(req, header_name) != NULL;
 }
 
 /**
@@ -234,59 +186,377 @@ int http_request_header_exists(http_request *req, char *header_name) {
  * @details Removes headers by name from the given \ref http_request
  * 
  * @param req Request to use
- * @param header_name Name of the header to remove
+ * @param header_name Name of the header to remove, case insensitive
  * 
  * @return Count of removed headers or < 0 on error
  */
 int http_request_remove_header(http_request *req, char *header_name) {
-	// Create new header list
-	http_header **list = calloc(req->_header_cap, sizeof(http_header*));	// TODO: Decrement _header_cap if needed to save memory
-	// Go through the header list and find header with given name
-	int found_count = 0;
-	size_t a = 0;
-	for (size_t i = 0; i < req->header_count; i++) {
-		http_header *h = req->headers[i];
-		if (strcmp(h->name, header_name) == 0) {
-			// Match!
-			http_header_free(h);
-			found_count++;
+	return http_header_list_remove(&req->headers, header_name);
+}
+
+/**
+ * @brief Format entity tag
+ * @details Creates a strong ETag from the identity, size and modification time of a file,
+ *          so edits within the same second still change it
+ * 
+ * @param ino Inode of the file
+ * @param size File size
+ * @param mtime Modification time with nanoseconds
+ * @param[out] out Buffer of at least #HTTP_ETAG_MAX bytes, null-terminated
+ * @return Length of the ETag, quotes included
+ */
+size_t http_etag_format(ino_t ino, off_t size, const struct timespec *mtime, char *out) {
+	return snprintf(out, HTTP_ETAG_MAX, "\"%lx-%lx-%lx.%lx\"",
+		(unsigned long)ino, (unsigned long)size, (unsigned long)mtime->tv_sec, (unsigned long)mtime->tv_nsec);
+}
+
+/**
+ * @brief Match entity tag list
+ * @details Checks if the comma-separated list of If-Match or If-None-Match contains \p etag or "*".
+ *          Malformed list members are skipped.
+ * 
+ * @param list Header value
+ * @param len Length of \p list
+ * @param etag Strong ETag of the resource, quotes included
+ * @param weak Use weak comparison (ignore "W/"), see RFC 7232 Section 2.3.2
+ * @return 1 if matched, 0 otherwise
+ */
+static int etag_list_matches(const char *list, size_t len, const char *etag, int weak) {
+	size_t etag_len = strlen(etag);
+	size_t i = 0;
+	while (i < len) {
+		// Skip separators and whitespace
+		if (list[i] == ',' || list[i] == ' ' || list[i] == '\t') {
+			i++;
+			continue;
+		}
+		if (list[i] == '*') return 1;
+
+		int is_weak = 0;
+		if (i + 1 < len && list[i] == 'W' && list[i+1] == '/') {
+			is_weak = 1;
+			i += 2;
+		}
+		if (i < len && list[i] == '"') {
+			const char *end = memchr(&list[i+1], '"', len - i - 1);
+			if (end == NULL) return 0;	// Unterminated tag
+			size_t tag_len = end - &list[i] + 1;
+			if ((weak || !is_weak) && tag_len == etag_len && memcmp(&list[i], etag, etag_len) == 0) return 1;
+			i += tag_len;
 		} else {
-			// Move the pointer to the list
-			list[a++] = h;
+			// Malformed, continue from the next member
+			const char *next = memchr(&list[i], ',', len - i);
+			if (next == NULL) return 0;
+			i = next - list;
 		}
 	}
-	if (found_count > 0) {
-		// Free old list
-		free(req->headers);
-		req->header_count = a;
-		// Change reponse headers to point to the created list
-		req->headers = list;
-		return found_count;
-	} else {
-		// Not found, free created list
-		free(list);
-		return -1;
+	return 0;
+}
+
+/**
+ * @brief Parse date header
+ *
+ * @param req Request
+ * @param id Header to parse
+ * @param[out] t Parsed time
+ * @return 1 if the header exists and has a valid date, 0 otherwise
+ */
+static int get_date_header(http_request *req, http_header_id id, time_t *t) {
+	http_header *h = http_request_get_known_header(req, id);
+	// Invalid dates are ignored, see RFC 7232 Section 3.3
+	return h != NULL && http_date_parse(h->value, h->value_len, t) == 0;
+}
+
+/**
+ * @brief Evaluate request preconditions
+ * @details Evaluates If-Match, If-Unmodified-Since, If-None-Match and If-Modified-Since
+ *          in the order of RFC 7232 Section 6
+ * 
+ * @param req Request
+ * @param etag Strong ETag of the resource
+ * @param last_modified Modification time of the resource
+ * @return 0 to respond normally, 304 for "304 Not Modified" or 412 for "412 Precondition Failed"
+ */
+int http_request_check_preconditions(http_request *req, const char *etag, time_t last_modified) {
+	int get_or_head = strcmp(req->method, METHOD_GET) == 0 || strcmp(req->method, METHOD_HEAD) == 0;
+	time_t t;
+
+	http_header *if_match = http_request_get_known_header(req, HTTP_HEADER_IF_MATCH);
+	if (if_match != NULL) {
+		if (!etag_list_matches(if_match->value, if_match->value_len, etag, 0)) return 412;
+	} else if (get_date_header(req, HTTP_HEADER_IF_UNMODIFIED_SINCE, &t) && last_modified > t) {
+		return 412;
+	}
+
+	http_header *if_none_match = http_request_get_known_header(req, HTTP_HEADER_IF_NONE_MATCH);
+	if (if_none_match != NULL) {
+		if (etag_list_matches(if_none_match->value, if_none_match->value_len, etag, 1)) return get_or_head ? 304 : 412;
+	} else if (get_or_head && get_date_header(req, HTTP_HEADER_IF_MODIFIED_SINCE, &t) && last_modified <= t) {
+		return 304;
 	}
+
+	return 0;
 }
 
 /**
- * @brief Free HTTP request
- * @details Frees \ref http_request
- * 
- * @param req Request to free
+ * @brief Evaluate If-Range
+ * @details Checks if the Range of the request may be applied, see RFC 7233 Section 3.2.
+ *          An entity tag must match strongly and a date exactly.
+ * 
+ * @param req Request
+ * @param etag Strong ETag of the resource
+ * @param last_modified Modification time of the resource
+ * @return 1 if there's no If-Range or it matches, 0 if the whole resource should be sent
+ */
+int http_request_if_range_matches(http_request *req, const char *etag, time_t last_modified) {
+	http_header *h = http_request_get_known_header(req, HTTP_HEADER_IF_RANGE);
+	if (h == NULL) return 1;
+	if (h->value_len > 0 && h->value[0] == '"') {
+		return h->value_len == strlen(etag) && memcmp(h->value, etag, h->value_len) == 0;
+	}
+	if (h->value_len > 1 && h->value[0] == 'W' && h->value[1] == '/') return 0;	// Weak tags never match
+	time_t t;
+	return get_date_header(req, HTTP_HEADER_IF_RANGE, &t) && t == last_modified;
+}
+
+/**
+ * @brief Parse byte position
+ *
+ * @param str Digits
+ * @param len Length of \p str
+ * @param[out] out Parsed value
+ * @return 0 on success, < 0 if \p str isn't a number or overflows
+ */
+static int parse_byte_pos(const char *str, size_t len, off_t *out) {
+	if (len == 0) return -1;
+	off_t v = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (str[i] < '0' || str[i] > '9') return -1;
+		if (v > (INT64_MAX - 9) / 10) return -1;
+		v = v * 10 + (str[i] - '0');
+	}
+	*out = v;
+	return 0;
+}
+
+/**
+ * @brief Get byte ranges
+ * @details Parses the Range header of the request, see RFC 7233 Section 2.1.
+ *          Unsatisfiable ranges are left out, the rest are clamped to the resource size.
+ * 
+ * @param req Request
+ * @param size Size of the resource
+ * @param[out] ranges Satisfiable ranges in request order
+ * @param max Size of \p ranges, requests with more ranges get the whole resource
+ * @return Count of \p ranges, 0 if none are satisfiable or < 0 if the whole resource should be sent
+ */
+int http_request_get_ranges(http_request *req, off_t size, http_byte_range *ranges, int max) {
+	http_header *h = http_request_get_known_header(req, HTTP_HEADER_RANGE);
+	if (h == NULL || h->value_len < 6 || strncasecmp(h->value, "bytes=", 6) != 0) return -1;
+
+	int count = 0;
+	int specs = 0;
+	const char *p = h->value + 6;
+	const char *end = h->value + h->value_len;
+	while (p < end) {
+		// Get the next comma-separated range spec without whitespace
+		const char *spec_end = memchr(p, ',', end - p);
+		if (spec_end == NULL) spec_end = end;
+		const char *q = spec_end;
+		while (p < q && (*p == ' ' || *p == '\t')) p++;
+		while (q > p && (q[-1] == ' ' || q[-1] == '\t')) q--;
+		const char *dash = memchr(p, '-', q - p);
+
+		if (p == q) {
+			// Empty list element
+		} else if (dash == NULL) {
+			return -1;
+		} else {
+			off_t first, last;
+			int satisfiable;
+			if (dash == p) {
+				// Suffix range "-N", the last N bytes
+				if (parse_byte_pos(dash + 1, q - dash - 1, &last) < 0) return -1;
+				satisfiable = last > 0 && size > 0;
+				first = last < size ? size - last : 0;
+				last = size - 1;
+			} else {
+				// "A-B" or "A-"
+				if (parse_byte_pos(p, dash - p, &first) < 0) return -1;
+				if (dash + 1 == q) {
+					last = size - 1;
+				} else {
+					if (parse_byte_pos(dash + 1, q - dash - 1, &last) < 0 || last < first) return -1;
+					if (last >= size) last = size - 1;
+				}
+				satisfiable = first < size;
+			}
+			if (++specs > max) return -1;
+			if (satisfiable) {
+				ranges[count].first = first;
+				ranges[count].last = last;
+				count++;
+			}
+		}
+		p = spec_end + 1;
+	}
+	return specs > 0 ? count : -1;
+}
+
+/**
+ * Content codings of precompressed files in preference order, see #HTTP_ENCODING_COUNT
+ */
+static const struct {
+	const char *name;	/**< Content-Encoding value */
+	const char *suffix;	/**< File name suffix of the precompressed file */
+} content_codings[HTTP_ENCODING_COUNT] = {
+	{"br",   ".br"},
+	{"zstd", ".zst"},
+	{"gzip", ".gz"}
+};
+
+/**
+ * @brief Get content coding index
+ *
+ * @param encoding One of the HTTP_ENCODING_* flags
+ * @return Index in #content_codings or -1 if \p encoding isn't a single known flag
  */
-void http_request_free(http_request *req) {
-	if (req == NULL) return;
-	if (req->method != NULL) free(req->method);
-	if (req->path != NULL) free(req->path);
-	if (req->query_str != NULL) free(req->query_str);
-	if (req->payload != NULL) free(req->payload);
-	// Free headers
-	for (size_t i = 0; i < req->header_count; i++) {
-		http_header_free(req->headers[i]);
+static int encoding_index(int encoding) {
+	for (int i = 0; i < HTTP_ENCODING_COUNT; i++) {
+		if (encoding == 1 << i) return i;
 	}
-	free(req->headers);
-	free(req);
+	return -1;
+}
+
+/**
+ * @brief Get content coding name
+ *
+ * @param encoding One of the HTTP_ENCODING_* flags
+ * @return Content-Encoding value or NULL if \p encoding is unknown
+ */
+const char * http_encoding_name(int encoding) {
+	int i = encoding_index(encoding);
+	return i >= 0 ? content_codings[i].name : NULL;
+}
+
+/**
+ * @brief Get precompressed file suffix
+ *
+ * @param encoding One of the HTTP_ENCODING_* flags
+ * @return Suffix added to the file name, NULL if \p encoding is unknown
+ */
+const char * http_encoding_suffix(int encoding) {
+	int i = encoding_index(encoding);
+	return i >= 0 ? content_codings[i].suffix : NULL;
+}
+
+/**
+ * @brief Strip precompressed file suffix
+ *
+ * @param name File name or path
+ * @param len Length of \p name
+ * @return Length of \p name without a precompressed file suffix, \p len if it has none
+ */
+size_t http_encoding_strip_suffix(const char *name, size_t len) {
+	for (int i = 0; i < HTTP_ENCODING_COUNT; i++) {
+		size_t suffix_len = strlen(content_codings[i].suffix);
+		if (len > suffix_len && memcmp(name + len - suffix_len, content_codings[i].suffix, suffix_len) == 0) {
+			return len - suffix_len;
+		}
+	}
+	return len;
+}
+
+/**
+ * @brief Parse quality value
+ * @details Parses the weight of an Accept-Encoding element, see RFC 7231 Section 5.3.1
+ *
+ * @param str Value after "q="
+ * @param len Length of \p str
+ * @return Weight in thousandths, 0 if \p str is malformed
+ */
+static int parse_qvalue(const char *str, size_t len) {
+	if (len == 0 || (str[0] != '0' && str[0] != '1')) return 0;
+	int q = (str[0] - '0') * 1000;
+	if (len == 1) return q;
+	if (str[1] != '.' || len > 5) return 0;
+	int scale = 100;
+	for (size_t i = 2; i < len; i++, scale /= 10) {
+		if (str[i] < '0' || str[i] > '9') return 0;
+		q += (str[i] - '0') * scale;
+	}
+	return q > 1000 ? 0 : q;
+}
+
+/**
+ * @brief Choose content coding
+ * @details Picks the coding the Accept-Encoding header of the request weighs highest of
+ *          \p available, the server preference breaks ties. Codings with weight 0 aren't accepted.
+ *
+ * @param req Request
+ * @param available HTTP_ENCODING_* flags of the codings that can be sent
+ * @return Chosen HTTP_ENCODING_* flag or 0 if the content should be sent as is
+ */
+int http_request_choose_encoding(http_request *req, int available) {
+	http_header *h = http_request_get_known_header(req, HTTP_HEADER_ACCEPT_ENCODING);
+	if (h == NULL || available == 0) return 0;
+
+	int weights[HTTP_ENCODING_COUNT];
+	for (int i = 0; i < HTTP_ENCODING_COUNT; i++) weights[i] = -1;	// Not mentioned
+	int any_weight = -1;
+
+	const char *p = h->value;
+	const char *end = h->value + h->value_len;
+	while (p < end) {
+		const char *elem_end = memchr(p, ',', end - p);
+		if (elem_end == NULL) elem_end = end;
+
+		// Coding name up to the parameters
+		while (p < elem_end && (*p == ' ' || *p == '\t')) p++;
+		const char *name = p;
+		while (p < elem_end && *p != ';' && *p != ' ' && *p != '\t') p++;
+		size_t name_len = p - name;
+
+		// Weight from the "q" parameter
+		int weight = 1000;
+		const char *param = memchr(p, ';', elem_end - p);
+		while (param != NULL) {
+			param++;
+			while (param < elem_end && (*param == ' ' || *param == '\t')) param++;
+			const char *param_end = memchr(param, ';', elem_end - param);
+			const char *value_end = param_end != NULL ? param_end : elem_end;
+			while (value_end > param && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+			if (value_end - param >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+				weight = parse_qvalue(param + 2, value_end - param - 2);
+			}
+			param = param_end;
+		}
+
+		if (name_len == 1 && name[0] == '*') {
+			any_weight = weight;
+		} else if (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0) {
+			weights[encoding_index(HTTP_ENCODING_GZIP)] = weight;
+		} else {
+			for (int i = 0; i < HTTP_ENCODING_COUNT; i++) {
+				if (name_len == strlen(content_codings[i].name) && strncasecmp(name, content_codings[i].name, name_len) == 0) {
+					weights[i] = weight;
+				}
+			}
+		}
+		p = elem_end + 1;
+	}
+
+	int chosen = 0;
+	int chosen_weight = 0;
+	for (int i = 0; i < HTTP_ENCODING_COUNT; i++) {
+		if (!(available & (1 << i))) continue;
+		int weight = weights[i] >= 0 ? weights[i] : (any_weight >= 0 ? any_weight : 0);
+		if (weight > chosen_weight) {
+			chosen = 1 << i;
+			chosen_weight = weight;
+		}
+	}
+	return chosen;
 }
 
 /**
@@ -297,25 +567,45 @@ void http_request_free(http_request *req) {
  * @return New \ref http_response or NULL on error
  */
 http_response * http_response_create(unsigned int status) {
-	http_response *resp = calloc(1, sizeof(http_response));
+	return http_response_create2(status, NULL);
+}
+
+/**
+ * @brief Create HTTP response
+ * @details Creates new \ref http_response with given status. With an arena the response,
+ *          its copied content and its rendered head are allocated from the arena, so they
+ *          stay valid only until the arena is reset.
+ * 
+ * @param status HTTP status code
+ * @param a Arena to allocate from or NULL to use malloc()
+ * @return New \ref http_response or NULL on error
+ */
+http_response * http_response_create2(unsigned int status, arena *a) {
+	http_response *resp = a != NULL ? arena_alloc(a, sizeof(http_response)) : malloc(sizeof(http_response));
+	if (resp == NULL) return NULL;
 	resp->method = NULL;
 	resp->fs_path = NULL;
 	resp->status = status;
 	resp->content_length = 0;
 	resp->content = NULL;
-	resp->_header_cap = 1;
-	resp->header_count = 0;
 	resp->keep_alive = 0;
 	resp->no_payload = 0;
-	resp->if_mod_since_time = 0;
-	resp->headers = calloc(resp->_header_cap, sizeof(http_header*));
+	resp->last_modified = -1;
+	resp->_head = NULL;
+	resp->_head_len = 0;
+	resp->_status_line = NULL;
+	resp->_status_len = 0;
+	resp->_conn_offset = 0;
+	resp->_arena = a;
+	resp->_free_content = 0;
+	http_header_list_init(&resp->headers);
 
 	return resp;
 }
 
 /**
  * @brief Add header to HTTP response
- * @details Adds given \ref http_header to the given \ref http_response
+ * @details Adds a copy of given \ref http_header to the given \ref http_response
  * 
  * @param resp Response to use
  * @param header Header to add
@@ -323,38 +613,26 @@ http_response * http_response_create(unsigned int status) {
  * @return 0 on success, < 0 on error
  */
 int http_response_add_header(http_response *resp, http_header *header) {
-	// Copy header
-	http_header *new_header = http_header_create(header->name, header->value);
-	if (new_header == NULL) {
-		return ERROR_HEADER_CREATE_FAILED;
-	}
-	if (resp->header_count + 1 > resp->_header_cap) {
-		// Realloc headers
-		resp->_header_cap *= 2;
-		resp->headers = realloc(resp->headers, resp->_header_cap * sizeof(http_header*));
-	}
-	resp->headers[resp->header_count++] = new_header;
-
-	return 0;
+	return http_header_list_add(&resp->headers, header);
 }
 
 /**
  * @brief Add header to HTTP response
- * @details Adds a new \ref http_header to the given \ref http_response
+ * @details Adds a new \ref http_header to the given \ref http_response, the strings are copied
  * 
  * @param resp Response to use
  * @param header_name New header name
  * @param header_value New header value
  * @return 0 on success, < 0 on error
  */
-int http_response_add_header2(http_response *resp, char *header_name, char *header_value) {
-	http_header *header = http_header_create(header_name, header_value);
-	if (header == NULL) return ERROR_HEADER_CREATE_FAILED;
-	// This wastes memory (because http_request_add_header copies the http_header), but works for now
-	// TODO: Redo
-	int ret = http_response_add_header(resp, header);
-	http_header_free(header);
-	return ret;
+int http_response_add_header2(http_response *resp, const char *header_name, const char *header_value) {
+	http_header header = {
+		.name = (char *)header_name,
+		.value = (char *)header_value,
+		.name_len = strlen(header_name),
+		.value_len = strlen(header_value)
+	};
+	return http_response_add_header(resp, &header);
 }
 
 /**
@@ -367,29 +645,20 @@ int http_response_add_header2(http_response *resp, char *header_name, char *head
  * @return Pointer to the header or NULL if not found
  */
 http_header * http_response_get_header(http_response *resp, char *header_name) {
-	http_header *h_tmp = NULL;
-	// Convert "needle" name to lowercase
-	char *header_name_needle_lower = string_to_lowercase(header_name);
-	// Loop through headers
-	for (size_t i = 0; i < resp->header_count; i++) {
-		http_header *h = resp->headers[i];
-		// Convert current header name to lowercase
-		char *header_name_lower = string_to_lowercase(h->name);
-		if (strcmp(header_name_needle_lower, header_name_lower) == 0) {
-			// Found
-			h_tmp = h;
-			free(header_name_lower);
-			break;
-		}
-		free(header_name_lower);
-	}
-	free(header_name_needle_lower);
-	if (h_tmp != NULL) {
-		// Header found, return
-		return h_tmp;
-	}
-	// No match
-	return NULL;
+	return http_header_list_get(&resp->headers, header_name);
+}
+
+/**
+ * @brief Get well-known header from response
+ * @details Gets the header from its slot without comparing names
+ * 
+ * @param resp Response to use
+ * @param id Header identifier
+ * 
+ * @return Pointer to the header or NULL if not found
+ */
+http_header * http_response_get_known_header(http_response *resp, http_header_id id) {
+	return http_header_list_get_known(&resp->headers, id);
 }
 
 /**
@@ -402,19 +671,7 @@ http_header * http_response_get_header(http_response *resp, char *header_name) {
  * @return 1 if header exists, 0 otherwise
  */
 int http_response_header_exists(http_response *resp, char *header_name) {
-	char *name = string_to_lowercase(header_name);
-	for (size_t i = 0; i < resp->header_count; i++) {
-		http_header *h = resp->headers[i];
-		char *cur_name = string_to_lowercase(h->name);
-		if (strcmp(cur_name, name) == 0) {
-			free(cur_name);
-			free(name);
-			return 1;	// True
-		}
-		free(cur_name);
-	}
-	free(name);
-	return 0;	// False
+	return http_response_get_header(resp, header_name) != NULL;
 }
 
 /**
@@ -422,47 +679,22 @@ int http_response_header_exists(http_response *resp, char *header_name) {
  * @details Removes headers by name from the given \ref http_response
  * 
  * @param resp Response to use
- * @param header_name Name of the header to remove
+ * @param header_name Name of the header to remove, case insensitive
  * 
  * @return Count of removed headers or < 0 on error
  */
 int http_response_remove_header(http_response *resp, char *header_name) {
-	// Create new header list
-	http_header **list = calloc(resp->_header_cap, sizeof(http_header*));	// TODO: Decrement _header_cap if needed to save memory
-	// Go through the header list and find header with given name
-	int found_count = 0;
-	size_t a = 0;
-	for (size_t i = 0; i < resp->header_count; i++) {
-		http_header *h = resp->headers[i];
-		if (strcmp(h->name, header_name) == 0) {
-			// Match!
-			http_header_free(h);
-			found_count++;
-		} else {
-			// Move the pointer to the list
-			list[a++] = h;
-		}
-	}
-	if (found_count > 0) {
-		// Free old list
-		free(resp->headers);
-		resp->header_count = a;
-		// Change reponse headers to point to the created list
-		resp->headers = list;
-		return found_count;
-	} else {
-		// Not found, free created list
-		free(list);
-		return -1;
-	}
+	return http_header_list_remove(&resp->headers, header_name);
 }
 
 /**
  * @brief Set HTTP response content
- * @details Copies data from \p content to the response content
+ * @details Copies data from \p content to the response content. With #CONTENT_TAKE_OWNERSHIP
+ *          the response uses \p content as is and frees it with the response instead,
+ *          with #CONTENT_STATIC it uses \p content as is and never frees it.
  * 
  * @param resp Response to use
- * @param content Content to copy
+ * @param content Content to copy, allocated with malloc() if #CONTENT_TAKE_OWNERSHIP is set
  * @param content_len Size of \p content
  * @param flags #SET_CONTENT_FLAGS
  * @return Content length if successful, < 0 otherwise
@@ -473,18 +705,37 @@ int http_response_set_content2(http_response *resp, unsigned const char *content
 
 	// content can be NULL if the given length is 0
 	// If the content_len is 0, reset content
+	if (resp->_free_content) free(resp->content);
+	resp->_free_content = 0;
 	if (content_len == 0) {
-		if (resp->content != NULL) free(resp->content);
+		if ((flags & CONTENT_TAKE_OWNERSHIP) == CONTENT_TAKE_OWNERSHIP) free((unsigned char *)content);
 		resp->content = NULL;
 		resp->content_length = 0;
 		return 0;
 	}
-	// Copy to the response content
-	resp->content = calloc(content_len, sizeof(char));
+	if ((flags & CONTENT_TAKE_OWNERSHIP) == CONTENT_TAKE_OWNERSHIP) {
+		// Use as is, no copying
+		resp->content = (unsigned char *)content;
+		resp->_free_content = 1;
+	} else if ((flags & CONTENT_STATIC) == CONTENT_STATIC) {
+		resp->content = (unsigned char *)content;
+	} else {
+		// Copy to the response content
+		if (resp->_arena != NULL) {
+			resp->content = arena_alloc(resp->_arena, content_len);
+		} else {
+			resp->content = malloc(content_len);
+			resp->_free_content = 1;
+		}
+		if (resp->content == NULL) {
+			resp->_free_content = 0;
+			resp->content_length = 0;
+			return ERROR_RESPONSE_ARGUMENT;
+		}
+		memcpy(resp->content, content, content_len);
+	}
 	resp->content_length = content_len;
 
-	memcpy(resp->content, content, content_len);
-
 	// Handle flags
 	if ((flags & CONTENT_SET_CONTENT_TYPE) == CONTENT_SET_CONTENT_TYPE) {
 		// We should also set Content-Type -header
@@ -492,16 +743,14 @@ int http_response_set_content2(http_response *resp, unsigned const char *content
 		http_response_remove_header(resp, "Content-Type");
 
 		// Get Content-Type string (which may contain charset)
-		char *content_type;
-		if (libmagic_get_mimetype(content, content_len, &content_type) < 0) {
+		const char *content_type = mime_type_by_buffer(content, content_len);
+		if (content_type == NULL) {
 			return ERROR_RESPONSE_SET_CONTENT_TYPE_FAILED;
 		}
 		zhttpd_log(LOG_DEBUG, "Detected Content-Type: %s", content_type);
 		if (http_response_add_header2(resp, "Content-Type", content_type) < 0) {
-			free(content_type);
 			return ERROR_RESPONSE_SET_CONTENT_TYPE_FAILED;
 		}
-		free(content_type);
 	}
 
 	return resp->content_length;
@@ -523,214 +772,205 @@ int http_response_set_content(http_response *resp, unsigned const char *content,
 
 /**
  * @brief Free \ref http_response
- * @details Frees \ref http_response and its members.
+ * @details Frees \ref http_response and its members. Memory from the response arena is
+ *          left for the arena reset.
  * 
  * @param resp Response to free
  */
 void http_response_free(http_response *resp) {
 	if (resp == NULL) return;
+	if (resp->_free_content) free(resp->content);
+	http_header_list_clear(&resp->headers);
+	if (resp->_arena != NULL) return;
 	if (resp->method != NULL) free(resp->method);
 	if (resp->fs_path != NULL) free(resp->fs_path);
-	if (resp->content != NULL) free(resp->content);
-	// Free headers
-	for (size_t i = 0; i < resp->header_count; i++) {
-		http_header_free(resp->headers[i]);
-	}
-	free(resp->headers);
+	if (resp->_head != NULL) free(resp->_head);
 	free(resp);
 }
 
 /**
- * @brief Create response start
- * @details Outputs HTTP status line and headers
+ * @brief Create response head
+ * @details Renders HTTP status line and headers to \p _head of the response
  * 
  * @param resp Response to use
- * @param[out] out Pointer to non-allocated memory where the result string will be stored
  * 
- * @return Length of \p out or < 0 on error
+ * @return Length of the head or < 0 on error
  */
-int http_response_get_start_string(http_response *resp, char **out) {
+static int http_response_build_head(http_response *resp) {
 	if (resp == NULL) return ERROR_RESPONSE_ARGUMENT;
 	
-	// Handle status code
-	int code = resp->status;
-
-	char *err_msg = NULL;
-	char *reason = NULL;
-
-	// Get reason string & error message
-	http_status_entry *status_entry;
-	status_entry = http_status_get_entry(code);
-	if (status_entry == NULL) {
-		// No entry, create 501 Not Implemented
-		code = 501;
-		reason = "Not Implemented";
-		err_msg = "Sorry, the server doesn't know how to handle the request.";
-	} else {
-		err_msg = status_entry->err_msg;
-		reason = status_entry->reason;
-	}
-
-	// On status != 200, add default error response content
-	if (code != 200) {
-		char *resp_html;
-		int c_len = asprintf(&resp_html,
-			"<!DOCTYPE html><html><head>\n \
-			<title>%d %s</title>\n \
-			</head><body>\n \
-			<h1>%d %s</h1>\n \
-			<p>%s<br /></p>\n \
-			<hr>\n \
-			<address>%s on port %d</address>\n</body></html>\n",
-			code, reason, code, reason, err_msg, SERVER_IDENT, LISTEN_PORT
-		);
-		http_response_set_content(resp, (unsigned char *)resp_html, c_len);
-		free(resp_html);
-
-	} else {
-		// 200 OK
-		reason = "OK";
-	}
-
-	time_t last_mtime = -1;
-	struct tm *last_mtime_tm = NULL;
-	// Get file mtime
-	struct stat f_stat;
-	if (resp->fs_path != NULL && stat(resp->fs_path, &f_stat) == 0) {
-		last_mtime = f_stat.st_mtime;
-		last_mtime_tm = gmtime(&last_mtime);
-	}
-
-	// Check if the request had If-Modified-Since (only check if using GET or HEAD)
-	if ((strcmp(resp->method, METHOD_GET) == 0 || strcmp(resp->method, METHOD_HEAD) == 0) &&
-		resp->if_mod_since_time > 0 && resp->fs_path != NULL) {
-
-		double diff = difftime(last_mtime, resp->if_mod_since_time);
-		if (diff <= 0) {
-			// File hasn't been modified since given date
-			// Respond with "304 Not Modified" without response body
-			status_entry = http_status_get_entry(304);
-			reason = status_entry->reason;
-			code = 304;
-			resp->no_payload = 1;	// Don't add message body
+	// Get the status entry, unknown codes become "501 Not Implemented"
+	http_status_entry *status_entry = http_status_get_entry(resp->status);
+	if (status_entry == NULL) status_entry = http_status_get_entry(501);
+
+	// On error statuses, use the prepared error page as the content
+	if (status_entry->error_page != NULL) {
+		http_response_set_content2(resp, (unsigned char *)status_entry->error_page, status_entry->error_page_len, CONTENT_STATIC);
+		if (http_response_get_known_header(resp, HTTP_HEADER_CONTENT_TYPE) == NULL) {
+			if (http_response_add_header2(resp, "Content-Type", "text/html; charset=utf-8") < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
 		}
 	}
 
 	// Add Last-Modified
-	if (http_response_header_exists(resp, "Last-Modified") == 0 && resp->fs_path != NULL) {
+	if (http_response_get_known_header(resp, HTTP_HEADER_LAST_MODIFIED) == NULL && resp->last_modified != -1) {
 		// No header, add
-		if (last_mtime_tm != NULL) {
-			// Create "HTTP-date"
-			char http_date[60];
-			if (strftime(http_date, 60, HTTP_DATE_FORMAT, last_mtime_tm) < 0) {
-				zhttpd_log(LOG_ERROR, "Response Last-Modified strftime failed!");
-				perror("strftime");
-			} else {
-				// Success
-				if (http_response_add_header2(resp, "Last-Modified", http_date) < 0) {
-					zhttpd_log(LOG_ERROR, "Response Last-Modified header addition failed!");
-				}
-			}
+		// Create "HTTP-date"
+		char http_date[HTTP_DATE_LEN + 1];
+		http_date_format(resp->last_modified, http_date);
+		if (http_response_add_header2(resp, "Last-Modified", http_date) < 0) {
+			zhttpd_log(LOG_ERROR, "Response Last-Modified header addition failed!");
 		}
 	}
 
 	// Add Content-Length if needed
-	if (http_response_header_exists(resp, "Content-Length") == 0 && resp->no_payload == 0) {
-		char *len_str = calloc(10, sizeof(char));
-		snprintf(len_str, 10, "%lu", resp->content_length);
-		int cl_r = http_response_add_header2(resp, "Content-Length", len_str);
-		free(len_str);
-		if (cl_r < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
+	if (http_response_get_known_header(resp, HTTP_HEADER_CONTENT_LENGTH) == NULL && resp->no_payload == 0) {
+		char len_str[24];
+		snprintf(len_str, sizeof(len_str), "%lu", resp->content_length);
+		if (http_response_add_header2(resp, "Content-Length", len_str) < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
 	}
 
 	// Add Server
 	if (http_response_add_header2(resp, "Server", SERVER_IDENT) < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
 
-	// Add Date
-	char *date_str;
-	if (current_datetime_string(&date_str) < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
-	if (http_response_add_header2(resp, "Date", date_str) < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
-	free(date_str);
-
-	// Add Connection header
-	if (resp->keep_alive) {
-		if (http_response_add_header2(resp, "Connection", "keep-alive") < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
-	} else {
-		if (http_response_add_header2(resp, "Connection", "close") < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
-	}
-
 	// Add Content-Type if needed
-	if (http_response_header_exists(resp, "Content-Type") == 0 && resp->content != NULL) {
+	if (http_response_get_known_header(resp, HTTP_HEADER_CONTENT_TYPE) == NULL && resp->content != NULL) {
 		// No header, add
-		char *content_type;
-		if (libmagic_get_mimetype(resp->content, resp->content_length, &content_type) < 0) {
+		const char *content_type = mime_type_by_buffer(resp->content, resp->content_length);
+		if (content_type == NULL) {
 			return ERROR_RESPONSE_STRING_CREATE_FAILED;
 		}
 		if (http_response_add_header2(resp, "Content-Type", content_type) < 0) {
-			free(content_type);
 			return ERROR_RESPONSE_STRING_CREATE_FAILED;
 		}
-		free(content_type);
 	}
 
-	size_t used = 0;
-	size_t cap = 512;
-	*out = calloc(cap, sizeof(char));
-	used += snprintf(*out, cap, "HTTP/1.1 %d %s\r\n", code, reason);	// Status line
+	// Date and Connection are always the last headers, see http_response_get_prebuilt()
+	// Add Date, formatted once per second
+	if (http_response_add_header2(resp, "Date", http_date_now()) < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
 
-	// Add headers
-	for (size_t i = 0; i < resp->header_count; i++) {
-		http_header *h = resp->headers[i];
-		size_t row_len = strlen(h->name) + strlen(h->value) + 5;	// +5: ": " (2), "\r\n" (2), \0 (1)
-		while (used + row_len > cap) {
-			// Realloc
-			cap *= 2;
-			*out = realloc(*out, cap * sizeof(char));
-		}
-		used += snprintf(&((*out)[used]), cap - used, "%s: %s\r\n", h->name, h->value);
+	// Add Connection header
+	if (resp->keep_alive) {
+		if (http_response_add_header2(resp, "Connection", "keep-alive") < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
+	} else {
+		if (http_response_add_header2(resp, "Connection", "close") < 0) return ERROR_RESPONSE_STRING_CREATE_FAILED;
 	}
 
-	while (used + 2 + resp->content_length > cap) {	// +2: "\r\n"
-		// Realloc
-		cap *= 2;
-		*out = realloc(*out, cap * sizeof(char));
+	// Measure the headers to allocate them at once
+	size_t cap = 3;	// +3: "\r\n" and \0
+	for (size_t i = 0; i < resp->headers.count; i++) {
+		http_header *h = http_header_list_at(&resp->headers, i);
+		cap += h->name_len + h->value_len + 4;	// +4: ": " (2), "\r\n" (2)
 	}
-	used += snprintf(&((*out)[used]), cap - used, "\r\n");
 
-	// Realloc to fit
-	*out = realloc((*out), (used+1) * sizeof(char));
-	(*out)[used] = '\0';	// Null byte
+	if (resp->_arena == NULL && resp->_head != NULL) free(resp->_head);
+	resp->_head = NULL;
+	char *out = resp->_arena != NULL ? arena_alloc(resp->_arena, cap) : malloc(cap);
+	if (out == NULL) return ERROR_RESPONSE_STRING_CREATE_FAILED;
+	size_t used = 0;
+
+	// Add headers
+	for (size_t i = 0; i < resp->headers.count; i++) {
+		http_header *h = http_header_list_at(&resp->headers, i);
+		if (i == resp->headers.count - 1) resp->_conn_offset = used;
+		memcpy(&out[used], h->name, h->name_len);
+		used += h->name_len;
+		out[used++] = ':';
+		out[used++] = ' ';
+		memcpy(&out[used], h->value, h->value_len);
+		used += h->value_len;
+		out[used++] = '\r';
+		out[used++] = '\n';
+	}
+	out[used++] = '\r';
+	out[used++] = '\n';
+	out[used] = '\0';
+
+	resp->_head = out;
+	resp->_head_len = used;
+	resp->_status_line = status_entry->status_line;
+	resp->_status_len = status_entry->status_line_len;
 
 	return used;
 }
 
 /**
- * @brief Create response string
- * @details Creates raw response string for sending to the socket
+ * @brief Get response I/O vector
+ * @details Renders the response head and fills \p iov with the status line, the header block and
+ *          the possible body, for sending in one writev() without copying the body.
+ *          The vector points to memory owned by the response, so the response must stay alive
+ *          until the data has been sent. Headers are added while rendering, call only once.
  * 
  * @param resp Response to use
- * @param[out] out Non-allocated pointer where the result will be written
+ * @param[out] iov Vector of at least #HTTP_RESPONSE_IOV_COUNT entries
  * 
- * @return Length of \p out or < 0 if an error occurred
+ * @return Count of \p iov entries used or < 0 on error
  */
-int http_response_string(http_response *resp, char **out) {
-
-	char *tmp_out;
-	int used = http_response_get_start_string(resp, &tmp_out);
-	if (used < 0) {
-		return used;
-	}
-
-	tmp_out = realloc(tmp_out, (used+resp->content_length+1) * sizeof(char));
-	tmp_out[used] = '\0';	// Null byte
-
+int http_response_get_iovec(http_response *resp, struct iovec *iov) {
+	int ret = http_response_build_head(resp);
+	if (ret < 0) return ret;
+
+	int count = 0;
+	// Status line
+	iov[count].iov_base = (char *)resp->_status_line;
+	iov[count].iov_len = resp->_status_len;
+	count++;
+	// Header block, ends with the empty line
+	iov[count].iov_base = resp->_head;
+	iov[count].iov_len = resp->_head_len;
+	count++;
 	// Message body
 	if (resp->no_payload == 0 && resp->content_length > 0 && resp->content != NULL) {
-		memcpy(&(tmp_out[used]), resp->content, resp->content_length);
-		used += resp->content_length;
+		iov[count].iov_base = resp->content;
+		iov[count].iov_len = resp->content_length;
+		count++;
 	}
 
-	*out = tmp_out;
+	return count;
+}
 
-	return used;
+/**
+ * @brief Get prebuilt response head
+ * @details Copies the rendered status line and headers without the Connection header to \p out.
+ *          The copy ends with the Date header, so a later response can reuse it with
+ *          http_prebuilt_finish(). Call after http_response_get_iovec().
+ * 
+ * @param resp Rendered response
+ * @param[out] out Buffer for the head
+ * @param cap Size of \p out
+ * 
+ * @return Length of the prebuilt head or < 0 on error, also if \p out is too small
+ */
+int http_response_get_prebuilt(http_response *resp, char *out, size_t cap) {
+	if (resp == NULL || resp->_head == NULL) return ERROR_RESPONSE_ARGUMENT;
+	size_t len = resp->_status_len + resp->_conn_offset;
+	if (len > cap) return ERROR_RESPONSE_ARGUMENT;
+	memcpy(out, resp->_status_line, resp->_status_len);
+	memcpy(&out[resp->_status_len], resp->_head, resp->_conn_offset);
+	return len;
+}
+
+/**
+ * @brief Finish prebuilt response head
+ * @details Writes the current date over the Date header of \p head and fills \p iov with the
+ *          head and the Connection header, which ends the header block
+ * 
+ * @param head Head from http_response_get_prebuilt(), modified in place
+ * @param head_len Length of \p head
+ * @param keep_alive Should the Connection header value be "keep-alive"
+ * @param[out] iov Vector of at least 2 entries
+ * 
+ * @return Count of \p iov entries used
+ */
+int http_prebuilt_finish(char *head, size_t head_len, int keep_alive, struct iovec *iov) {
+	static const char conn_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+	static const char conn_close[] = "Connection: close\r\n\r\n";
+
+	// The head ends with "Date: <HTTP-date>\r\n"
+	memcpy(&head[head_len - HTTP_DATE_LEN - 2], http_date_now(), HTTP_DATE_LEN);
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = head_len;
+	iov[1].iov_base = (char *)(keep_alive ? conn_keep_alive : conn_close);
+	iov[1].iov_len = keep_alive ? sizeof(conn_keep_alive) - 1 : sizeof(conn_close) - 1;
+	return 2;
 }
@@ -0,0 +1,162 @@
+#include "http_date.h"
+
+static const char day_names[7][4] = {"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"};	// From 1970-01-01
+static const char month_names[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+static time_t cached_time = -1;				// Second the cached date was formatted for
+static char cached_date[HTTP_DATE_LEN + 1];	// Current date for the Date header
+
+/**
+ * @brief Convert civil date to days
+ * @details Counts days since 1970-01-01 in the proleptic Gregorian calendar,
+ *          see http://howardhinnant.github.io/date_algorithms.html
+ *
+ * @param y Year
+ * @param m Month, 1-12
+ * @param d Day of month, 1-31
+ * @return Days since the epoch, negative before it
+ */
+static long days_from_civil(long y, unsigned int m, unsigned int d) {
+	y -= m <= 2;
+	long era = (y >= 0 ? y : y - 399) / 400;
+	unsigned long yoe = (unsigned long)(y - era * 400);
+	unsigned long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	unsigned long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (long)doe - 719468;
+}
+
+/**
+ * @brief Convert days to civil date
+ * @details Inverse of days_from_civil()
+ *
+ * @param days Days since the epoch
+ * @param[out] y Year
+ * @param[out] m Month, 1-12
+ * @param[out] d Day of month, 1-31
+ */
+static void civil_from_days(long days, long *y, unsigned int *m, unsigned int *d) {
+	days += 719468;
+	long era = (days >= 0 ? days : days - 146096) / 146097;
+	unsigned long doe = (unsigned long)(days - era * 146097);
+	unsigned long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	unsigned long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	unsigned long mp = (5 * doy + 2) / 153;
+	*d = doy - (153 * mp + 2) / 5 + 1;
+	*m = mp < 10 ? mp + 3 : mp - 9;
+	*y = (long)yoe + era * 400 + (*m <= 2);
+}
+
+/**
+ * @brief Write two digits
+ *
+ * @param out Where to write
+ * @param value Number, 0-99
+ */
+static void put2(char *out, unsigned int value) {
+	out[0] = '0' + value / 10;
+	out[1] = '0' + value % 10;
+}
+
+/**
+ * @brief Read two digits
+ *
+ * @param str Digits
+ * @return Number or -1 if \p str doesn't start with two digits
+ */
+static int get2(const char *str) {
+	if (str[0] < '0' || str[0] > '9' || str[1] < '0' || str[1] > '9') return -1;
+	return (str[0] - '0') * 10 + (str[1] - '0');
+}
+
+/**
+ * @brief Format HTTP date
+ * @details Formats \p t as an IMF-fixdate (RFC 7231 Section 7.1.1.1) without gmtime() or
+ *          strftime(), the output doesn't depend on the locale. Years must have four digits.
+ *
+ * @param t Time to format
+ * @param[out] out Buffer of at least #HTTP_DATE_LEN + 1 bytes, null-terminated
+ * @return #HTTP_DATE_LEN
+ */
+size_t http_date_format(time_t t, char *out) {
+	long days = t / 86400;
+	long secs = t % 86400;
+	if (secs < 0) {
+		secs += 86400;
+		days--;
+	}
+	long y;
+	unsigned int m, d;
+	civil_from_days(days, &y, &m, &d);
+	long wday = days % 7;
+	if (wday < 0) wday += 7;
+
+	memcpy(out, day_names[wday], 3);
+	out[3] = ',';
+	out[4] = ' ';
+	put2(&out[5], d);
+	out[7] = ' ';
+	memcpy(&out[8], month_names[m - 1], 3);
+	out[11] = ' ';
+	put2(&out[12], (y / 100) % 100);
+	put2(&out[14], y % 100);
+	out[16] = ' ';
+	put2(&out[17], secs / 3600);
+	out[19] = ':';
+	put2(&out[20], secs / 60 % 60);
+	out[22] = ':';
+	put2(&out[23], secs % 60);
+	memcpy(&out[25], " GMT", 5);	// Null byte included
+	return HTTP_DATE_LEN;
+}
+
+/**
+ * @brief Parse HTTP date
+ * @details Parses an IMF-fixdate (RFC 7231 Section 7.1.1.1) without strptime() or timegm().
+ *          The obsolete RFC 850 and asctime() formats aren't accepted.
+ *
+ * @param str Date string, doesn't need to be null-terminated
+ * @param len Length of \p str
+ * @param[out] out Parsed time
+ * @return 0 on success, -1 if \p str isn't a valid IMF-fixdate
+ */
+int http_date_parse(const char *str, size_t len, time_t *out) {
+	if (len != HTTP_DATE_LEN || str[3] != ',' || str[4] != ' ' || str[7] != ' ' || str[11] != ' ' ||
+		str[16] != ' ' || str[19] != ':' || str[22] != ':' || memcmp(&str[25], " GMT", 4) != 0) {
+		return -1;
+	}
+
+	int day = get2(&str[5]);
+	int century = get2(&str[12]);
+	int year = get2(&str[14]);
+	int hour = get2(&str[17]);
+	int min = get2(&str[20]);
+	int sec = get2(&str[23]);
+	if (day < 1 || day > 31 || century < 0 || year < 0 || hour < 0 || hour > 23 ||
+		min < 0 || min > 59 || sec < 0 || sec > 60) {
+		return -1;
+	}
+
+	int month = 0;
+	while (month < 12 && memcmp(&str[8], month_names[month], 3) != 0) month++;
+	if (month == 12) return -1;
+
+	long days = days_from_civil(century * 100 + year, month + 1, day);
+	*out = (time_t)days * 86400 + hour * 3600 + min * 60 + sec;
+	return 0;
+}
+
+/**
+ * @brief Get current HTTP date
+ * @details Returns the current time as an IMF-fixdate for the Date header.
+ *          The string is formatted at most once per second and shared by all responses.
+ *
+ * @return Null-terminated date, valid until the next call
+ */
+const char * http_date_now(void) {
+	time_t now = time(NULL);
+	if (now != cached_time) {
+		http_date_format(now, cached_date);
+		cached_time = now;
+	}
+	return cached_date;
+}
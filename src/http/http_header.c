@@ -0,0 +1,343 @@
+#include "http_header.h"
+
+/**
+ * Well-known header table entry
+ */
+typedef struct {
+	const char *name;		/**< Header name */
+	size_t len;				/**< Length of \p name */
+	http_header_id id;		/**< Header identifier */
+} known_header_entry;
+
+#define KNOWN_HEADER_TABLE_SIZE 64	/**< Size of the well-known header table, a power of two */
+
+/**
+ * @brief Hash header name
+ * @details Perfect hash for the names in #known_headers: each of them gets its own table slot.
+ *          Other names may collide with them, so the slot is only a candidate.
+ *          The table must be regenerated if a header is added.
+ */
+#define KNOWN_HEADER_HASH(name, len) \
+	(((len) + ((name)[0] | 0x20) * 14 + ((name)[(len) - 2] | 0x20) * 17) & (KNOWN_HEADER_TABLE_SIZE - 1))
+
+/**
+ * Well-known headers by #KNOWN_HEADER_HASH
+ */
+static const known_header_entry known_headers[KNOWN_HEADER_TABLE_SIZE] = {
+	[4] = {"Accept", 6, HTTP_HEADER_ACCEPT},
+	[5] = {"Server", 6, HTTP_HEADER_SERVER},
+	[8] = {"Content-Encoding", 16, HTTP_HEADER_CONTENT_ENCODING},
+	[10] = {"Vary", 4, HTTP_HEADER_VARY},
+	[14] = {"Content-Range", 13, HTTP_HEADER_CONTENT_RANGE},
+	[15] = {"Location", 8, HTTP_HEADER_LOCATION},
+	[16] = {"Accept-Ranges", 13, HTTP_HEADER_ACCEPT_RANGES},
+	[17] = {"Upgrade", 7, HTTP_HEADER_UPGRADE},
+	[19] = {"Connection", 10, HTTP_HEADER_CONNECTION},
+	[21] = {"Status", 6, HTTP_HEADER_STATUS},
+	[22] = {"Cache-Control", 13, HTTP_HEADER_CACHE_CONTROL},
+	[23] = {"Host", 4, HTTP_HEADER_HOST},
+	[24] = {"Range", 5, HTTP_HEADER_RANGE},
+	[25] = {"If-Match", 8, HTTP_HEADER_IF_MATCH},
+	[29] = {"If-Range", 8, HTTP_HEADER_IF_RANGE},
+	[30] = {"If-None-Match", 13, HTTP_HEADER_IF_NONE_MATCH},
+	[31] = {"Expect", 6, HTTP_HEADER_EXPECT},
+	[34] = {"If-Modified-Since", 17, HTTP_HEADER_IF_MODIFIED_SINCE},
+	[36] = {"If-Unmodified-Since", 19, HTTP_HEADER_IF_UNMODIFIED_SINCE},
+	[38] = {"Content-Type", 12, HTTP_HEADER_CONTENT_TYPE},
+	[41] = {"Cookie", 6, HTTP_HEADER_COOKIE},
+	[42] = {"Last-Modified", 13, HTTP_HEADER_LAST_MODIFIED},
+	[43] = {"Accept-Encoding", 15, HTTP_HEADER_ACCEPT_ENCODING},
+	[44] = {"Content-Length", 14, HTTP_HEADER_CONTENT_LENGTH},
+	[48] = {"Date", 4, HTTP_HEADER_DATE},
+	[52] = {"Accept-Language", 15, HTTP_HEADER_ACCEPT_LANGUAGE},
+	[55] = {"Transfer-Encoding", 17, HTTP_HEADER_TRANSFER_ENCODING},
+	[56] = {"Referer", 7, HTTP_HEADER_REFERER},
+	[58] = {"Authorization", 13, HTTP_HEADER_AUTHORIZATION},
+	[59] = {"ETag", 4, HTTP_HEADER_ETAG},
+	[62] = {"User-Agent", 10, HTTP_HEADER_USER_AGENT},
+};
+
+/**
+ * @brief Identify header name
+ * @details Finds the well-known header with given name in constant time. Case insensitive.
+ *
+ * @param name Header name, doesn't need to be null-terminated
+ * @param len Length of \p name
+ * @return Header identifier or #HTTP_HEADER_OTHER if the header isn't well-known
+ */
+http_header_id http_header_lookup(const char *name, size_t len) {
+	if (len < 2) return HTTP_HEADER_OTHER;
+	const known_header_entry *e = &known_headers[KNOWN_HEADER_HASH(name, len)];
+	if (e->name == NULL || e->len != len || strncasecmp(e->name, name, len) != 0) return HTTP_HEADER_OTHER;
+	return e->id;
+}
+
+/**
+ * @brief Hash other header name
+ * @details FNV-1a over the name with ASCII letters folded to lowercase
+ *
+ * @param name Header name, doesn't need to be null-terminated
+ * @param len Length of \p name
+ * @return Hash value
+ */
+static size_t other_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i] | 0x20;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * @brief Get header by index
+ * @details Pointers to the first #HTTP_HEADER_LIST_INLINE headers stay valid until the header is
+ *          removed, the others until the next header is added
+ *
+ * @param list Header list
+ * @param index Index of the header, less than the header count
+ * @return Pointer to the header
+ */
+http_header * http_header_list_at(http_header_list *list, size_t index) {
+	if (index < HTTP_HEADER_LIST_INLINE) return &list->_inline[index];
+	return &list->_overflow[index - HTTP_HEADER_LIST_INLINE];
+}
+
+/**
+ * @brief Initialize header list
+ * @details Initializes empty \ref http_header_list
+ *
+ * @param list Header list to initialize
+ */
+void http_header_list_init(http_header_list *list) {
+	list->count = 0;
+	memset(list->slots, 0, sizeof(list->slots));
+	memset(list->others, 0, sizeof(list->others));
+	list->other_count = 0;
+	list->others_full = 0;
+	list->_overflow = NULL;
+	list->_overflow_cap = 0;
+	list->_strings_len = 0;
+	list->_blocks = NULL;
+}
+
+/**
+ * @brief Clear header list
+ * @details Removes all headers and frees the memory allocated for them, the list stays usable
+ *
+ * @param list Header list to clear
+ */
+void http_header_list_clear(http_header_list *list) {
+	free(list->_overflow);
+	while (list->_blocks != NULL) {
+		http_string_block *next = list->_blocks->next;
+		free(list->_blocks);
+		list->_blocks = next;
+	}
+	http_header_list_init(list);
+}
+
+/**
+ * @brief Copy string to the list
+ * @details Copies \p len bytes of \p str and a null byte to the string space of the list
+ *
+ * @param list Header list
+ * @param str String to copy
+ * @param len Length of \p str
+ * @return The copy or NULL on error
+ */
+static char * store_string(http_header_list *list, const char *str, size_t len) {
+	char *dest;
+	if (len < HTTP_HEADER_LIST_STRINGS_INLINE - list->_strings_len) {
+		dest = &list->_strings[list->_strings_len];
+		list->_strings_len += len + 1;
+	} else {
+		http_string_block *block = list->_blocks;
+		if (block == NULL || len >= block->cap - block->len) {
+			size_t cap = len + 1 > HTTP_HEADER_LIST_STRING_BLOCK ? len + 1 : HTTP_HEADER_LIST_STRING_BLOCK;
+			block = malloc(sizeof(http_string_block) + cap);
+			if (block == NULL) return NULL;
+			block->len = 0;
+			block->cap = cap;
+			block->next = list->_blocks;
+			list->_blocks = block;
+		}
+		dest = &block->data[block->len];
+		block->len += len + 1;
+	}
+	memcpy(dest, str, len);
+	dest[len] = '\0';
+	return dest;
+}
+
+/**
+ * @brief Find other header
+ * @details Finds the first header with a name that isn't well-known from the hash table
+ *
+ * @param list Header list
+ * @param name Header name, case insensitive, doesn't need to be null-terminated
+ * @param len Length of \p name
+ * @return Pointer to the header or NULL if it isn't in the table
+ */
+static http_header * find_other(http_header_list *list, const char *name, size_t len) {
+	for (size_t i = other_hash(name, len) & (HTTP_HEADER_LIST_OTHER_SLOTS - 1); list->others[i] != 0;
+		i = (i + 1) & (HTTP_HEADER_LIST_OTHER_SLOTS - 1)) {
+		http_header *h = http_header_list_at(list, list->others[i] - 1);
+		if (h->name_len == len && strncasecmp(h->name, name, len) == 0) return h;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Add other header to table
+ * @details Adds the name of the header unless the list already has a header with that name.
+ *          The table is kept at most three quarters full, further names are left out and
+ *          found by comparing the headers.
+ *
+ * @param list Header list
+ * @param index Index of a header with a name that isn't well-known
+ */
+static void add_other(http_header_list *list, size_t index) {
+	http_header *h = http_header_list_at(list, index);
+	size_t i = other_hash(h->name, h->name_len) & (HTTP_HEADER_LIST_OTHER_SLOTS - 1);
+	for (; list->others[i] != 0; i = (i + 1) & (HTTP_HEADER_LIST_OTHER_SLOTS - 1)) {
+		http_header *o = http_header_list_at(list, list->others[i] - 1);
+		if (o->name_len == h->name_len && strncasecmp(o->name, h->name, h->name_len) == 0) return;
+	}
+	if (list->other_count >= HTTP_HEADER_LIST_OTHER_SLOTS / 4 * 3) {
+		list->others_full = 1;
+		return;
+	}
+	list->others[i] = index + 1;
+	list->other_count++;
+}
+
+/**
+ * @brief Add header without copying
+ * @details Adds \p header to the end of the list. The strings aren't copied and must stay valid
+ *          while the list is used.
+ *
+ * @param list Header list
+ * @param header Header to add, the name doesn't need to be identified
+ * @return 0 on success, < 0 on error
+ */
+int http_header_list_add_view(http_header_list *list, const http_header *header) {
+	if (list->count == HTTP_HEADER_LIST_MAX) return ERROR_HEADER_CREATE_FAILED;
+	if (list->count >= HTTP_HEADER_LIST_INLINE && list->count - HTTP_HEADER_LIST_INLINE == list->_overflow_cap) {
+		// Out of space, double it
+		size_t cap = list->_overflow_cap > 0 ? list->_overflow_cap * 2 : HTTP_HEADER_LIST_INLINE;
+		http_header *overflow = realloc(list->_overflow, cap * sizeof(http_header));
+		if (overflow == NULL) return ERROR_HEADER_CREATE_FAILED;
+		list->_overflow = overflow;
+		list->_overflow_cap = cap;
+	}
+
+	http_header *h = http_header_list_at(list, list->count++);
+	*h = *header;
+	h->id = http_header_lookup(h->name, h->name_len);
+	if (h->id == HTTP_HEADER_OTHER) {
+		add_other(list, list->count - 1);
+	} else if (list->slots[h->id] == 0) {
+		list->slots[h->id] = list->count;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Add header
+ * @details Copies \p header to the end of the list, strings included
+ *
+ * @param list Header list
+ * @param header Header to add, the name doesn't need to be identified
+ * @return 0 on success, < 0 on error
+ */
+int http_header_list_add(http_header_list *list, const http_header *header) {
+	http_header copy = *header;
+	copy.name = store_string(list, header->name, header->name_len);
+	copy.value = store_string(list, header->value, header->value_len);
+	if (copy.name == NULL || copy.value == NULL) return ERROR_HEADER_CREATE_FAILED;
+	return http_header_list_add_view(list, &copy);
+}
+
+/**
+ * @brief Get header
+ * @details Gets the first header with given name. Well-known headers are found from their
+ *          slots, the others from the hash table. Case insensitive.
+ *
+ * @param list Header list
+ * @param name Header name, case insensitive
+ * @return Pointer to the header or NULL if not found
+ */
+http_header * http_header_list_get(http_header_list *list, const char *name) {
+	size_t len = strlen(name);
+	http_header_id id = http_header_lookup(name, len);
+	if (id != HTTP_HEADER_OTHER) return http_header_list_get_known(list, id);
+
+	http_header *found = find_other(list, name, len);
+	if (found != NULL || !list->others_full) return found;
+
+	// Names that didn't fit in the table
+	for (size_t i = 0; i < list->count; i++) {
+		http_header *h = http_header_list_at(list, i);
+		if (h->id == HTTP_HEADER_OTHER && strcasecmp(h->name, name) == 0) {
+			// Found
+			return h;
+		}
+	}
+	// No match
+	return NULL;
+}
+
+/**
+ * @brief Get well-known header
+ * @details Gets the first header with given identifier from its slot without comparing names
+ *
+ * @param list Header list
+ * @param id Header identifier
+ * @return Pointer to the header or NULL if not found
+ */
+http_header * http_header_list_get_known(http_header_list *list, http_header_id id) {
+	if (id == HTTP_HEADER_OTHER || list->slots[id] == 0) return NULL;
+	return http_header_list_at(list, list->slots[id] - 1);
+}
+
+/**
+ * @brief Remove header(s) by name
+ * @details Removes all headers with given name, moving the rest in place. The memory of copied
+ *          strings is reclaimed only when the list is cleared.
+ *
+ * @param list Header list
+ * @param name Name of the header to remove, case insensitive
+ * @return Count of removed headers or < 0 if there were none
+ */
+int http_header_list_remove(http_header_list *list, const char *name) {
+	size_t len = strlen(name);
+	http_header_id id = http_header_lookup(name, len);
+	if (id != HTTP_HEADER_OTHER && list->slots[id] == 0) return -1;
+	if (id == HTTP_HEADER_OTHER && !list->others_full && find_other(list, name, len) == NULL) return -1;
+
+	int found_count = 0;
+	size_t a = 0;
+	memset(list->slots, 0, sizeof(list->slots));
+	memset(list->others, 0, sizeof(list->others));
+	list->other_count = 0;
+	list->others_full = 0;
+	for (size_t i = 0; i < list->count; i++) {
+		http_header *h = http_header_list_at(list, i);
+		if (id != HTTP_HEADER_OTHER ? h->id == id : (h->id == HTTP_HEADER_OTHER && strcasecmp(h->name, name) == 0)) {
+			// Match!
+			found_count++;
+			continue;
+		}
+		if (a != i) *http_header_list_at(list, a) = *h;
+		if (h->id == HTTP_HEADER_OTHER) {
+			add_other(list, a);
+		} else if (list->slots[h->id] == 0) {
+			list->slots[h->id] = a + 1;
+		}
+		a++;
+	}
+	list->count = a;
+	return found_count > 0 ? found_count : -1;
+}
@@ -1,137 +1,116 @@
 #include "http_request_parser.h"
 
+/**
+ * @brief Initialize parser
+ * @details Resets \ref http_parser to the start of a new header block
+ *
+ * @param parser Parser to initialize
+ */
+void http_parser_init(http_parser *parser) {
+	parser->status = PARSER_STATUS_LINE;
+	parser->pos = 0;
+	parser->line_start = 0;
+	parser->line_count = 0;
+	parser->end_pos = 0;
+	parser->payload_len = 0;
+}
+
 /**
  * @brief Parse HTTP request for header lines
- * @details Parses HTTP request and splits headers to lines. Doesn't touch request payload.
- * 
- * @param request Raw request string
+ * @details Splits the header block of a HTTP request to lines without copying. Scanning continues
+ *          from where the previous call with the same \p parser stopped, so \p request must only
+ *          have grown since then. The lines point to \p request and are null-terminated in place,
+ *          so \p request is modified, but only once the whole header block has been received.
+ *          Doesn't touch request payload.
+ *
+ * @param parser Parser state
+ * @param request Raw request string, modified in place
  * @param len Length of \p request
- * @param[out] header_lines Pointer to non-allocated memory that will contain pointers to header line strings
- * @param[out] end_pos_out Pointer to the last character after header end
+ * @param[out] lines Array of #HTTP_PARSER_MAX_LINES entries that will contain the lines,
+ *                   NULL to only find the end of the header block without modifying \p request
+ * @param[out] end_pos_out Pointer to the last character of the header block, may be NULL
  * @return Count of header lines or < 0 on error
  */
-int http_request_parse_header_lines(const char *request, size_t len, char ***header_lines, char **end_pos_out) {
-	// Memory for lines
-	size_t lines_cap = 1;
-	size_t lines_count = 0;
-	char **lines = calloc(lines_cap, sizeof(char *));
-
-	// Memory for current line
-	size_t line_cap = 100;
-	size_t line_pos = 0;
-	char *line = calloc(line_cap, sizeof(char));
-
-	char *end_pos = NULL;
-
-	// Parser state
-	int status = PARSER_STATUS_CHAR;
-
-	for (size_t i = 0; i < len; i++) {
-		// Read line
-		if (line_pos+1 > line_cap) {
-			// Realloc if we need more space
-			line_cap *= 2;
-			line = realloc(line, line_cap * sizeof(char));
-		}
-		line[line_pos] = request[i];
-		
-		if (request[i] == '\r') status = PARSER_STATUS_LF;
-		
-		if (request[i] == '\n') {
-			if (status == PARSER_STATUS_LF) {
-				// End of line
-				// Add to lines
-				// Fit line
-				if (line_pos-1 <= 0) {
-					// Empty line
-					line = realloc(line, sizeof(char));
-					line[0] = '\0';
-					line_pos = 0;
-					end_pos = (char *)&request[i];
-					status = PARSER_STATUS_HEADER_END;
-				} else {
-					// Normal line ending with \r\n
-					line = realloc(line, line_pos * sizeof(char));
-					line[line_pos-1] = '\0';
-					status = PARSER_STATUS_LINE;
-				}
-			} else if (status == PARSER_STATUS_CHAR) {
-				// Data violates HTTP specs and ends line with just \n
-				// We'll manage
-				if (line_pos == 0) {
-					// Empty line
-					line = realloc(line, sizeof(char));
-					line[0] = '\0';
-					line_pos = 0;
-					end_pos = (char *)&request[i];
-					status = PARSER_STATUS_HEADER_END;
-				} else {
-					// Normal line ending with \n
-					line = realloc(line, line_pos+1 * sizeof(char));
-					line[line_pos] = '\0';
-					status = PARSER_STATUS_LINE;
-				}
+int http_request_parse_header_lines(http_parser *parser, char *request, size_t len, http_line *lines, char **end_pos_out) {
+
+	if (parser->status != PARSER_STATUS_HEADER_END && parser->status != PARSER_STATUS_PAYLOAD) {
+		// Scan only the data received after the previous call, a vector at a time
+		size_t i = parser->pos;
+		while (i < len) {
+			size_t lf = i + http_scan_any(&request[i], len - i, '\n', '\n', '\n');
+			if (lf == len) {
+				// Line continues in the next piece of data
+				parser->status = PARSER_STATUS_CHAR;
+				i = len;
+				break;
 			}
-		}
 
-		if (status == PARSER_STATUS_LINE) {
-			// If we have whole line
-			if (lines_count+1 > lines_cap) {
-				// Realloc line array
-				lines_cap *= 2;
-				lines = realloc(lines, lines_cap * sizeof(char *));
+			// Lines should end with \r\n, but we'll manage with just \n
+			size_t line_end = lf;
+			if (line_end > parser->line_start && request[line_end-1] == '\r') line_end--;
+
+			if (line_end == parser->line_start) {
+				// Empty line, headers end here
+				parser->end_pos = lf;
+				parser->status = PARSER_STATUS_HEADER_END;
+				i = lf + 1;
+				break;
+			}
+
+			if (parser->line_count == HTTP_PARSER_MAX_LINES) {
+				zhttpd_log(LOG_WARN, "Request has too many header lines, max: %d", HTTP_PARSER_MAX_LINES);
+				return ERROR_PARSER_TOO_MANY_HEADERS;
 			}
-			lines[lines_count++] = strdup(line);
-
-			free(line);
-			line = calloc(line_cap, sizeof(char));
-
-			line_pos = 0;
-			status = PARSER_STATUS_CHAR;
-		
-		} else if (status == PARSER_STATUS_HEADER_END) {
-			// Headers ended, content begins
-			break;
-		
-		} else {
-			line_pos++;
+			parser->lines[parser->line_count].start = parser->line_start;
+			parser->lines[parser->line_count].len = line_end - parser->line_start;
+			parser->line_count++;
+			parser->line_start = lf + 1;
+			parser->status = PARSER_STATUS_LINE;
+			i = lf + 1;
+		}
+		parser->pos = i;
+
+		if (parser->status != PARSER_STATUS_HEADER_END) {
+			// It seems that we have no enough data
+			// Request more
+			zhttpd_log(LOG_DEBUG, "Possible request data exhaustion");
+			return ERROR_PARSER_GET_MORE_DATA;
 		}
 	}
 
-	free(line);
+	if (lines == NULL) return parser->line_count;
 
-	if (status != PARSER_STATUS_HEADER_END) {
-		// It seems that we have no enough data
-		// Request more
-		split_line_free(lines, lines_count);
-		zhttpd_log(LOG_WARN, "Possible request data exhaustion");
-		return ERROR_PARSER_GET_MORE_DATA;
+	// Header block complete, terminate lines in place
+	for (size_t i = 0; i < parser->line_count; i++) {
+		lines[i].ptr = &request[parser->lines[i].start];
+		lines[i].len = parser->lines[i].len;
+		lines[i].ptr[lines[i].len] = '\0';
 	}
 
-	*header_lines = lines;
-	if (end_pos_out != NULL) *end_pos_out = end_pos;
+	if (end_pos_out != NULL) *end_pos_out = &request[parser->end_pos];
 
-	return lines_count;
+	return parser->line_count;
 }
 
 /**
- * @brief Parse lines to array of \ref http_header
- * @details Parses given array of lines to array of \ef http_header
- * 
- * @param lines Pointer to array produced by \ref http_request_parse_header_lines
+ * @brief Parse lines to \ref http_header_list
+ * @details Parses given lines to headers pointing to the lines. Names and values are
+ *          null-terminated in place, surrounding whitespace is removed from values.
+ *
+ * @param lines Lines produced by \ref http_request_parse_header_lines
  * @param line_count Count of lines in \p lines
- * @param[out] out_headers Pointer to non-allocated memory that will contain the array of \ref http_header
+ * @param[out] headers List the headers are added to without copying
+ * @param max_headers Maximum count of headers
  * @return Count of parsed headers or < 0 on error
  */
-int http_request_parse_headers(char **lines, size_t line_count, http_header ***out_headers) {
+int http_request_parse_headers(http_line *lines, size_t line_count, http_header_list *headers, size_t max_headers) {
 
-	size_t header_cap = 1;
-	size_t header_count = 0;
-	http_header **headers = calloc(header_cap, sizeof(http_header *));
+	if (line_count > max_headers) return ERROR_PARSER_TOO_MANY_HEADERS;
 
 	for (size_t i = 0; i < line_count; i++) {
+		char *line = lines[i].ptr;
 
-		if (i > 0 && (lines[i][0] == ' ' || lines[i][0] == '\t')) {
+		if (line[0] == ' ' || line[0] == '\t') {
 			/* The parser has stumbled upon a folded header value
 			 * This has been obsoleted and must be responded with 400 Bad Request
 			 * For more information, see RFC 7230 Section 3.2.4.
@@ -140,88 +119,172 @@ int http_request_parse_headers(char **lines, size_t line_count, http_header ***o
 			return ERROR_PARSER_MALFORMED_REQUEST;
 		}
 
-		// Split header line
-		char **header_words;
-		size_t header_words_count = split_line2(lines[i], strlen(lines[i]), ' ', &header_words, 1);
-
-		if (header_words_count != 2) {
+		// Find the end of the header name
+		size_t name_len = http_scan_any(line, lines[i].len, ':', ' ', '\t');
+		if (name_len == lines[i].len || name_len == 0) {
 			// Invalid header
-			// TODO: Maybe ignore invalid headers?
-			zhttpd_log(LOG_WARN, "Invalid request header: %s", lines[i]);
-			split_line_free(header_words, header_words_count);
+			zhttpd_log(LOG_WARN, "Invalid request header: %s", line);
 			return ERROR_PARSER_MALFORMED_REQUEST;
 		}
-
-		char *header_name = header_words[0];
-		char *header_value = header_words[1];
-
-		if (header_name[strlen(header_name)-1] != ':') {
-			// Not valid header, header name must end with :
-			zhttpd_log(LOG_WARN, "Invalid request header name: \"%s\"", header_words[0]);
-			split_line_free(header_words, header_words_count);
+		if (line[name_len] != ':') {
+			// No whitespace allowed in header name or before the colon
+			zhttpd_log(LOG_WARN, "Invalid request header name: \"%s\"", line);
 			return ERROR_PARSER_MALFORMED_REQUEST;
 		}
-		header_name[strlen(header_name)-1] = '\0';	// Remove trailing ':'
+		char *colon = &line[name_len];
+		*colon = '\0';
+
+		// Trim whitespace around the value
+		char *value = colon + 1;
+		char *value_end = line + lines[i].len;
+		while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+		while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+		*value_end = '\0';
+
+		http_header header = {
+			.name = line,
+			.value = value,
+			.name_len = colon - line,
+			.value_len = value_end - value
+		};
+		if (http_header_list_add_view(headers, &header) < 0) return ERROR_PARSER_TOO_MANY_HEADERS;
+	}
 
-		http_header *h = http_header_create(header_name, header_value);
-		if (header_cap < header_count+1) {
-			// Realloc
-			header_cap *= 2;
-			headers = realloc(headers, header_cap * sizeof(http_header *));
-		}
-		headers[header_count++] = h;
+	return line_count;
+}
 
-		split_line_free(header_words, header_words_count);
+/**
+ * @brief Get payload length
+ * @details Gets the payload length from Content-Length of a complete header block.
+ *          Looks at the raw lines, so the request isn't modified before the payload has arrived.
+ *
+ * @param parser Parser with a complete header block
+ * @param request Raw request string
+ * @param[out] out Payload length, 0 if the request has no payload
+ * @return 0 on success, < 0 on error
+ */
+static int get_payload_length(http_parser *parser, const char *request, size_t *out) {
+	int found = 0;
+	size_t payload_len = 0;
+
+	// Skip the status line
+	for (size_t i = 1; i < parser->line_count; i++) {
+		const char *line = &request[parser->lines[i].start];
+		size_t len = parser->lines[i].len;
+
+		const char *colon = memchr(line, ':', len);
+		if (colon == NULL) continue;
+		http_header_id id = http_header_lookup(line, colon - line);
+
+		if (id == HTTP_HEADER_TRANSFER_ENCODING) {
+			// Chunked payloads aren't supported, and without knowing the length the next request can't be found
+			zhttpd_log(LOG_WARN, "Request uses Transfer-Encoding, not supported");
+			return ERROR_PARSER_UNSUPPORTED_TRANSFER_ENCODING;
+		}
+		if (id != HTTP_HEADER_CONTENT_LENGTH) continue;
+
+		size_t pos = colon - line + 1;
+		while (pos < len && (line[pos] == ' ' || line[pos] == '\t')) pos++;
+		size_t value = 0;
+		size_t digits = 0;
+		for (; pos < len && line[pos] >= '0' && line[pos] <= '9'; pos++, digits++) {
+			value = value * 10 + (line[pos] - '0');
+			if (value > HTTP_REQUEST_MAX_PAYLOAD) {
+				// Rejected before any of the payload is buffered
+				zhttpd_log(LOG_WARN, "Request Content-Length too large, max: %d", HTTP_REQUEST_MAX_PAYLOAD);
+				return ERROR_PARSER_PAYLOAD_TOO_LARGE;
+			}
+		}
+		while (pos < len && (line[pos] == ' ' || line[pos] == '\t')) pos++;
+		if (digits == 0 || pos != len || (found && value != payload_len)) {
+			zhttpd_log(LOG_WARN, "Request has invalid Content-Length");
+			return ERROR_PARSER_MALFORMED_REQUEST;
+		}
+		found = 1;
+		payload_len = value;
 	}
 
-	*out_headers = headers;
-	return header_count;
+	*out = payload_len;
+	return 0;
 }
 
 /**
  * @brief HTTP request parser
- * @details Parses raw text and produces \ref http_request
- * 
+ * @details Parses raw text to \ref http_request without copying. The request points to
+ *          \p request, which is modified in place and must stay valid while the request is used.
+ *          \p request must have room for a null byte after \p len bytes.
+ *          On #ERROR_PARSER_GET_MORE_DATA \p request is left untouched and \p parser remembers
+ *          how far it got. Call again with the same \p parser when more data has been appended.
+ *          The request ends after Content-Length bytes of payload, any data after that belongs
+ *          to the next (pipelined) request.
+ *
+ * @param parser Parser state, reset with http_parser_init() before each new request
  * @param request Raw request string
  * @param len Length of \p request
- * @param[out] out Unallocated memory for created request
- * @return 0 if successful, < 0 on error
+ * @param[out] req Request to fill
+ * @return Count of bytes the request took from \p request or < 0 on error
  */
-int http_request_parse(const char *request, size_t len, http_request **out) {
+int http_request_parse(http_parser *parser, char *request, size_t len, http_request *req) {
+
+	http_request_clear(req);
+
+	if (parser->status == PARSER_STATUS_LINE && parser->line_count == 0) {
+		// Ignore empty lines before the request, see RFC 7230 Section 3.5
+		while (parser->pos < len && (request[parser->pos] == '\r' || request[parser->pos] == '\n')) {
+			parser->pos++;
+		}
+		parser->line_start = parser->pos;
+	}
 
 	char *header_end_pos;
-	char **lines;
-	int lines_count = 0;
-	lines_count = http_request_parse_header_lines(request, len, &lines, &header_end_pos);
+	http_line lines[HTTP_PARSER_MAX_LINES];
+	int lines_count;
+
+	if (parser->status != PARSER_STATUS_PAYLOAD) {
+		// Receiving the header block
+		lines_count = http_request_parse_header_lines(parser, request, len, NULL, NULL);
+		if (lines_count < 0) {
+			return lines_count;	// Pass the error code
+		}
+		int ret = get_payload_length(parser, request, &parser->payload_len);
+		if (ret < 0) return ret;
+		parser->status = PARSER_STATUS_PAYLOAD;
+	}
+
+	// Wait for the whole payload before touching the request
+	if (parser->payload_len > SIZE_MAX - parser->end_pos - 1) return ERROR_PARSER_PAYLOAD_TOO_LARGE;
+	size_t request_len = parser->end_pos + 1 + parser->payload_len;
+	if (len < request_len) {
+		zhttpd_log(LOG_DEBUG, "Waiting for request payload (%lu/%lu bytes)", len - parser->end_pos - 1, parser->payload_len);
+		return ERROR_PARSER_GET_MORE_DATA;
+	}
 
+	lines_count = http_request_parse_header_lines(parser, request, len, lines, &header_end_pos);
 	if (lines_count < 0) {
 		return lines_count;	// Pass the error code
 	}
 
 	if (lines_count < 1) {
 		// No HTTP status line, possible data exhaustion
-		free(lines);
 		zhttpd_log(LOG_WARN, "Possible request data exhaustion (no enough lines)");
 		return ERROR_PARSER_GET_MORE_DATA;
 	}
 
 	// We have now parsed first lines of the response containing (hopefully)
 	// status line and headers. Checking the status line is the second step.
-	
-	// Split the status line
-	char **words;
-	int word_count = split_line(lines[0], strlen(lines[0]), ' ', &words);
-	if (word_count != 3) {
+
+	// Split the status line in place
+	char *method = lines[0].ptr;
+	char *line_end = lines[0].ptr + lines[0].len;
+	char *path = method + http_scan_any(method, line_end - method, ' ', ' ', ' ');
+	char *protocol = (path < line_end) ? path + 1 + http_scan_any(path + 1, line_end - path - 1, ' ', ' ', ' ') : line_end;
+	if (protocol >= line_end || memchr(protocol + 1, ' ', line_end - protocol - 1) != NULL || path == method || protocol == path + 1 || protocol[1] == '\0') {
 		// Malformed request
 		zhttpd_log(LOG_WARN, "Malformed request, status line size wrong");
-		split_line_free(words, word_count);
-		split_line_free(lines, lines_count);
 		return ERROR_PARSER_MALFORMED_REQUEST;
 	}
-
-	char *method = words[0];
-	char *path = words[1];
-	char *protocol = words[2];
+	*path++ = '\0';
+	*protocol++ = '\0';
 
 	// First the request must contain the method
 
@@ -230,18 +293,13 @@ int http_request_parse(const char *request, size_t len, http_request **out) {
 		strcmp(method, METHOD_DELETE) != 0 && strcmp(method, METHOD_CONNECT) != 0 && strcmp(method, METHOD_OPTIONS) != 0 && strcmp(method, METHOD_TRACE) != 0) {
 		// Not valid method
 		zhttpd_log(LOG_WARN, "Invalid request method %s", method);
-		split_line_free(words, word_count);
-		split_line_free(lines, lines_count);
 		return ERROR_PARSER_INVALID_METHOD;
 	}
 
 	// TODO: Check & decode path
 	if (strlen(path) > 8000) {
 		// 414 URI Too Long
-		// return ERROR_PARSER_URI_TOO_LONG;
 		zhttpd_log(LOG_WARN, "Request URI too long: %d characters, max: 8000", strlen(path));
-		split_line_free(words, word_count);
-		split_line_free(lines, lines_count);
 		return ERROR_PARSER_URI_TOO_LONG;
 	}
 
@@ -249,125 +307,72 @@ int http_request_parse(const char *request, size_t len, http_request **out) {
 	if (strcmp(protocol, "HTTP/1.1") != 0) {
 		// Not supported protocol/protocol version
 		zhttpd_log(LOG_WARN, "Request has unsupported protocol %s", protocol);
-		split_line_free(words, word_count);
-		split_line_free(lines, lines_count);
 		return ERROR_PARSER_UNSUPPORTED_PROTOCOL;
 	}
 
 	// Extract possible query string
-	char *query_str = NULL;
-	int query_str_len = 0;
-
-	char *query_start = strstr(path, "?");
-	if (query_start != NULL) {
+	char *query_str = strchr(path, '?');
+	if (query_str != NULL) {
 		zhttpd_log(LOG_DEBUG, "Request contains a query string");
-		// TODO: Do this without pointer arithmetic?
-		query_start += sizeof(char);	// Advance one char
-		query_str_len = url_decode(query_start, strlen(query_start), &query_str);
-		if (query_str_len < 0) {
-			// url_decode failed
+		*query_str++ = '\0';	// Replace '?' with '\0' to end path string here
+		int query_len = url_decode_in_place(query_str, strlen(query_str));
+		if (query_len < 0) {
+			// url_decode_in_place failed
 			zhttpd_log(LOG_ERROR, "URL query string decoding failed!");
-			split_line_free(words, word_count);
-			split_line_free(lines, lines_count);
-			return ERROR_PARSER_MALFORMED_REQUEST;	// TODO: Return better error depending on return value
-		} else {
-			// Decoding successful
-			*(query_start-sizeof(char)) = '\0';	// Replace '?' with '\0' to end path string here
-			// We won't realloc path here, because it would mess up the split_line memory management
+			return ERROR_PARSER_MALFORMED_REQUEST;
 		}
+		query_str[query_len] = '\0';
 	}
 
-	// Create http_request
-	http_request *req = http_request_create2(method, path, query_str);
-
-	if (query_str != NULL) free(query_str);	// Because http_request_create2 uses strdup
-
-	split_line_free(words, word_count);
+	req->method = method;
+	req->path = path;
+	req->query_str = query_str;
 
 	// Parse headers
 	size_t header_count = lines_count - 1;
 	if (header_count == 0) {
 		// No headers, malformed request
 		zhttpd_log(LOG_WARN, "Request contains no headers");
-		split_line_free(lines, lines_count);
-		http_request_free(req);
 		return ERROR_PARSER_MALFORMED_REQUEST;
 	}
 
-	http_header **headers;
-	int got_header_count = http_request_parse_headers(&lines[1], header_count, &headers);
+	int got_header_count = http_request_parse_headers(&lines[1], header_count, &req->headers, HTTP_REQUEST_MAX_HEADERS);
 	if (got_header_count < 0) {
-		split_line_free(lines, lines_count);
-		http_request_free(req);
 		return got_header_count;
 	}
 
-	// Check for Host header
-	int got_host_header = 0;
-	for (size_t i = 0; i < header_count; i++) {
-		http_header *h = headers[i];
-		http_request_add_header(req, h);
-		if (strcmp(h->name, "Host") == 0) {
-			got_host_header = 1;
-		}
-		http_header_free(h);
-	}
-	free(headers);
-
-	// Cleanup
-	split_line_free(lines, lines_count);
-
 	// Check that the request has all necessary headers
-	if (got_host_header == 0) {
+	if (http_request_get_known_header(req, HTTP_HEADER_HOST) == NULL) {
 		// HTTP 1.1 requires Host header
 		zhttpd_log(LOG_WARN, "Request is missing Host header");
-		http_request_free(req);
 		return ERROR_PARSER_NO_HOST_HEADER;
 	}
-	
-	// TODO: Check if there's leftover data
 
 	// Parse possible payload (in POST, etc.)
-	int data_len = (int)(&request[len] - header_end_pos)-1;
+	size_t data_len = parser->payload_len;
 	if (data_len > 0) {
-		// header_end_pos points to '\r' or '\n', advance by one to get to the next
-		header_end_pos += 1;
-		zhttpd_log(LOG_DEBUG, "Request has leftover data (%d bytes)", data_len);
+		// header_end_pos points to '\n', advance by one to get to the next
+		char *data = header_end_pos + 1;
+		zhttpd_log(LOG_DEBUG, "Request has payload (%lu bytes)", data_len);
 
 		if (strcmp(req->method, METHOD_POST) == 0) {
 			// POST, get data
-			int is_form_urlencoded = 0;
-			for (size_t i = 0; i < req->header_count; i++) {
-				http_header *h = req->headers[i];
-				if (strcmp(h->name, "Content-Type") == 0) {
-					char *v = string_to_lowercase(h->value);
-					if (strcmp(v, "application/x-www-form-urlencoded") == 0) {
-						is_form_urlencoded = 1;
-						free(v);
-						break;
-					}
-					free(v);
-				}
-			}
-			if (is_form_urlencoded == 0) {
+			http_header *cont_type_h = http_request_get_known_header(req, HTTP_HEADER_CONTENT_TYPE);
+			if (cont_type_h == NULL || strcasecmp(cont_type_h->value, "application/x-www-form-urlencoded") != 0) {
 				// Other form encodings not supported at this moment
-				*out = req;
 				return ERROR_PARSER_UNSUPPORTED_FORM_ENCODING;
 			}
-			// Decode data
-			char *decoded_data;
-			int decoded_data_len = url_decode(header_end_pos, data_len, &decoded_data);
+			// Decode data in place, not null-terminated as the next request may follow right after
+			int decoded_data_len = url_decode_in_place(data, data_len);
 			if (decoded_data_len < 0) {
 				zhttpd_log(LOG_ERROR, "Decoding supplied form data failed!");
 			} else {
-				req->payload = decoded_data;
+				req->payload = data;
 				req->payload_len = decoded_data_len;
 			}
 
 		}
 	}
 
-	*out = req;
-
-	return 0;
+	return request_len;
 }
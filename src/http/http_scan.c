@@ -0,0 +1,126 @@
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
+/**
+ * Scanner implementation
+ */
+typedef size_t (*http_scan_func)(const char *buf, size_t len, char c1, char c2, char c3);
+
+static size_t scan_resolve(const char *buf, size_t len, char c1, char c2, char c3);
+
+static http_scan_func scan_impl = scan_resolve;	// Chosen on the first call
+static const char *scan_impl_name = "unresolved";
+
+/**
+ * @brief Scan bytes one by one
+ * @details Portable fallback, also handles the tails shorter than a vector
+ *
+ * @param buf Data to scan
+ * @param len Length of \p buf
+ * @param c1 Byte to find
+ * @param c2 Byte to find
+ * @param c3 Byte to find
+ * @return Offset of the first matching byte or \p len if there are none
+ */
+static size_t scan_scalar(const char *buf, size_t len, char c1, char c2, char c3) {
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+		if (c == c1 || c == c2 || c == c3) return i;
+	}
+	return len;
+}
+
+#ifdef HTTP_SCAN_X86
+
+/**
+ * @brief Scan 16 bytes at a time
+ * @details SSE2 version of scan_scalar()
+ */
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *buf, size_t len, char c1, char c2, char c3) {
+	const __m128i v1 = _mm_set1_epi8(c1);
+	const __m128i v2 = _mm_set1_epi8(c2);
+	const __m128i v3 = _mm_set1_epi8(c3);
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(data, v1), _mm_cmpeq_epi8(data, v2)), _mm_cmpeq_epi8(data, v3));
+		unsigned int mask = _mm_movemask_epi8(match);
+		if (mask != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_scalar(buf + i, len - i, c1, c2, c3);
+}
+
+/**
+ * @brief Scan 32 bytes at a time
+ * @details AVX2 version of scan_scalar()
+ */
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, char c1, char c2, char c3) {
+	const __m256i v1 = _mm256_set1_epi8(c1);
+	const __m256i v2 = _mm256_set1_epi8(c2);
+	const __m256i v3 = _mm256_set1_epi8(c3);
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i data = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i match = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(data, v1), _mm256_cmpeq_epi8(data, v2)), _mm256_cmpeq_epi8(data, v3));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(match);
+		if (mask != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scan_sse2(buf + i, len - i, c1, c2, c3);
+}
+
+#endif
+
+/**
+ * @brief Choose scanner
+ * @details Picks the widest implementation the CPU supports and runs the scan with it
+ */
+static size_t scan_resolve(const char *buf, size_t len, char c1, char c2, char c3) {
+	scan_impl = scan_scalar;
+	scan_impl_name = "scalar";
+#ifdef HTTP_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_impl = scan_avx2;
+		scan_impl_name = "AVX2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		scan_impl = scan_sse2;
+		scan_impl_name = "SSE2";
+	}
+#endif
+	return scan_impl(buf, len, c1, c2, c3);
+}
+
+/**
+ * @brief Find any of given bytes
+ * @details Finds the first byte equal to \p c1, \p c2 or \p c3. Scans 32 or 16 bytes at a time
+ *          with AVX2 or SSE2 when the CPU supports them. Repeat a byte to find less than three.
+ *
+ * @param buf Data to scan
+ * @param len Length of \p buf
+ * @param c1 Byte to find
+ * @param c2 Byte to find
+ * @param c3 Byte to find
+ * @return Offset of the first matching byte or \p len if there are none
+ */
+size_t http_scan_any(const char *buf, size_t len, char c1, char c2, char c3) {
+	return scan_impl(buf, len, c1, c2, c3);
+}
+
+/**
+ * @brief Get scanner name
+ * @details Resolves the scanner if needed and returns its name for logging
+ *
+ * @return Name of the scanner implementation in use
+ */
+const char * http_scan_impl_name(void) {
+	if (scan_impl == scan_resolve) scan_resolve("", 0, 0, 0, 0);
+	return scan_impl_name;
+}
@@ -1,81 +1,59 @@
 #include "cgi.h"
 
-static int parse_headers(const char *in, size_t in_len, http_header ***out_headers, char **out_end_pos) {
+static int cgi_efd = -1;	// Watches the pipes of the running CGI programs of this worker
 
-	char **header_lines;
+/**
+ * @brief Parse CGI response headers
+ * @details Parses the header block at the start of the CGI output and copies the headers,
+ *          so they stay valid when the output buffer is freed
+ *
+ * @param in CGI output
+ * @param in_len Length of \p in
+ * @param[out] out_headers Initialized list the headers are added to
+ * @param[out] out_end_pos Will point to the last character of the header block
+ * @return Count of headers or < 0 on error
+ */
+static int parse_headers(char *in, size_t in_len, http_header_list *out_headers, char **out_end_pos) {
+
+	http_parser parser;
+	http_parser_init(&parser);
+	http_line header_lines[HTTP_PARSER_MAX_LINES];
 	char *end_pos;
 	int header_lines_count = 0;
-	header_lines_count = http_request_parse_header_lines(in, in_len, &header_lines, &end_pos);
+	header_lines_count = http_request_parse_header_lines(&parser, in, in_len, header_lines, &end_pos);
 	if (header_lines_count < 0) {
 		return header_lines_count;
 	}
 
-	http_header **headers;
+	http_header_list header_views;
+	http_header_list_init(&header_views);
 	int header_count = 0;
-	header_count = http_request_parse_headers(header_lines, header_lines_count, &headers);
+	header_count = http_request_parse_headers(header_lines, header_lines_count, &header_views, HTTP_REQUEST_MAX_HEADERS);
 	if (header_count < 0) {
-		split_line_free(header_lines, header_lines_count);
+		http_header_list_clear(&header_views);
 		return header_count;
 	}
 
-	split_line_free(header_lines, header_lines_count);
+	// Copy the headers, the output buffer is replaced with the body
+	for (int i = 0; i < header_count; i++) {
+		if (http_header_list_add(out_headers, http_header_list_at(&header_views, i)) < 0) {
+			header_count = ERROR_HEADER_CREATE_FAILED;
+			break;
+		}
+	}
+	http_header_list_clear(&header_views);
 
-	*out_headers = headers;
 	*out_end_pos = end_pos;
 	return header_count;
 }
 
 /**
- * @brief Execute CGI program
- * @details Executes CGI program and returns its output.
- *          NOTE: \p out is allocated also when the function returns ERROR_CGI_STATUS_NONZERO.
- *          Parts of this code are from https://jineshkj.wordpress.com/2006/12/22/how-to-capture-stdin-stdout-and-stderr-of-child-program/
- * 
- * @param path Path to the program
+ * @brief Set up CGI environment
+ * @details Replaces the environment of the forked process with the CGI variables of the request
+ *
  * @param params CGI parameters
- * @param[out] out Pointer to non-allocated memory where the result will be stored
- * @param[out] out_headers Pointer to non-allocated memory where the headers set by the CGI program will be stored
- * @param[out] out_header_count Will contain count of \p out_headers
- * @return Length of \p out or < 0 on error
  */
-int cgi_exec(const char *path, cgi_parameters *params, unsigned char **out, http_header ***out_headers, size_t *out_header_count) {
-
-	// TODO: Provide parameters in cgi_parameters
-	// Check if path points to existing file
-	zhttpd_log(LOG_DEBUG, "Statting %s", path);
-	struct stat cgi_prog_stat;
-	errno = 0;
-	if (stat(path, &cgi_prog_stat) != 0) {
-		if (errno != ENOENT) {
-			zhttpd_log(LOG_ERROR, "CGI program path stat failed!");
-			perror("stat");
-			return ERROR_CGI_EXEC_FAILED;
-		}
-	}
-	if (errno == ENOENT || !S_ISREG(cgi_prog_stat.st_mode)) {
-		// CGI binary not found or not regular file
-		zhttpd_log(LOG_ERROR, "CGI program path invalid!");
-		perror("stat");
-		return ERROR_CGI_PROG_PATH_INVALID;
-	}
-
-	// Check if requested file exists
-	struct stat cgi_script_stat;
-	errno = 0;
-	if (stat(params->script_filename, &cgi_script_stat) != 0) {
-		if (errno != ENOENT) {
-			zhttpd_log(LOG_ERROR, "CGI script path stat failed!");
-			perror("stat");
-			return ERROR_CGI_EXEC_FAILED;
-		}
-	}
-	if (errno == ENOENT || !S_ISREG(cgi_script_stat.st_mode)) {
-		// CGI script not found or not regular file
-		zhttpd_log(LOG_WARN, "CGI script doesn't exist");
-		return ERROR_CGI_SCRIPT_PATH_INVALID;
-	}
-
-	zhttpd_log(LOG_DEBUG, "Setting up CGI environment");
+static void setup_environment(cgi_parameters *params) {
 
 	// Convert numeric port to string
 	char port_str[6] = {0};
@@ -123,8 +101,8 @@ int cgi_exec(const char *path, cgi_parameters *params, unsigned char **out, http
 	setenv("REDIRECT_STATUS", "true", 1);
 
 	// Set HTTP headers as environment variables starting with "HTTP_"
-	for (size_t i = 0; i < params->req->header_count; i++) {
-		http_header *h = params->req->headers[i];
+	for (size_t i = 0; i < params->req->headers.count; i++) {
+		http_header *h = http_header_list_at(&params->req->headers, i);
 		char *name_upper = string_to_uppercase(h->name);
 		char *env_name = calloc(strlen(name_upper) + 6, sizeof(char));
 		snprintf(env_name, strlen(name_upper)+6, "HTTP_%s", name_upper);
@@ -137,6 +115,286 @@ int cgi_exec(const char *path, cgi_parameters *params, unsigned char **out, http
 		setenv(env_name, h->value, 0);
 		free(env_name);
 	}
+}
+
+/**
+ * @brief Close CGI pipe
+ * @details Stops watching the pipe and closes it
+ *
+ * @param fd Pipe end, set to -1
+ */
+static void close_pipe(int *fd) {
+	if (*fd == -1) return;
+	epoll_ctl(cgi_efd, EPOLL_CTL_DEL, *fd, NULL);
+	close(*fd);
+	*fd = -1;
+}
+
+/**
+ * @brief Reap CGI program
+ * @details Gets the exit status of the program without waiting for it
+ *
+ * @param proc CGI program
+ * @return 1 if the program has exited, 0 if it's still running
+ */
+static int reap_process(cgi_process *proc) {
+	pid_t ret;
+	while ((ret = waitpid(proc->pid, &proc->status, WNOHANG)) == -1 && errno == EINTR);
+	if (ret != proc->pid) return 0;
+	zhttpd_log(LOG_INFO, "CGI program exited with status code %d", proc->status);
+	proc->pid = -1;
+	return 1;
+}
+
+/**
+ * @brief Stop CGI program
+ * @details Closes the pipes, cancels the time limit and kills and reaps the program
+ *
+ * @param proc CGI program
+ */
+static void stop_process(cgi_process *proc) {
+	close_pipe(&proc->in_fd);
+	close_pipe(&proc->out_fd);
+	timer_cancel(proc->timers, &proc->timer);
+	if (proc->pid == -1) return;
+
+	if (kill(proc->pid, SIGKILL) == -1) {
+		zhttpd_log(LOG_ERROR, "Couldn't kill CGI process %d!", proc->pid);
+		perror("kill");
+	}
+	// Killed processes exit right away
+	int status;
+	while (waitpid(proc->pid, &status, 0) == -1 && errno == EINTR);
+	proc->pid = -1;
+}
+
+/**
+ * @brief Wait for CGI program exit
+ * @details Checks the program again after #CGI_REAP_INTERVAL_MS, at the latest when its time is up
+ *
+ * @param proc CGI program with complete output
+ */
+static void wait_process(cgi_process *proc) {
+	uint64_t retry_ms = monotonic_time_ms() + CGI_REAP_INTERVAL_MS;
+	timer_arm(proc->timers, &proc->timer, retry_ms < proc->deadline_ms ? retry_ms : proc->deadline_ms);
+}
+
+/**
+ * @brief Complete CGI program
+ * @details Reports the result to the done callback once the program has exited. A program that
+ *          has closed its output is left to exit by itself, its exit status is part of the result.
+ *          Programs that failed are killed.
+ *
+ * @param proc CGI program
+ * @param error 0 if the output is complete or the error that stopped the program
+ */
+static void complete_process(cgi_process *proc, int error) {
+	proc->error = error;
+	if (error == 0) {
+		close_pipe(&proc->in_fd);
+		close_pipe(&proc->out_fd);
+		if (!reap_process(proc)) {
+			zhttpd_log(LOG_DEBUG, "CGI program still running after closing its output");
+			wait_process(proc);
+			return;
+		}
+	}
+	stop_process(proc);
+	proc->done(proc, proc->done_data);
+}
+
+/**
+ * @brief Free CGI program
+ *
+ * @param proc Stopped CGI program
+ */
+static void free_process(cgi_process *proc) {
+	free(proc->payload);
+	free(proc->output);
+	free(proc);
+}
+
+/**
+ * @brief CGI timer callback
+ * @details Checks if a program that has closed its output has exited, and stops the program
+ *          that ran out of time
+ *
+ * @param timer Expired timer
+ * @param data CGI program
+ */
+static void cgi_timeout(timer_entry *timer, void *data) {
+	cgi_process *proc = data;
+	if (proc->out_fd == -1 && proc->error == 0) {
+		// Output complete, waiting for the exit
+		if (reap_process(proc)) {
+			proc->done(proc, proc->done_data);
+			return;
+		}
+		if (monotonic_time_ms() < proc->deadline_ms) {
+			wait_process(proc);
+			return;
+		}
+		zhttpd_log(LOG_ERROR, "CGI program didn't exit in time!");
+	} else {
+		zhttpd_log(LOG_ERROR, "CGI data read timeout!");
+	}
+	complete_process(proc, ERROR_CGI_EXEC_FAILED);
+}
+
+/**
+ * @brief Write payload to CGI program
+ * @details Writes as much of the request payload as the pipe takes. The input is closed
+ *          once everything has been written or the program stopped reading.
+ *
+ * @param proc CGI program with payload left to write
+ */
+static void write_payload(cgi_process *proc) {
+	while (proc->payload_pos < proc->payload_len) {
+		ssize_t n = write(proc->in_fd, proc->payload + proc->payload_pos, proc->payload_len - proc->payload_pos);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return;	// Continue when the pipe drains
+			zhttpd_log(LOG_DEBUG, "CGI program stopped reading its input");
+			break;
+		}
+		proc->payload_pos += n;
+	}
+	zhttpd_log(LOG_DEBUG, "Wrote %zu bytes to CGI program", proc->payload_pos);
+	close_pipe(&proc->in_fd);
+}
+
+/**
+ * @brief Read CGI program output
+ * @details Reads all currently available output
+ *
+ * @param proc CGI program
+ * @return 0 on end of output, 1 if more is coming or < 0 on error
+ */
+static int read_output(cgi_process *proc) {
+	while (1) {
+		if (proc->out_len == proc->out_cap) {
+			unsigned char *output = realloc(proc->output, proc->out_cap * 2);
+			if (output == NULL) return ERROR_CGI_EXEC_FAILED;
+			proc->output = output;
+			proc->out_cap *= 2;
+		}
+
+		ssize_t n = read(proc->out_fd, proc->output + proc->out_len, proc->out_cap - proc->out_len);
+		if (n == 0) {
+			// EOF, stop reading
+			zhttpd_log(LOG_DEBUG, "CGI program output EOF");
+			return 0;
+		}
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			zhttpd_log(LOG_ERROR, "CGI program output read failed!");
+			perror("read");
+			return ERROR_CGI_EXEC_FAILED;
+		}
+		proc->out_len += n;
+	}
+}
+
+/**
+ * @brief Initialize CGI support
+ * @details Creates the epoll set watching the pipes of the CGI programs. Call in each worker.
+ *
+ * @return Descriptor to poll for readability or < 0 on error
+ */
+int cgi_init(void) {
+	cgi_efd = epoll_create1(EPOLL_CLOEXEC);
+	if (cgi_efd == -1) {
+		zhttpd_log(LOG_ERROR, "CGI epoll init failed!");
+		perror("epoll_create1");
+	}
+	return cgi_efd;
+}
+
+/**
+ * @brief Free CGI support
+ * @details Cancel the running programs with cgi_cancel() first
+ */
+void cgi_free(void) {
+	if (cgi_efd != -1) close(cgi_efd);
+	cgi_efd = -1;
+}
+
+/**
+ * @brief Start CGI program
+ * @details Starts the CGI program without waiting for it. The request payload is copied
+ *          and written to the program as it reads it, the output is collected by
+ *          cgi_handle_events(). \p done is called when the program has completed its output
+ *          and exited, when it fails or when it runs longer than #CGI_READ_TIMEOUT_SECONDS.
+ *          The worker keeps serving other connections meanwhile.
+ *          Parts of this code are from https://jineshkj.wordpress.com/2006/12/22/how-to-capture-stdin-stdout-and-stderr-of-child-program/
+ * 
+ * @param path Path to the program
+ * @param params CGI parameters, needed only during the call
+ * @param done Function to call when the program has finished
+ * @param done_data Data passed to \p done
+ * @param[out] out Running program, pass it to cgi_finish() in \p done or to cgi_cancel()
+ * @return 0 on success or < 0 on error
+ */
+int cgi_start(const char *path, cgi_parameters *params, cgi_done_callback done, void *done_data, cgi_process **out) {
+
+	// Check if path points to existing file
+	zhttpd_log(LOG_DEBUG, "Statting %s", path);
+	struct stat cgi_prog_stat;
+	errno = 0;
+	if (stat(path, &cgi_prog_stat) != 0) {
+		if (errno != ENOENT) {
+			zhttpd_log(LOG_ERROR, "CGI program path stat failed!");
+			perror("stat");
+			return ERROR_CGI_EXEC_FAILED;
+		}
+	}
+	if (errno == ENOENT || !S_ISREG(cgi_prog_stat.st_mode)) {
+		// CGI binary not found or not regular file
+		zhttpd_log(LOG_ERROR, "CGI program path invalid!");
+		perror("stat");
+		return ERROR_CGI_PROG_PATH_INVALID;
+	}
+
+	// Check if requested file exists
+	struct stat cgi_script_stat;
+	errno = 0;
+	if (stat(params->script_filename, &cgi_script_stat) != 0) {
+		if (errno != ENOENT) {
+			zhttpd_log(LOG_ERROR, "CGI script path stat failed!");
+			perror("stat");
+			return ERROR_CGI_EXEC_FAILED;
+		}
+	}
+	if (errno == ENOENT || !S_ISREG(cgi_script_stat.st_mode)) {
+		// CGI script not found or not regular file
+		zhttpd_log(LOG_WARN, "CGI script doesn't exist");
+		return ERROR_CGI_SCRIPT_PATH_INVALID;
+	}
+
+	if (cgi_efd == -1) return ERROR_CGI_EXEC_FAILED;
+
+	cgi_process *proc = calloc(1, sizeof(cgi_process));
+	if (proc == NULL) return ERROR_CGI_EXEC_FAILED;
+	proc->pid = -1;
+	proc->in_fd = -1;
+	proc->out_fd = -1;
+	proc->out_cap = CGI_READ_BUF_SIZE;
+	proc->output = malloc(proc->out_cap);
+	proc->timers = params->timers;
+	proc->done = done;
+	proc->done_data = done_data;
+	timer_init(&proc->timer, cgi_timeout, proc);
+	if (params->req->payload != NULL && params->req->payload_len > 0) {
+		// The request buffer moves on to the next request meanwhile
+		proc->payload = malloc(params->req->payload_len);
+		if (proc->payload != NULL) memcpy(proc->payload, params->req->payload, params->req->payload_len);
+		proc->payload_len = params->req->payload_len;
+	}
+	if (proc->output == NULL || (proc->payload_len > 0 && proc->payload == NULL)) {
+		free_process(proc);
+		return ERROR_CGI_EXEC_FAILED;
+	}
 
 	/* Fork CGI program
 	 * We can't use popen, because it supports only one-way pipes
@@ -145,24 +403,31 @@ int cgi_exec(const char *path, cgi_parameters *params, unsigned char **out, http
 
 	zhttpd_log(LOG_DEBUG, "Starting CGI program");
 
+	// Close-on-exec, so programs started later don't keep these pipes open
 	int pipes[2][2];
-
-	int status = 0;
-	unsigned char *output = NULL;
-	size_t out_pos = 0;
-	
-	int pipe1_s = pipe(pipes[PARENT_READ_PIPE]);
-	int pipe2_s = pipe(pipes[PARENT_WRITE_PIPE]);
-	if (pipe1_s == -1 || pipe2_s == -1) {
+	if (pipe2(pipes[PARENT_READ_PIPE], O_CLOEXEC) == -1) {
+		zhttpd_log(LOG_ERROR, "CGI pipe creation failed!");
+		perror("pipe");
+		free_process(proc);
+		return ERROR_CGI_EXEC_FAILED;
+	}
+	if (pipe2(pipes[PARENT_WRITE_PIPE], O_CLOEXEC) == -1) {
 		zhttpd_log(LOG_ERROR, "CGI pipe creation failed!");
 		perror("pipe");
+		close(PARENT_READ_FD);
+		close(CHILD_WRITE_FD);
+		free_process(proc);
 		return ERROR_CGI_EXEC_FAILED;
 	}
 	pid_t pid = fork();
 
 	if (pid == 0) {
 		// Child
-		// Duplicate file descriptors
+		// The worker ignores SIGPIPE, give the CGI program the default behavior back
+		signal(SIGPIPE, SIG_DFL);
+		setup_environment(params);
+
+		// Duplicate file descriptors, the duplicates stay open in the program
 		// TODO: Check for errors
 		dup2(CHILD_READ_FD, STDIN_FILENO);
 		dup2(CHILD_WRITE_FD, STDOUT_FILENO);
@@ -182,114 +447,107 @@ int cgi_exec(const char *path, cgi_parameters *params, unsigned char **out, http
 			zhttpd_log(LOG_ERROR, "CGI execl failed!");
 			perror("execl");
 		}
-		exit(1);
-	} else if (pid < 0) {
+		_exit(1);
+	}
+
+	close(CHILD_READ_FD);
+	close(CHILD_WRITE_FD);
+	proc->out_fd = PARENT_READ_FD;
+	proc->in_fd = PARENT_WRITE_FD;
+
+	if (pid < 0) {
 		// Forking failed
 		zhttpd_log(LOG_ERROR, "CGI fork failed!");
 		perror("fork");
+		stop_process(proc);
+		free_process(proc);
 		return ERROR_CGI_EXEC_FAILED;
-	} else {
-		// Parent
+	}
+	proc->pid = pid;
+
+	/* Use fcntl to set the O_NONBLOCK flag to make the file descriptor
+	 * non-blocking. The naming of this function is a bit misleading. */
+	// TODO: Rename make_socket_nonblocking
+	struct epoll_event event = {0};
+	event.data.ptr = proc;
+	event.events = EPOLLIN;
+	if (make_socket_nonblocking(proc->out_fd) == -1 || make_socket_nonblocking(proc->in_fd) == -1 ||
+		epoll_ctl(cgi_efd, EPOLL_CTL_ADD, proc->out_fd, &event) == -1) {
+		zhttpd_log(LOG_ERROR, "Couldn't watch CGI program output!");
+		stop_process(proc);
+		free_process(proc);
+		return ERROR_CGI_EXEC_FAILED;
+	}
 
-		close(CHILD_READ_FD);
-		close(CHILD_WRITE_FD);
+	// Write possible (POST) parameters, the rest when the pipe has room
+	write_payload(proc);
+	event.events = EPOLLOUT;
+	if (proc->in_fd != -1 && epoll_ctl(cgi_efd, EPOLL_CTL_ADD, proc->in_fd, &event) == -1) {
+		zhttpd_log(LOG_ERROR, "Couldn't watch CGI program input!");
+		stop_process(proc);
+		free_process(proc);
+		return ERROR_CGI_EXEC_FAILED;
+	}
 
-		/* Use fcntl to set the O_NONBLOCK flag to make the file descriptor
-		 * non-blocking. The naming of this function is a bit misleading. */
-		// TODO: Rename make_socket_nonblocking
-		if (make_socket_nonblocking(PARENT_READ_FD) == -1) {
-			// Failed
-			close(PARENT_READ_FD);
-			close(PARENT_WRITE_FD);
-			zhttpd_log(LOG_ERROR, "Couldn't make CGI parent read file descriptor non-blocking!");
-			// Ask the CGI process to shut down
-			if (kill(pid, SIGTERM) == -1) {
-				// Failed!
-				zhttpd_log(LOG_ERROR, "Couldn't send SIGTERM to CGI process %d!", pid);
-				perror("kill");
-			}
-			return ERROR_CGI_EXEC_FAILED;
-		}
+	// Limit the time the CGI program may take
+	proc->deadline_ms = monotonic_time_ms() + CGI_READ_TIMEOUT_SECONDS * 1000;
+	timer_arm(proc->timers, &proc->timer, proc->deadline_ms);
 
-		// Write possible (POST) parameters
-		if (params->req->payload != NULL && params->req->payload_len > 0) {
-			// TODO: Ensure that all bytes are written
-			int w_res = write(PARENT_WRITE_FD, params->req->payload, params->req->payload_len);
-			zhttpd_log(LOG_DEBUG, "Wrote %d bytes to CGI program", w_res);
-		}
+	*out = proc;
+	return 0;
+}
 
-		// Read stdout / stderr
-		char buf[2048] = {0};
-		int read_bytes = 0;
-		out_pos = 0;
-		size_t out_cap = 2048;
-		output = calloc(out_cap, sizeof(char));
-		int read_cgi_data = 1;
-		time_t cgi_data_read_start = time(NULL);	// Start time
-
-		zhttpd_log(LOG_DEBUG, "Reading CGI output");
-
-		while (read_cgi_data) {
-			errno = 0;
-			read_bytes = read(PARENT_READ_FD, buf, sizeof(buf));
-			if (read_bytes == 0) {
-				// EOF, stop reading
-				zhttpd_log(LOG_DEBUG, "CGI program output EOF");
-				read_cgi_data = 0;
-			}
-			if (read_bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-				// Error, other than EAGAIN or EWOULDBLOCK
-				zhttpd_log(LOG_ERROR, "CGI program output read failed!");
-				perror("read");
-				free(output);
-				close(PARENT_READ_FD);
-				close(PARENT_WRITE_FD);
-				return ERROR_CGI_EXEC_FAILED;
-			}
-
-			if (read_bytes > 0) {
-				// Read OK
-				//zhttpd_log(LOG_DEBUG, "Read %d bytes", read_bytes);
-				while (out_cap < out_pos + read_bytes) {
-					out_cap *= 2;
-					output = realloc(output, out_cap * sizeof(char));
-				}
-				memcpy(&output[out_pos], buf, read_bytes);
-				out_pos += read_bytes;
-			}
-
-			if (read_cgi_data && time(NULL) - cgi_data_read_start >= CGI_READ_TIMEOUT_SECONDS) {
-				zhttpd_log(LOG_ERROR, "CGI data read timeout!");
-				free(output);
-				close(PARENT_READ_FD);
-				close(PARENT_WRITE_FD);
-				return ERROR_CGI_EXEC_FAILED;
-			}
-
-			usleep(5000);	// 5 ms
-		}
+/**
+ * @brief Handle CGI program events
+ * @details Writes payloads and reads output of the programs whose pipes are ready and calls
+ *          the done callbacks of the finished ones. Events are taken one at a time, because
+ *          a callback may free a program that has more events pending.
+ */
+void cgi_handle_events(void) {
+	struct epoll_event event;
+	while (epoll_wait(cgi_efd, &event, 1, 0) == 1) {
+		cgi_process *proc = event.data.ptr;
+		if (proc->in_fd != -1) write_payload(proc);
+		int ret = read_output(proc);
+		if (ret <= 0) complete_process(proc, ret);
+	}
+}
 
-		zhttpd_log(LOG_DEBUG, "All read");
-		close(PARENT_READ_FD);
-		close(PARENT_WRITE_FD);
+/**
+ * @brief Get CGI result
+ * @details Parses the output of the finished program and frees the program.
+ *          NOTE: \p out is allocated also when the function returns ERROR_CGI_STATUS_NONZERO.
+ * 
+ * @param proc Program passed to the done callback
+ * @param[out] out Pointer to non-allocated memory where the result will be stored
+ * @param[out] out_headers Initialized list the headers set by the CGI program will be added to, clear it after use
+ * @return Length of \p out or < 0 on error
+ */
+int cgi_finish(cgi_process *proc, unsigned char **out, http_header_list *out_headers) {
+	if (proc->error != 0) {
+		int error = proc->error;
+		free_process(proc);
+		return error;
+	}
 
-		output = realloc(output, (out_pos+1) * sizeof(char));
-		output[out_pos] = '\0';
+	unsigned char *output = proc->output;
+	size_t out_pos = proc->out_len;
+	int status = proc->status;
+	proc->output = NULL;
+	free_process(proc);
 
-		zhttpd_log(LOG_DEBUG, "CGI program outputted %d bytes", out_pos);
-		// Output read, wait for program exit (probably has already)
-		do {
-			waitpid(pid, &status, WUNTRACED);
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
-		zhttpd_log(LOG_INFO, "CGI program exited with status code %d", status);
+	unsigned char *terminated = realloc(output, out_pos + 1);
+	if (terminated == NULL) {
+		free(output);
+		return ERROR_CGI_EXEC_FAILED;
 	}
-
-	if (output == NULL) return ERROR_CGI_EXEC_FAILED;	// CGI program must output something
+	output = terminated;
+	output[out_pos] = '\0';
+	zhttpd_log(LOG_DEBUG, "CGI program outputted %zu bytes", out_pos);
 
 	// Parse headers
-	http_header **headers;
 	char *end_pos;
-	int header_count = parse_headers((char *)output, out_pos, &headers, &end_pos);
+	int header_count = parse_headers((char *)output, out_pos, out_headers, &end_pos);
 	if (header_count < 0) {
 		zhttpd_log(LOG_ERROR, "CGI response HTTP header parsing failed!");
 		free(output);
@@ -307,12 +565,10 @@ int cgi_exec(const char *path, cgi_parameters *params, unsigned char **out, http
 	// Just some logging
 	zhttpd_log(LOG_DEBUG, "CGI response contains %d header(s):", header_count);
 	for (size_t i = 0; i < header_count; i++) {
-		http_header *h = headers[i];
+		http_header *h = http_header_list_at(out_headers, i);
 		zhttpd_log(LOG_DEBUG, "  - %s: \"%s\"", h->name, h->value);
 	}
 
-	*out_headers = headers;
-	*out_header_count = header_count;
 	*out = output;
 
 	// CGI program has exited
@@ -322,3 +578,15 @@ int cgi_exec(const char *path, cgi_parameters *params, unsigned char **out, http
 	}
 	return content_length;
 }
+
+/**
+ * @brief Cancel CGI program
+ * @details Kills the program and frees it without calling the done callback,
+ *          e.g. when the client has gone away
+ *
+ * @param proc Running program
+ */
+void cgi_cancel(cgi_process *proc) {
+	stop_process(proc);
+	free_process(proc);
+}
@@ -0,0 +1,340 @@
+#include "file_cache.h"
+#include "shared_cache.h"
+
+static int inotify_fd = -1;				// Watches the directories of cached files, -1 when disabled
+static char *cache_root = NULL;			// Directories from here down to a cached file are watched
+static size_t cache_root_len = 0;
+static file_cache_entry *buckets[FILE_CACHE_BUCKETS];	// Cached entries by key
+static file_cache_entry *lru_head = NULL;	// Most recently used entry
+static file_cache_entry *lru_tail = NULL;	// Least recently used entry, evicted first
+static size_t cached_count = 0;			// Count of cached entries, each holds a descriptor
+
+/**
+ * @brief Hash path
+ * @details FNV-1a over the path
+ *
+ * @param path Path to hash
+ * @return Bucket index
+ */
+static size_t hash_path(const char *path) {
+	size_t h = 2166136261u;
+	for (const char *p = path; *p != '\0'; p++) {
+		h ^= (unsigned char)*p;
+		h *= 16777619u;
+	}
+	return h & (FILE_CACHE_BUCKETS - 1);
+}
+
+/**
+ * @brief Destroy entry
+ * @details Closes the descriptor and frees the entry
+ *
+ * @param e Entry not in the cache and not in use
+ */
+static void destroy_entry(file_cache_entry *e) {
+	close(e->file.fd);
+	free(e->file.path);
+	free(e->key);
+	free(e);
+}
+
+/**
+ * @brief Unlink entry from LRU list
+ *
+ * @param e Cached entry
+ */
+static void lru_unlink(file_cache_entry *e) {
+	if (e->lru_prev != NULL) e->lru_prev->lru_next = e->lru_next; else lru_head = e->lru_next;
+	if (e->lru_next != NULL) e->lru_next->lru_prev = e->lru_prev; else lru_tail = e->lru_prev;
+	e->lru_prev = NULL;
+	e->lru_next = NULL;
+}
+
+/**
+ * @brief Link entry to LRU list head
+ *
+ * @param e Entry not in the LRU list
+ */
+static void lru_push(file_cache_entry *e) {
+	e->lru_prev = NULL;
+	e->lru_next = lru_head;
+	if (lru_head != NULL) lru_head->lru_prev = e; else lru_tail = e;
+	lru_head = e;
+}
+
+/**
+ * @brief Drop entry from cache
+ * @details Removes the entry from the hash and the LRU list. The entry is destroyed
+ *          right away if it isn't in use, otherwise when the last copy is released.
+ *
+ * @param e Cached entry
+ */
+static void drop_entry(file_cache_entry *e) {
+	file_cache_entry **p = &buckets[hash_path(e->key)];
+	while (*p != e) p = &(*p)->hash_next;
+	*p = e->hash_next;
+	lru_unlink(e);
+	e->cached = 0;
+	cached_count--;
+	if (e->refs == 0) destroy_entry(e);
+}
+
+/**
+ * @brief Drop all entries
+ */
+static void drop_all(void) {
+	while (lru_head != NULL) drop_entry(lru_head);
+}
+
+/**
+ * @brief Release entry copy
+ * @details Release callback of the resolved files given out by file_cache_open()
+ *
+ * @param data Entry of the copy
+ */
+static void release_entry(void *data) {
+	file_cache_entry *e = data;
+	e->refs--;
+	if (e->refs == 0 && e->cached == 0) destroy_entry(e);
+}
+
+/**
+ * @brief Give out entry copy
+ *
+ * @param e Cached entry
+ * @param[out] out Copy of the resolved file, released with resolved_file_close()
+ */
+static void copy_entry(file_cache_entry *e, resolved_file *out) {
+	*out = e->file;
+	out->release = release_entry;
+	out->release_data = e;
+	e->refs++;
+}
+
+/**
+ * @brief Watch directories of file
+ * @details Adds watches on the directories from the cache root down to the one containing the file,
+ *          so renaming any of them is noticed. Watching a directory again is cheap, the kernel
+ *          returns its existing watch.
+ *
+ * @param path File path
+ * @return Watch of the directory containing the file or -1 on error
+ */
+static int watch_directories(const char *path) {
+	const uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+		IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+	const char *last_slash = strrchr(path, '/');
+	if (last_slash == NULL) return -1;
+	size_t dir_len = last_slash - path;
+	if (dir_len == 0 || dir_len >= PATH_MAX) return -1;
+
+	char dir[PATH_MAX];
+	memcpy(dir, path, dir_len);
+	dir[dir_len] = '\0';
+
+	// Start from the root if the file is under it
+	size_t pos = dir_len;
+	if (dir_len + 1 >= cache_root_len && strncmp(path, cache_root, cache_root_len) == 0) {
+		pos = cache_root_len > 0 && cache_root[cache_root_len-1] == '/' ? cache_root_len - 1 : cache_root_len;
+	}
+
+	int wd = -1;
+	while (1) {
+		// Watch dir[0..pos), then continue to the next slash
+		char saved = dir[pos];
+		dir[pos] = '\0';
+		wd = inotify_add_watch(inotify_fd, pos > 0 ? dir : "/", mask);
+		dir[pos] = saved;
+		if (wd == -1) {
+			zhttpd_log(LOG_WARN, "Can't watch \"%s\" for changes", dir);
+			perror("inotify_add_watch");
+			return -1;
+		}
+		if (pos >= dir_len) break;
+		char *next = strchr(&dir[pos + 1], '/');
+		pos = next != NULL ? (size_t)(next - dir) : dir_len;
+	}
+	return wd;
+}
+
+/**
+ * @brief Watch directories of file
+ * @details Makes this worker notice changes to the file, see file_cache_handle_events()
+ *
+ * @param path File path
+ * @return Watch of the directory containing the file or -1 if changes can't be watched
+ */
+int file_cache_watch(const char *path) {
+	if (inotify_fd == -1) return -1;
+	return watch_directories(path);
+}
+
+/**
+ * @brief Initialize file cache
+ * @details Starts watching for changes. Call in each worker, the cache is per process.
+ *
+ * @param root Directory of the served files, changes below it invalidate cached files
+ * @return inotify descriptor to poll for readability or -1 if caching is disabled
+ */
+int file_cache_init(const char *root) {
+	cache_root = strdup(root);
+	if (cache_root == NULL) return -1;
+	cache_root_len = strlen(root);
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		zhttpd_log(LOG_WARN, "inotify unavailable, files aren't cached");
+		perror("inotify_init1");
+		free(cache_root);
+		cache_root = NULL;
+	}
+	return inotify_fd;
+}
+
+/**
+ * @brief Free file cache
+ * @details Drops all entries and stops watching. Entries still in use are freed when released.
+ */
+void file_cache_free(void) {
+	drop_all();
+	if (inotify_fd != -1) close(inotify_fd);
+	inotify_fd = -1;
+	free(cache_root);
+	cache_root = NULL;
+}
+
+/**
+ * @brief Open file through cache
+ * @details Gives a copy of the cached file for \p path, or resolves it with resolved_file_open()
+ *          and caches it. Cached descriptors are shared, release the copy with resolved_file_close()
+ *          or pass its release callback on together with the descriptor.
+ *          The least recently used files are closed to stay within #FILE_CACHE_MAX_FDS.
+ *
+ * @param a Arena used for the path of an index file
+ * @param path Filesystem path
+ * @param[out] out Resolved file
+ * @return 0 on success, < 0 on error
+ */
+int file_cache_open(arena *a, char *path, resolved_file *out) {
+	if (inotify_fd == -1) return resolved_file_open(a, path, out);
+
+	size_t bucket = hash_path(path);
+	for (file_cache_entry *e = buckets[bucket]; e != NULL; e = e->hash_next) {
+		if (strcmp(e->key, path) == 0) {
+			// Hit, make it the most recently used
+			lru_unlink(e);
+			lru_push(e);
+			copy_entry(e, out);
+			return 0;
+		}
+	}
+
+	int ret = resolved_file_open(a, path, out);
+	if (ret < 0) return ret;
+
+	// Cache the file if its directories can be watched, otherwise just serve it
+	int wd = watch_directories(out->path);
+	if (wd == -1) return 0;
+	file_cache_entry *e = calloc(1, sizeof(file_cache_entry));
+	if (e == NULL) return 0;
+	e->key = strdup(path);
+	char *file_path = strdup(out->path);
+	if (e->key == NULL || file_path == NULL) {
+		free(e->key);
+		free(file_path);
+		free(e);
+		return 0;
+	}
+	e->file = *out;
+	e->file.path = file_path;
+	snprintf(e->type, sizeof(e->type), "%s", out->type);
+	e->file.type = e->type;
+	e->name = strrchr(file_path, '/') + 1;
+	e->is_index = strcmp(path, file_path) != 0;
+	e->wd = wd;
+	e->cached = 1;
+
+	e->hash_next = buckets[bucket];
+	buckets[bucket] = e;
+	lru_push(e);
+	cached_count++;
+
+	// Stay within the descriptor budget, in-use entries close when released
+	while (cached_count > FILE_CACHE_MAX_FDS) drop_entry(lru_tail);
+
+	copy_entry(e, out);
+	return 0;
+}
+
+/**
+ * @brief Find precompressed siblings of file
+ * @details Looks the siblings up with resolved_file_find_encodings() unless that has been done.
+ *          The result is kept in the cache entry of a copy from file_cache_open(), changes to
+ *          the siblings drop the entry.
+ *
+ * @param file Resolved file
+ * @return HTTP_ENCODING_* flags of the siblings
+ */
+int file_cache_find_encodings(resolved_file *file) {
+	if (file->encodings >= 0) return file->encodings;
+	if (file->release == release_entry) {
+		file_cache_entry *e = file->release_data;
+		if (e->file.encodings < 0) e->file.encodings = resolved_file_find_encodings(file);
+		file->encodings = e->file.encodings;
+	} else {
+		file->encodings = resolved_file_find_encodings(file);
+	}
+	return file->encodings;
+}
+
+/**
+ * @brief Handle change notifications
+ * @details Reads pending inotify events and drops the cached files they concern, also the ones
+ *          of the shared cache this worker guards. Changes to a precompressed sibling drop
+ *          the file it belongs to. Changes to directories drop the whole cache,
+ *          they may move any file below them.
+ */
+void file_cache_handle_events(void) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (1) {
+		ssize_t len = read(inotify_fd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				zhttpd_log(LOG_ERROR, "inotify read failed!");
+				perror("read");
+				drop_all();
+				shared_cache_invalidate_all();
+			}
+			return;
+		}
+
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			if ((ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_ISDIR)) || ev->len == 0) {
+				// Events may be lost or directories moved, start over
+				drop_all();
+				shared_cache_invalidate_all();
+				continue;
+			}
+
+			shared_cache_invalidate(ev->wd, ev->name);
+
+			// Precompressed siblings are part of the file they belong to
+			size_t base_len = http_encoding_strip_suffix(ev->name, strlen(ev->name));
+
+			file_cache_entry *e = lru_head;
+			while (e != NULL) {
+				file_cache_entry *next = e->lru_next;
+				// A new or removed file may change which index file a directory resolves to
+				if (e->wd == ev->wd && (e->is_index || strcmp(e->name, ev->name) == 0 ||
+					(strlen(e->name) == base_len && strncmp(e->name, ev->name, base_len) == 0))) drop_entry(e);
+				e = next;
+			}
+		}
+	}
+}
@@ -1,5 +1,12 @@
 #include "file_io.h"
 
+static const char *index_names[] = {
+	"index.html",
+	"index.htm",
+	"index.php",
+	NULL	// Guard entry, must be last
+};
+
 /**
  * @brief Read file to buffer
  * @details Reads file to given non-allocated buffer
@@ -62,31 +69,180 @@ ssize_t read_file(const char *path, unsigned char **out) {
 }
 
 /**
- * @brief Get file size
- * @details Gets file size in bytes
- * 
- * @param path File path
- * @param[out] file_size Pointer to memory address that will contain the file size
- * 
+ * @brief Convert open() errno to file error
+ *
+ * @param err errno value
+ * @return ERROR_FILE_IO_* error code
+ */
+static int open_error(int err) {
+	if (err == EACCES || err == EPERM) {
+		// Requested access isn't allowed
+		return ERROR_FILE_IO_NO_ACCESS;
+	} else if (err == ENOENT || err == ENOTDIR || err == ENAMETOOLONG || err == ELOOP) {
+		// Requested file doesn't exist
+		return ERROR_FILE_IO_NO_ENT;
+	}
+	return ERROR_FILE_IO_GENERAL;
+}
+
+/**
+ * @brief Open index file
+ * @details Opens the first regular file of #index_names in the directory
+ *
+ * @param dir_fd Open directory
+ * @param[out] st Status of the opened file
+ * @param[out] name Name of the opened file
+ * @return Descriptor of the index file or < 0 on error
+ */
+static int open_index_file(int dir_fd, struct stat *st, const char **name) {
+	for (int i = 0; index_names[i] != NULL; i++) {
+		int fd = openat(dir_fd, index_names[i], O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+		if (fd == -1) {
+			if (errno != ENOENT) {
+				zhttpd_log(LOG_ERROR, "Can't open index file \"%s\"", index_names[i]);
+				perror("openat");
+			}
+			continue;
+		}
+		if (fstat(fd, st) == 0 && S_ISREG(st->st_mode)) {
+			*name = index_names[i];
+			return fd;
+		}
+		close(fd);
+	}
+	zhttpd_log(LOG_WARN, "No index file found");
+	return ERROR_FILE_IO_NO_ENT;
+}
+
+/**
+ * @brief Resolve requested file
+ * @details Opens \p path and gets its status with one fstat(). Directories are resolved to their
+ *          index file. The size, modification time, identity and Content-Type are taken from
+ *          the open descriptor, so they all describe the same file. Precompressed siblings are
+ *          left unknown, see resolved_file_find_encodings().
+ *
+ * @param a Arena used for the path of an index file
+ * @param path Filesystem path
+ * @param[out] out Resolved file, close it with resolved_file_close()
  * @return 0 on success, < 0 on error
  */
-int get_file_size(const char *path, off_t *file_size) {
-	struct stat file_stat;
-	errno = 0;
-	if (stat(path, &file_stat) == -1) {
-		if (errno == EACCES) {
-			return ERROR_FILE_IO_NO_ACCESS;
-		} else if (errno == ENOENT) {
-			return ERROR_FILE_IO_NO_ENT;
+int resolved_file_open(arena *a, char *path, resolved_file *out) {
+	out->fd = -1;
+	out->path = path;
+	out->type = NULL;
+	out->encodings = -1;
+	out->encoding = 0;
+	out->release = NULL;
+	out->release_data = NULL;
+
+	// Non-blocking, so special files like FIFOs can't stall the worker
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (fd == -1) return open_error(errno);
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		zhttpd_log(LOG_ERROR, "Can't stat \"%s\"", path);
+		perror("fstat");
+		close(fd);
+		return ERROR_FILE_IO_GENERAL;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		const char *index_name;
+		int index_fd = open_index_file(fd, &st, &index_name);
+		close(fd);
+		if (index_fd < 0) return index_fd;
+		fd = index_fd;
+
+		size_t path_len = strlen(path);
+		if (arena_sprintf(a, &out->path, "%s%s%s", path, (path[path_len-1] == '/' ? "" : "/"), index_name) < 0) {
+			close(fd);
+			return ERROR_FILE_IO_GENERAL;
 		}
-		// Stat failed
-		zhttpd_log(LOG_ERROR, "get_file_size stat failed!");
-		perror("stat");
+
+	} else if (!S_ISREG(st.st_mode)) {
+		// Only regular files are served
+		close(fd);
+		return ERROR_FILE_IO_NO_ACCESS;
+	}
+
+	out->fd = fd;
+	out->size = st.st_size;
+	out->mtime = st.st_mtim;
+	out->dev = st.st_dev;
+	out->ino = st.st_ino;
+	http_date_format(st.st_mtime, out->last_modified);
+	http_etag_format(st.st_ino, st.st_size, &st.st_mtim, out->etag);
+	out->type = mime_type_by_file(out->path, fd, &st);
+	if (out->type == NULL) {
+		zhttpd_log(LOG_ERROR, "Content-Type guessing failed!");
+		resolved_file_close(out);
 		return ERROR_FILE_IO_GENERAL;
 	}
-	if (S_ISDIR(file_stat.st_mode)) {
-		return ERROR_FILE_IS_DIR;
+	return 0;
+}
+
+/**
+ * @brief Read resolved file
+ * @details Reads the whole file with pread(), so the file offset of a shared descriptor doesn't move
+ *
+ * @param file Open resolved file
+ * @param[out] buf Buffer of at least \p file->size bytes
+ * @return 0 on success, < 0 on error or if the file got shorter
+ */
+int resolved_file_read(const resolved_file *file, unsigned char *buf) {
+	off_t pos = 0;
+	while (pos < file->size) {
+		ssize_t n = pread(file->fd, buf + pos, file->size - pos, pos);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			zhttpd_log(LOG_ERROR, "Can't read \"%s\"", file->path);
+			perror("pread");
+			return ERROR_FILE_IO_GENERAL;
+		}
+		if (n == 0) return ERROR_FILE_IO_GENERAL;
+		pos += n;
 	}
-	*file_size = file_stat.st_size;
 	return 0;
 }
+
+/**
+ * @brief Close resolved file
+ * @details Closes the descriptor or calls the release callback of the file, unless the ownership
+ *          of the descriptor has been passed on
+ *
+ * @param file Resolved file
+ */
+void resolved_file_close(resolved_file *file) {
+	if (file->fd == -1) return;
+	if (file->release != NULL) {
+		file->release(file->release_data);
+	} else {
+		close(file->fd);
+	}
+	file->fd = -1;
+	file->release = NULL;
+}
+
+/**
+ * @brief Find precompressed siblings
+ * @details Checks which precompressed versions, like "style.css.gz", exist next to the file.
+ *          Precompressed files themselves have none. Costs a stat() per coding, so it's
+ *          only done for clients that accept one of them.
+ *
+ * @param file Resolved file
+ * @return HTTP_ENCODING_* flags of the siblings that are regular files
+ */
+int resolved_file_find_encodings(const resolved_file *file) {
+	size_t path_len = strlen(file->path);
+	if (http_encoding_strip_suffix(file->path, path_len) != path_len) return 0;
+
+	int encodings = 0;
+	char sibling[PATH_MAX];
+	for (int i = 0; i < HTTP_ENCODING_COUNT; i++) {
+		struct stat st;
+		if (snprintf(sibling, sizeof(sibling), "%s%s", file->path, http_encoding_suffix(1 << i)) >= (int)sizeof(sibling)) continue;
+		if (stat(sibling, &st) == 0 && S_ISREG(st.st_mode)) encodings |= 1 << i;
+	}
+	return encodings;
+}
@@ -0,0 +1,279 @@
+#include "output_queue.h"
+
+/**
+ * @brief Release segment
+ * @details Calls the release callback of the segment or closes the file of a file segment
+ *          without one and frees the segment
+ *
+ * @param seg Segment to release
+ */
+static void release_segment(output_segment *seg) {
+	if (seg->release != NULL) {
+		seg->release(seg->release_data);
+	} else if (seg->type == OUTPUT_SEGMENT_FILE && seg->fd != -1) {
+		close(seg->fd);
+	}
+	free(seg);
+}
+
+/**
+ * @brief Append segment
+ * @details Adds the segment to the end of the queue
+ *
+ * @param q Output queue
+ * @param seg Segment to add
+ */
+static void append_segment(output_queue *q, output_segment *seg) {
+	seg->next = NULL;
+	if (q->tail != NULL) {
+		q->tail->next = seg;
+	} else {
+		q->head = seg;
+	}
+	q->tail = seg;
+}
+
+/**
+ * @brief Remove first segment
+ * @details Removes the fully sent first segment from the queue and releases it
+ *
+ * @param q Output queue
+ */
+static void pop_segment(output_queue *q) {
+	output_segment *seg = q->head;
+	q->head = seg->next;
+	if (q->head == NULL) q->tail = NULL;
+	release_segment(seg);
+}
+
+/**
+ * @brief Initialize output queue
+ * @details Initializes empty \ref output_queue
+ *
+ * @param q Output queue to initialize
+ */
+void output_queue_init(output_queue *q) {
+	q->head = NULL;
+	q->tail = NULL;
+}
+
+/**
+ * @brief Clear output queue
+ * @details Releases all queued segments without sending them
+ *
+ * @param q Output queue to clear
+ */
+void output_queue_clear(output_queue *q) {
+	while (q->head != NULL) {
+		pop_segment(q);
+	}
+}
+
+/**
+ * @brief Check if output queue is empty
+ *
+ * @param q Output queue
+ * @return 1 if there's nothing to send, 0 otherwise
+ */
+int output_queue_empty(output_queue *q) {
+	return q->head == NULL;
+}
+
+/**
+ * @brief Queue memory buffers
+ * @details Adds the buffers of \p iov to the end of the queue as one segment. The buffers must stay
+ *          valid until \p release is called, which happens once they have been sent or the queue
+ *          is cleared, also on error.
+ *
+ * @param q Output queue
+ * @param iov Buffers to send, the vector itself is copied
+ * @param iov_count Count of entries in \p iov, at most #OUTPUT_SEGMENT_IOV_MAX
+ * @param release Function to call when the buffers aren't needed anymore, may be NULL
+ * @param release_data Data passed to \p release
+ * @return 0 on success, < 0 on error
+ */
+int output_queue_add_iovec(output_queue *q, const struct iovec *iov, int iov_count, output_release_callback release, void *release_data) {
+	output_segment *seg = NULL;
+	if (iov_count <= OUTPUT_SEGMENT_IOV_MAX) seg = calloc(1, sizeof(output_segment));
+	if (seg == NULL) {
+		if (release != NULL) release(release_data);
+		return ERROR_OUTPUT_ALLOC_FAILED;
+	}
+	seg->type = OUTPUT_SEGMENT_MEMORY;
+	seg->iov_count = 0;
+	for (int i = 0; i < iov_count; i++) {
+		// Nothing to send from empty buffers
+		if (iov[i].iov_len > 0) seg->iov[seg->iov_count++] = iov[i];
+	}
+	seg->iov_index = 0;
+	seg->release = release;
+	seg->release_data = release_data;
+	seg->fd = -1;
+	if (seg->iov_count == 0) {
+		release_segment(seg);
+		return 0;
+	}
+	append_segment(q, seg);
+	return 0;
+}
+
+/**
+ * @brief Queue memory buffer
+ * @details Adds \p buf to the end of the queue. The queue takes ownership of \p buf
+ *          and frees it once it has been sent, also on error.
+ *
+ * @param q Output queue
+ * @param buf Data to send, allocated with malloc()
+ * @param len Length of \p buf
+ * @return 0 on success, < 0 on error
+ */
+int output_queue_add_buffer(output_queue *q, char *buf, size_t len) {
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len
+	};
+	return output_queue_add_iovec(q, &iov, 1, free, buf);
+}
+
+/**
+ * @brief Queue file range
+ * @details Adds \p len bytes of \p fd starting from \p offset to the end of the queue.
+ *          The queue takes ownership of \p fd and closes it once it has been sent, also on error.
+ *          Actually calls output_queue_add_file2() without a release callback.
+ *
+ * @param q Output queue
+ * @param fd File to send
+ * @param offset Offset of the first byte to send
+ * @param len Count of bytes to send
+ * @return 0 on success, < 0 on error
+ */
+int output_queue_add_file(output_queue *q, int fd, off_t offset, off_t len) {
+	return output_queue_add_file2(q, fd, offset, len, NULL, NULL);
+}
+
+/**
+ * @brief Queue file range with release callback
+ * @details Adds \p len bytes of \p fd starting from \p offset to the end of the queue.
+ *          Once the range has been sent, also on error, \p release is called. Without
+ *          \p release the queue closes \p fd instead.
+ *
+ * @param q Output queue
+ * @param fd File to send, must stay open until \p release is called
+ * @param offset Offset of the first byte to send
+ * @param len Count of bytes to send
+ * @param release Function to call when the file isn't needed anymore, may be NULL
+ * @param release_data Data passed to \p release
+ * @return 0 on success, < 0 on error
+ */
+int output_queue_add_file2(output_queue *q, int fd, off_t offset, off_t len, output_release_callback release, void *release_data) {
+	output_segment *seg = len > 0 ? calloc(1, sizeof(output_segment)) : NULL;
+	if (seg == NULL) {
+		// Nothing to send or out of memory, done with the file either way
+		if (release != NULL) {
+			release(release_data);
+		} else {
+			close(fd);
+		}
+		return len > 0 ? ERROR_OUTPUT_ALLOC_FAILED : 0;
+	}
+	seg->type = OUTPUT_SEGMENT_FILE;
+	seg->fd = fd;
+	seg->file_offset = offset;
+	seg->file_remaining = len;
+	seg->release = release;
+	seg->release_data = release_data;
+	append_segment(q, seg);
+	return 0;
+}
+
+/**
+ * @brief Send memory segments
+ * @details Gathers the buffers of consecutive memory segments from the head of the queue
+ *          and sends them with one sendmsg(). Fully sent segments are released.
+ *
+ * @param q Output queue, the head must be a memory segment
+ * @param sock Socket to write to
+ * @return Sent byte count or -1 on error with errno set
+ */
+static ssize_t send_memory_segments(output_queue *q, int sock) {
+	struct iovec iov[OUTPUT_WRITEV_IOV_MAX];
+	int iov_count = 0;
+
+	for (output_segment *seg = q->head; seg != NULL && seg->type == OUTPUT_SEGMENT_MEMORY; seg = seg->next) {
+		if (iov_count + seg->iov_count - seg->iov_index > OUTPUT_WRITEV_IOV_MAX) break;
+		for (int i = seg->iov_index; i < seg->iov_count; i++) {
+			iov[iov_count++] = seg->iov[i];
+		}
+	}
+
+	struct msghdr msg = {0};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov_count;
+	ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (n == -1) return -1;
+
+	// Advance past the sent data
+	size_t left = n;
+	while (left > 0) {
+		output_segment *seg = q->head;
+		struct iovec *v = &seg->iov[seg->iov_index];
+		if (left < v->iov_len) {
+			v->iov_base = (char *)v->iov_base + left;
+			v->iov_len -= left;
+			break;
+		}
+		left -= v->iov_len;
+		seg->iov_index++;
+		if (seg->iov_index == seg->iov_count) pop_segment(q);
+	}
+
+	return n;
+}
+
+/**
+ * @brief Flush output queue
+ * @details Writes queued segments to the non-blocking socket until the socket buffer
+ *          fills up or the queue is empty. Consecutive memory segments are sent with one
+ *          sendmsg(), file segments with sendfile() without copying them to userspace.
+ *
+ * @param q Output queue
+ * @param sock Non-blocking socket to write to
+ * @return 0 if the queue is empty, 1 if the socket is full and data is still queued or < 0 on error
+ */
+int output_queue_flush(output_queue *q, int sock) {
+	while (q->head != NULL) {
+		output_segment *seg = q->head;
+		output_segment_type type = seg->type;	// Memory segments may be released while sending
+		ssize_t n;
+
+		if (type == OUTPUT_SEGMENT_MEMORY) {
+			n = send_memory_segments(q, sock);
+		} else {
+			size_t count = seg->file_remaining > SENDFILE_CHUNK_SIZE ? SENDFILE_CHUNK_SIZE : seg->file_remaining;
+			n = sendfile(sock, seg->fd, &seg->file_offset, count);
+		}
+
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// Socket buffer full, continue when it becomes writable
+				return 1;
+			}
+			zhttpd_log(LOG_ERROR, "Sending failed!");
+			perror(type == OUTPUT_SEGMENT_MEMORY ? "sendmsg" : "sendfile");
+			return ERROR_OUTPUT_SEND_FAILED;
+		}
+
+		if (type == OUTPUT_SEGMENT_FILE) {
+			if (n == 0) {
+				// The file got truncated while sending it
+				zhttpd_log(LOG_ERROR, "File ended %ld bytes early!", (long)seg->file_remaining);
+				return ERROR_OUTPUT_FILE_READ_FAILED;
+			}
+			seg->file_remaining -= n;
+			if (seg->file_remaining == 0) pop_segment(q);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,357 @@
+#include "shared_cache.h"
+#include "file_cache.h"
+
+/**
+ * Watch of this worker guarding a slot
+ */
+typedef struct {
+	uint32_t seq;	/**< Slot version the watch was added for, 0 if none */
+	int wd;			/**< inotify watch of the file directory */
+} slot_watch;
+
+static unsigned char *slots = NULL;		// Shared mapping, created before forking
+static size_t slot_count = 0;			// Multiple of SHARED_CACHE_WAYS, set count is a power of two
+static slot_watch *watches = NULL;		// Per worker, each process gets its own copy on fork
+
+/**
+ * @brief Get slot
+ *
+ * @param i Slot index
+ * @return Slot
+ */
+static shared_cache_slot * get_slot(size_t i) {
+	return (shared_cache_slot *)(slots + i * SHARED_CACHE_SLOT_SIZE);
+}
+
+/**
+ * @brief Hash path
+ * @details FNV-1a over the path
+ *
+ * @param key Path
+ * @param len Length of \p key
+ * @return Hash value
+ */
+static uint64_t hash_key(const char *key, size_t len) {
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/**
+ * @brief Lock slot for writing
+ * @details Makes this process the writer of the slot. A worker may die in the middle of
+ *          an update, so the slot of a writer that doesn't exist anymore is taken over.
+ *
+ * @param slot Slot to lock
+ * @return 1 if locked, 0 if another writer has it
+ */
+static int lock_slot(shared_cache_slot *slot) {
+	pid_t self = getpid();
+	pid_t owner = 0;
+	if (atomic_compare_exchange_strong_explicit(&slot->writer, &owner, self, memory_order_acquire, memory_order_relaxed)) return 1;
+	if (owner == self || kill(owner, 0) == 0 || errno != ESRCH) return 0;
+	zhttpd_log(LOG_WARN, "Reclaiming shared cache slot of exited process %d", owner);
+	return atomic_compare_exchange_strong_explicit(&slot->writer, &owner, self, memory_order_acquire, memory_order_relaxed);
+}
+
+/**
+ * @brief Begin slot update
+ * @details Locks the slot and makes the sequence odd, so readers ignore the slot until write_end()
+ *
+ * @param slot Slot to update
+ * @param seq Sequence the slot is expected to have
+ * @return 1 if the slot may be written, 0 if it changed or another writer has it
+ */
+static int write_begin(shared_cache_slot *slot, uint32_t seq) {
+	if (!lock_slot(slot)) return 0;
+	uint32_t current = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	if (current != seq) {
+		atomic_store_explicit(&slot->writer, 0, memory_order_release);
+		return 0;
+	}
+	// Odd only if the previous writer died while updating, then it stays odd
+	atomic_store_explicit(&slot->seq, seq + ((seq & 1) ? 2 : 1), memory_order_relaxed);
+	// Keep the writes below after the odd sequence
+	atomic_thread_fence(memory_order_release);
+	return 1;
+}
+
+/**
+ * @brief End slot update
+ * @details Publishes the written slot with the next even sequence and unlocks it
+ *
+ * @param slot Updated slot
+ * @return New sequence of the slot
+ */
+static uint32_t write_end(shared_cache_slot *slot) {
+	uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed) + 1;
+	atomic_store_explicit(&slot->seq, seq, memory_order_release);
+	atomic_store_explicit(&slot->writer, 0, memory_order_release);
+	return seq;
+}
+
+/**
+ * @brief Drop slot
+ * @details Empties the slot if it still has the sequence \p seq
+ *
+ * @param slot Slot to drop
+ * @param seq Sequence the slot is expected to have
+ */
+static void drop_slot(shared_cache_slot *slot, uint32_t seq) {
+	if (!write_begin(slot, seq)) return;
+	atomic_store_explicit(&slot->used, 0, memory_order_relaxed);
+	write_end(slot);
+}
+
+/**
+ * @brief Initialize shared cache
+ * @details Maps the shared memory. Call before forking, the workers share the mapping.
+ *
+ * @param size Size of the mapping in bytes, 0 disables the cache
+ * @return 0 on success, < 0 on error
+ */
+int shared_cache_init(size_t size) {
+	size_t sets = size / SHARED_CACHE_SLOT_SIZE / SHARED_CACHE_WAYS;
+	if (sets == 0) return 0;
+	// Round down to a power of two, the set is picked with a mask
+	while (sets & (sets - 1)) sets &= sets - 1;
+	slot_count = sets * SHARED_CACHE_WAYS;
+
+	// Anonymous memory is zeroed, so every slot starts unused with sequence 0
+	void *map = mmap(NULL, slot_count * SHARED_CACHE_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		zhttpd_log(LOG_ERROR, "Shared cache mapping failed!");
+		perror("mmap");
+		slot_count = 0;
+		return -1;
+	}
+	watches = calloc(slot_count, sizeof(slot_watch));
+	if (watches == NULL) {
+		munmap(map, slot_count * SHARED_CACHE_SLOT_SIZE);
+		slot_count = 0;
+		return -1;
+	}
+	slots = map;
+	zhttpd_log(LOG_DEBUG, "Shared cache has %zu slots for files up to %zu bytes", slot_count, SHARED_CACHE_BODY_MAX);
+	return 0;
+}
+
+/**
+ * @brief Check if file can be stored
+ *
+ * @param key Path the file was resolved from
+ * @param file Resolved file
+ * @return 1 if shared_cache_put() would store the file, 0 otherwise
+ */
+int shared_cache_fits(const char *key, const resolved_file *file) {
+	return slot_count > 0 && file->size <= (off_t)SHARED_CACHE_BODY_MAX &&
+		strlen(key) < SHARED_CACHE_PATH_MAX && strlen(file->path) < SHARED_CACHE_PATH_MAX;
+}
+
+/**
+ * @brief Check slot against file
+ * @details Guards a slot this worker hasn't served before with an own watch. Changes made before
+ *          the watch existed would go unnoticed, so the file is compared with the slot once.
+ *
+ * @param i Slot index
+ * @param copy Validated copy of the slot
+ * @return 1 if the slot may be served, 0 otherwise
+ */
+static int guard_slot(size_t i, const shared_cache_slot *copy) {
+	if (watches[i].seq == copy->seq) return 1;
+
+	int wd = file_cache_watch(copy->path);
+	if (wd == -1) return 0;
+	struct stat st;
+	if (stat(copy->path, &st) == -1 || st.st_dev != copy->dev || st.st_ino != copy->ino || st.st_size != copy->size ||
+		st.st_mtim.tv_sec != copy->mtime.tv_sec || st.st_mtim.tv_nsec != copy->mtime.tv_nsec) {
+		// Changed while nobody watched it
+		drop_slot(get_slot(i), copy->seq);
+		return 0;
+	}
+	watches[i].seq = copy->seq;
+	watches[i].wd = wd;
+	return 1;
+}
+
+/**
+ * @brief Get file from shared cache
+ * @details Copies the file stored for \p key, headers and body, to the arena without
+ *          touching the filesystem. Never blocks, a slot being updated counts as a miss.
+ *
+ * @param a Arena to copy to
+ * @param key Path the file was resolved from
+ * @param encoding HTTP_ENCODING_* flag of the wanted representation, 0 for the file as it is
+ * @param[out] out Resolved file without a descriptor
+ * @param[out] body File content, \p out->size bytes
+ * @param[out] head Prebuilt response head for http_prebuilt_finish() or NULL if there is none
+ * @param[out] head_len Length of \p head
+ * @return 0 on hit, < 0 on miss
+ */
+int shared_cache_get(arena *a, const char *key, int encoding, resolved_file *out, unsigned char **body, char **head, size_t *head_len) {
+	if (slot_count == 0) return -1;
+	size_t key_len = strlen(key);
+	if (key_len >= SHARED_CACHE_PATH_MAX) return -1;
+	uint64_t hash = hash_key(key, key_len);
+	size_t first = (hash & (slot_count / SHARED_CACHE_WAYS - 1)) * SHARED_CACHE_WAYS;
+
+	for (size_t i = first; i < first + SHARED_CACHE_WAYS; i++) {
+		shared_cache_slot *slot = get_slot(i);
+		uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq & 1) continue;
+
+		// Copy first, the copy is trusted only if the sequence didn't change
+		shared_cache_slot copy;
+		memcpy(&copy, slot, sizeof(copy));
+		if (!copy.used || copy.hash != hash || copy.encoding != encoding || copy.key_len != key_len || memcmp(copy.key, key, key_len) != 0) continue;
+		if (copy.size < 0 || copy.size > (off_t)SHARED_CACHE_BODY_MAX || copy.path_len >= SHARED_CACHE_PATH_MAX ||
+			copy.head_len > SHARED_CACHE_HEAD_MAX) continue;
+		unsigned char *data = arena_alloc(a, copy.head_len + copy.size + 1);
+		if (data == NULL) return -1;
+		memcpy(data, slot->data, copy.head_len + copy.size);
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) continue;
+
+		copy.seq = seq;
+		copy.path[copy.path_len] = '\0';
+		copy.type[MIME_TYPE_MAX - 1] = '\0';
+		copy.last_modified[HTTP_DATE_LEN] = '\0';
+		copy.etag[HTTP_ETAG_MAX - 1] = '\0';
+		if (!guard_slot(i, &copy)) return -1;
+
+		out->fd = -1;
+		out->path = arena_strdup(a, copy.path);
+		out->size = copy.size;
+		out->mtime = copy.mtime;
+		out->dev = copy.dev;
+		out->ino = copy.ino;
+		out->type = arena_strdup(a, copy.type);
+		memcpy(out->last_modified, copy.last_modified, sizeof(out->last_modified));
+		memcpy(out->etag, copy.etag, sizeof(out->etag));
+		out->encodings = copy.encodings;
+		out->encoding = copy.encoding;
+		out->release = NULL;
+		out->release_data = NULL;
+		if (out->path == NULL || out->type == NULL) return -1;
+		*head = copy.head_len > 0 ? (char *)data : NULL;
+		*head_len = copy.head_len;
+		*body = data + copy.head_len;
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * @brief Store file in shared cache
+ * @details Replaces an unused slot or the oldest one of the set. Gives up instead of waiting
+ *          if another worker is updating the slot. The file must pass shared_cache_fits().
+ *          A precompressed sibling served as an encoded representation is stored apart from the
+ *          sibling requested by its own name, the coding of \p file is part of the key.
+ *
+ * @param key Path the file was resolved from
+ * @param file Resolved file
+ * @param body File content, \p file->size bytes
+ * @param head Response head from http_response_get_prebuilt(), may be NULL
+ * @param head_len Length of \p head, at most #SHARED_CACHE_HEAD_MAX
+ */
+void shared_cache_put(const char *key, const resolved_file *file, const unsigned char *body, const char *head, size_t head_len) {
+	if (!shared_cache_fits(key, file)) return;
+	if (head == NULL || head_len > SHARED_CACHE_HEAD_MAX) head_len = 0;
+	int wd = file_cache_watch(file->path);
+	if (wd == -1) return;
+
+	size_t key_len = strlen(key);
+	uint64_t hash = hash_key(key, key_len);
+	size_t first = (hash & (slot_count / SHARED_CACHE_WAYS - 1)) * SHARED_CACHE_WAYS;
+
+	// Other workers may be writing the set, only a hint until write_begin() checks the sequence
+	size_t victim = first;
+	uint64_t victim_ms = UINT64_MAX;
+	for (size_t i = first; i < first + SHARED_CACHE_WAYS; i++) {
+		shared_cache_slot *slot = get_slot(i);
+		if (!atomic_load_explicit(&slot->used, memory_order_relaxed)) {
+			victim = i;
+			break;
+		}
+		uint64_t stored_ms = atomic_load_explicit(&slot->stored_ms, memory_order_relaxed);
+		if (stored_ms < victim_ms) {
+			victim = i;
+			victim_ms = stored_ms;
+		}
+	}
+
+	shared_cache_slot *slot = get_slot(victim);
+	if (!write_begin(slot, atomic_load_explicit(&slot->seq, memory_order_relaxed))) return;
+	atomic_store_explicit(&slot->used, 1, memory_order_relaxed);
+	slot->hash = hash;
+	atomic_store_explicit(&slot->stored_ms, monotonic_time_ms(), memory_order_relaxed);
+	slot->dev = file->dev;
+	slot->ino = file->ino;
+	slot->size = file->size;
+	slot->mtime = file->mtime;
+	slot->key_len = key_len;
+	memcpy(slot->key, key, key_len + 1);
+	slot->path_len = strlen(file->path);
+	memcpy(slot->path, file->path, slot->path_len + 1);
+	slot->is_index = strcmp(key, file->path) != 0;
+	slot->encodings = file->encodings;
+	slot->encoding = file->encoding;
+	snprintf(slot->type, sizeof(slot->type), "%s", file->type);
+	memcpy(slot->last_modified, file->last_modified, sizeof(slot->last_modified));
+	memcpy(slot->etag, file->etag, sizeof(slot->etag));
+	slot->head_len = head_len;
+	if (head_len > 0) memcpy(slot->data, head, head_len);
+	memcpy(slot->data + head_len, body, file->size);
+	watches[victim].seq = write_end(slot);
+	watches[victim].wd = wd;
+}
+
+/**
+ * @brief Drop files of changed directory entry
+ * @details Drops the slots guarded by watch \p wd that hold file \p name or were resolved to
+ *          an index file in the directory. A precompressed sibling also drops the file it belongs to,
+ *          the slot knows which siblings exist.
+ *
+ * @param wd inotify watch of the changed directory
+ * @param name Name of the changed entry
+ */
+void shared_cache_invalidate(int wd, const char *name) {
+	size_t base_len = http_encoding_strip_suffix(name, strlen(name));
+	for (size_t i = 0; i < slot_count; i++) {
+		if (watches[i].seq == 0 || watches[i].wd != wd) continue;
+		shared_cache_slot *slot = get_slot(i);
+		uint32_t seq = watches[i].seq;
+		watches[i].seq = 0;
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq) continue;	// Already replaced
+
+		// Compare the name of a copy, it's valid if the slot is still unchanged when dropping
+		char path[SHARED_CACHE_PATH_MAX];
+		memcpy(path, slot->path, sizeof(path));
+		int is_index = slot->is_index;
+		atomic_thread_fence(memory_order_acquire);
+		path[SHARED_CACHE_PATH_MAX - 1] = '\0';
+		const char *slot_name = strrchr(path, '/');
+		if (is_index || (slot_name != NULL && (strcmp(slot_name + 1, name) == 0 ||
+			(strlen(slot_name + 1) == base_len && strncmp(slot_name + 1, name, base_len) == 0)))) {
+			drop_slot(slot, seq);
+		} else {
+			watches[i].seq = seq;	// Other file of the directory, keep guarding it
+		}
+	}
+}
+
+/**
+ * @brief Drop all files
+ * @details Empties every slot, for changes that may affect any file
+ */
+void shared_cache_invalidate_all(void) {
+	for (size_t i = 0; i < slot_count; i++) {
+		shared_cache_slot *slot = get_slot(i);
+		watches[i].seq = 0;
+		uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (atomic_load_explicit(&slot->used, memory_order_relaxed)) drop_slot(slot, seq);
+	}
+}
@@ -10,31 +10,165 @@
 #include <signal.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <sys/select.h>
 #include <arpa/inet.h>
 
 #include "child.h"
+#include "http.h"
+#include "http_scan.h"
+#include "mime.h"
+#include "shared_cache.h"
 #include "utils.h"
 
+/**
+ * Worker process slot of the master
+ */
+typedef struct {
+	pid_t pid;				/**< Process ID, -1 if not running */
+	uint64_t started_ms;	/**< Time the worker was started */
+	uint64_t respawn_ms;	/**< Time to respawn the worker, 0 if it isn't waiting */
+	int quick_exits;		/**< Count of consecutive exits within #WORKER_MIN_LIFETIME_MS */
+} worker_slot;
+
 volatile sig_atomic_t run_main_loop = 0;
+volatile sig_atomic_t reap_workers = 0;	// True (1) if some worker process has exited
 
 static void sigint_handler(int signal) {
 	run_main_loop = 1;
 }
 
-static void sigchld_handler(int signal, siginfo_t *siginfo, void *context) {
-	pid_t chld_pid = siginfo->si_pid;
-	int exit_status = siginfo->si_status;
-	zhttpd_log(LOG_DEBUG, "Child process %d exited with status code %d, reaping", chld_pid, exit_status);
-	if (waitpid(chld_pid, NULL, 0) == -1) {
-		zhttpd_log(LOG_ERROR, "Waitpid failed!");
-		perror("waitpid");
+static void sigchld_handler(int signal) {
+	// Workers are reaped in the main loop, only flag the event here
+	reap_workers = 1;
+}
+
+/**
+ * @brief Get worker process count
+ * @details Resolves the count of worker processes to pre-fork
+ *
+ * @param requested Requested count, 0 means one worker per online CPU core
+ * @return Worker process count, always > 0
+ */
+static int get_worker_count(int requested) {
+	if (requested > 0) return requested;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1) {
+		zhttpd_log(LOG_WARN, "Couldn't get online CPU core count, using one worker");
+		return 1;
+	}
+	return (int)cores;
+}
+
+/**
+ * @brief Fork a new worker process
+ * @details Forks a long-lived worker process that accepts and serves connections
+ *          from \p server_sock until it's asked to stop. Doesn't return in the worker.
+ *
+ * @param server_sock Listening server socket
+ * @param orig_mask Signal mask to restore in the worker
+ * @return Process ID of the worker or < 0 on error
+ */
+static pid_t spawn_worker(int server_sock, const sigset_t *orig_mask) {
+	pid_t parent_pid = getpid();
+	pid_t pid = fork();
+	if (pid == 0) {
+		// Worker, the master blocks SIGINT and SIGCHLD outside of sigsuspend()
+		sigprocmask(SIG_SETMASK, orig_mask, NULL);
+		child_main_loop(server_sock, parent_pid);
+		close(server_sock);
+		zhttpd_log(LOG_DEBUG, "Worker process shutdown");
+		exit(0);
+	} else if (pid < 0) {
+		zhttpd_log(LOG_ERROR, "Worker process forking failed!");
+		perror("fork");
+	} else {
+		zhttpd_log(LOG_DEBUG, "Worker process %d started", pid);
+	}
+	return pid;
+}
+
+/**
+ * @brief Start worker of slot
+ * @details A failed fork is retried like a worker that exited right after starting
+ *
+ * @param w Worker slot
+ * @param server_sock Listening server socket
+ * @param orig_mask Signal mask to restore in the worker
+ */
+static void start_worker(worker_slot *w, int server_sock, const sigset_t *orig_mask) {
+	w->started_ms = monotonic_time_ms();
+	w->respawn_ms = 0;
+	w->pid = spawn_worker(server_sock, orig_mask);
+	if (w->pid < 0) {
+		w->pid = -1;
+		w->quick_exits++;
+		w->respawn_ms = w->started_ms + WORKER_MIN_LIFETIME_MS;
+	}
+}
+
+/**
+ * @brief Schedule respawn of exited worker
+ * @details A worker that keeps exiting right after starting, e.g. because its setup fails,
+ *          is respawned after a delay that doubles each time, so it can't keep the master
+ *          forking in a loop
+ *
+ * @param w Worker slot of the exited worker
+ * @return 1 if the worker should be respawned now, 0 if it's delayed
+ */
+static int schedule_respawn(worker_slot *w) {
+	uint64_t now = monotonic_time_ms();
+	if (now - w->started_ms >= WORKER_MIN_LIFETIME_MS) {
+		w->quick_exits = 0;
+		return 1;
 	}
-	zhttpd_log(LOG_DEBUG, "SIGCHLD handled");
+	uint64_t delay = WORKER_MIN_LIFETIME_MS;
+	for (int i = 0; i < w->quick_exits && delay < WORKER_RESPAWN_DELAY_MAX_MS; i++) delay *= 2;
+	if (delay > WORKER_RESPAWN_DELAY_MAX_MS) delay = WORKER_RESPAWN_DELAY_MAX_MS;
+	w->quick_exits++;
+	w->respawn_ms = now + delay;
+	zhttpd_log(LOG_WARN, "Worker exited right after starting, respawning in %lu ms", (unsigned long)delay);
+	return 0;
 }
 
 int main(int argc, char *argv[]) {
 
+	int requested_workers = WORKER_COUNT;
+	int listen_backlog = LISTEN_LIMIT;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "w:b:")) != -1) {
+		if (opt == 'w') {
+			requested_workers = atoi(optarg);
+			if (requested_workers < 0) {
+				fprintf(stderr, "Invalid worker count \"%s\"\n", optarg);
+				exit(1);
+			}
+		} else if (opt == 'b') {
+			listen_backlog = atoi(optarg);
+			if (listen_backlog < 1) {
+				fprintf(stderr, "Invalid listen backlog \"%s\"\n", optarg);
+				exit(1);
+			}
+		} else {
+			fprintf(stderr, "Usage: %s [-w workers] [-b listen_backlog]\n", argv[0]);
+			exit(1);
+		}
+	}
+
 	zhttpd_log(LOG_INFO, "zhttpd starting on port %d", LISTEN_PORT);
+	// Pick the request scanner once, workers inherit the choice
+	zhttpd_log(LOG_DEBUG, "Request header scanner: %s", http_scan_impl_name());
+	// Render the status lines and error pages once, workers inherit them
+	http_status_init();
+	// Load the extension table once, workers share it
+	if (mime_init(MIME_TYPES_PATH) < 0) {
+		zhttpd_log(LOG_CRIT, "MIME type table allocation failed!");
+		exit(1);
+	}
+	// Map the static file cache before forking, so every worker sees the same one
+	if (shared_cache_init(SHARED_CACHE_SIZE) < 0) {
+		zhttpd_log(LOG_WARN, "Shared cache disabled");
+	}
 
 	zhttpd_log(LOG_DEBUG, "Registering signal handler for SIGINT");
 	struct sigaction sigint_sigaction = {
@@ -49,8 +183,8 @@ int main(int argc, char *argv[]) {
 
 	zhttpd_log(LOG_DEBUG, "Registering signal handler for SIGCHLD");
 	struct sigaction sigchld_sigaction = {
-		.sa_sigaction = sigchld_handler,
-		.sa_flags = SA_SIGINFO
+		.sa_handler = sigchld_handler,
+		.sa_flags = SA_NOCLDSTOP
 	};
 
 	if (sigaction(SIGCHLD, &sigchld_sigaction, NULL) == -1) {
@@ -60,7 +194,8 @@ int main(int argc, char *argv[]) {
 	}
 
 	zhttpd_log(LOG_DEBUG, "Creating server socket");
-	int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+	// Accepted sockets get SOCK_CLOEXEC separately, but the server socket mustn't leak to CGI programs either
+	int server_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (server_sock == -1) {
 		zhttpd_log(LOG_CRIT, "Server socket init failed!");
 		perror("Listen socket init");
@@ -113,81 +248,101 @@ int main(int argc, char *argv[]) {
 
 	freeaddrinfo(serv_info);
 
+	// Workers drain the backlog until accept4() would block
 	if (make_socket_nonblocking(server_sock) == -1) {
 		zhttpd_log(LOG_CRIT, "Setting server socket non-blocking failed!");
 		exit(1);
 	}
 
-	if (listen(server_sock, LISTEN_LIMIT) == -1) {
+	// The kernel silently caps the backlog to net.core.somaxconn
+	zhttpd_log(LOG_DEBUG, "Listening with backlog of %d connections", listen_backlog);
+	if (listen(server_sock, listen_backlog) == -1) {
 		zhttpd_log(LOG_CRIT, "Connection listening failed!");
 		perror("Server listen");
 		exit(1);
 	}
 
-	zhttpd_log(LOG_INFO, "zhttpd ready, waiting for connections");
+	// Block SIGINT and SIGCHLD so that they're only delivered inside sigsuspend()
+	sigset_t block_mask, orig_mask;
+	sigemptyset(&block_mask);
+	sigaddset(&block_mask, SIGINT);
+	sigaddset(&block_mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &block_mask, &orig_mask) == -1) {
+		zhttpd_log(LOG_CRIT, "Signal mask setting failed!");
+		perror("sigprocmask");
+		exit(1);
+	}
+
+	// Pre-fork the workers, each one runs its own event loop for many connections
+	int worker_count = get_worker_count(requested_workers);
+	worker_slot *workers = calloc(worker_count, sizeof(worker_slot));
+	if (workers == NULL) {
+		zhttpd_log(LOG_CRIT, "Worker table allocation failed!");
+		exit(1);
+	}
+	for (int i = 0; i < worker_count; i++) {
+		start_worker(&workers[i], server_sock, &orig_mask);
+	}
 
-	pid_t pid = 1234;
+	zhttpd_log(LOG_INFO, "zhttpd ready with %d worker(s), waiting for connections", worker_count);
 
 	while (run_main_loop == 0) {
 
-		struct sockaddr_storage in_addr = {0};
-		socklen_t in_len = sizeof(in_addr);
-
-		int cli_sock = accept(server_sock, (struct sockaddr *)&in_addr, &in_len);
-		if (cli_sock == -1) {
-			if (errno != EAGAIN && errno != EWOULDBLOCK) {
-				zhttpd_log(LOG_ERROR, "Connection accepting failed!");
-				perror("accept");
-				continue;
-			}
+		// Sleep until a worker exits or we're asked to stop, or a delayed respawn is due
+		uint64_t respawn_ms = 0;
+		for (int i = 0; i < worker_count; i++) {
+			if (workers[i].respawn_ms != 0 && (respawn_ms == 0 || workers[i].respawn_ms < respawn_ms)) respawn_ms = workers[i].respawn_ms;
+		}
+		if (respawn_ms == 0) {
+			sigsuspend(&orig_mask);
 		} else {
-			zhttpd_log(LOG_INFO, "New connection accepted");
-
-			// Get address info
-			char str_addr[INET6_ADDRSTRLEN];
-			void *sin_addr;
-			if (in_addr.ss_family == AF_INET) {
-				// IPv4
-				sin_addr = &(((struct sockaddr_in *)&in_addr)->sin_addr);
-			} else if (in_addr.ss_family == AF_INET6) {
-				// IPv6
-				sin_addr = &(((struct sockaddr_in6 *)&in_addr)->sin6_addr);
-			} else {
-				zhttpd_log(LOG_ERROR, "Unknown socket family %d!", in_addr.ss_family);
-				shutdown(cli_sock, SHUT_RDWR);
-				close(cli_sock);
-				continue;
-			}
-			if (inet_ntop(in_addr.ss_family, sin_addr, str_addr, sizeof(str_addr)) == NULL) {
-				zhttpd_log(LOG_ERROR, "Getting address string failed!");
-				perror("inet_ntop");
-				shutdown(cli_sock, SHUT_RDWR);
-				close(cli_sock);
-				continue;
-			}
-			zhttpd_log(LOG_DEBUG, "Client address: %s", str_addr);
-
-			// Fork!
-			pid_t parent_pid = getpid();
-			pid = fork();
-			if (pid == 0) {
-				close(server_sock);
-				child_main_loop(cli_sock, parent_pid, str_addr);
-				break;
-			} else {
-				close(cli_sock);
+			uint64_t now = monotonic_time_ms();
+			uint64_t wait_ms = respawn_ms > now ? respawn_ms - now : 0;
+			struct timespec timeout = { .tv_sec = wait_ms / 1000, .tv_nsec = (wait_ms % 1000) * 1000000 };
+			pselect(0, NULL, NULL, NULL, &timeout, &orig_mask);
+		}
+
+		if (reap_workers) {
+			reap_workers = 0;
+			int status;
+			pid_t pid;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				zhttpd_log(LOG_DEBUG, "Worker process %d exited with status code %d, reaped", pid, status);
+				for (int i = 0; i < worker_count; i++) {
+					if (workers[i].pid != pid) continue;
+					workers[i].pid = -1;
+					if (run_main_loop == 0) {
+						// Worker died unexpectedly, replace it
+						zhttpd_log(LOG_WARN, "Worker process %d died, respawning", pid);
+						if (schedule_respawn(&workers[i])) start_worker(&workers[i], server_sock, &orig_mask);
+					}
+					break;
+				}
 			}
 		}
-		usleep(5000);
+
+		// Start the workers whose respawn delay has passed
+		uint64_t now = monotonic_time_ms();
+		for (int i = 0; i < worker_count && run_main_loop == 0; i++) {
+			if (workers[i].respawn_ms != 0 && workers[i].respawn_ms <= now) start_worker(&workers[i], server_sock, &orig_mask);
+		}
 	}
 
+	// Ask the workers to stop and wait for them
+	for (int i = 0; i < worker_count; i++) {
+		if (workers[i].pid > 0) kill(workers[i].pid, SIGINT);
+	}
+	for (int i = 0; i < worker_count; i++) {
+		if (workers[i].pid > 0 && waitpid(workers[i].pid, NULL, 0) == -1) {
+			zhttpd_log(LOG_ERROR, "Waitpid failed!");
+			perror("waitpid");
+		}
+	}
+	free(workers);
+
 	shutdown(server_sock, SHUT_RDWR);
 	close(server_sock);
 
-	if (pid == 0) {
-		zhttpd_log(LOG_DEBUG, "Child process shutdown");
-	} else {
-		zhttpd_log(LOG_INFO, "zhttpd exiting");
-	}
+	zhttpd_log(LOG_INFO, "zhttpd exiting");
 	return 0;
 }
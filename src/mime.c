@@ -0,0 +1,276 @@
+#include "mime.h"
+
+/**
+ * Types used when the types file doesn't list the extension
+ */
+static const char *builtin_types[][2] = {
+	{"html", "text/html"},
+	{"htm", "text/html"},
+	{"css", "text/css"},
+	{"js", "text/javascript"},
+	{"json", "application/json"},
+	{"txt", "text/plain"},
+	{"xml", "application/xml"},
+	{"png", "image/png"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"gif", "image/gif"},
+	{"svg", "image/svg+xml"},
+	{"ico", "image/vnd.microsoft.icon"},
+	{"webp", "image/webp"},
+	{"pdf", "application/pdf"},
+	{"wasm", "application/wasm"},
+	{"woff", "font/woff"},
+	{"woff2", "font/woff2"},
+	{NULL, NULL}	// Guard entry, must be last
+};
+
+static mime_ext_entry *ext_table = NULL;	// Open addressing table, shared by the workers
+static size_t ext_table_cap = 0;			// Slot count of ext_table, a power of two
+static size_t ext_table_count = 0;			// Used slots of ext_table
+
+static magic_t magic_cookie = NULL;			// Opened on first use in each process
+static mime_cache_entry type_cache[MIME_CACHE_SIZE];	// Types detected by libmagic
+static char buffer_type[MIME_TYPE_MAX];		// Last type detected from a buffer
+
+/**
+ * @brief Hash extension
+ * @details FNV-1a over the lowercase extension
+ *
+ * @param ext Extension
+ * @param len Length of \p ext
+ * @return Hash value
+ */
+static size_t hash_extension(const char *ext, size_t len) {
+	size_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)tolower((unsigned char)ext[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * @brief Find extension slot
+ *
+ * @param ext Extension, case insensitive
+ * @param len Length of \p ext
+ * @return Slot holding the extension or the free slot where it belongs
+ */
+static mime_ext_entry * find_slot(const char *ext, size_t len) {
+	size_t mask = ext_table_cap - 1;
+	for (size_t i = hash_extension(ext, len) & mask; ; i = (i + 1) & mask) {
+		mime_ext_entry *e = &ext_table[i];
+		if (e->ext == NULL || (strncasecmp(e->ext, ext, len) == 0 && e->ext[len] == '\0')) return e;
+	}
+}
+
+/**
+ * @brief Add extension
+ * @details Maps \p ext to \p type, replacing a previous mapping
+ *
+ * @param ext Extension without the dot
+ * @param len Length of \p ext
+ * @param type Media type
+ * @return 0 on success, < 0 on error
+ */
+static int add_extension(const char *ext, size_t len, const char *type) {
+	if ((ext_table_count + 1) * 2 > ext_table_cap) {
+		// Keep the table at most half full
+		mime_ext_entry *old = ext_table;
+		size_t old_cap = ext_table_cap;
+		ext_table_cap = old_cap > 0 ? old_cap * 2 : 256;
+		ext_table = calloc(ext_table_cap, sizeof(mime_ext_entry));
+		if (ext_table == NULL) {
+			ext_table = old;
+			ext_table_cap = old_cap;
+			return -1;
+		}
+		for (size_t i = 0; i < old_cap; i++) {
+			if (old[i].ext != NULL) *find_slot(old[i].ext, strlen(old[i].ext)) = old[i];
+		}
+		free(old);
+	}
+
+	mime_ext_entry *e = find_slot(ext, len);
+	char *type_copy = strdup(type);
+	if (type_copy == NULL) return -1;
+	if (e->ext == NULL) {
+		e->ext = strndup(ext, len);
+		if (e->ext == NULL) {
+			free(type_copy);
+			return -1;
+		}
+		for (char *p = e->ext; *p != '\0'; p++) *p = tolower((unsigned char)*p);
+		ext_table_count++;
+	} else {
+		free(e->type);
+	}
+	e->type = type_copy;
+	return 0;
+}
+
+/**
+ * @brief Load types file
+ * @details Reads a mime.types style file: a media type followed by its extensions on each line,
+ *          lines starting with '#' are comments
+ *
+ * @param path File path
+ * @return Count of loaded extensions or < 0 on error
+ */
+static int load_types_file(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return -1;
+
+	int count = 0;
+	char *line = NULL;
+	size_t line_cap = 0;
+	while (getline(&line, &line_cap, f) != -1) {
+		char *save;
+		char *type = strtok_r(line, " \t\r\n", &save);
+		if (type == NULL || type[0] == '#') continue;
+		char *ext;
+		while ((ext = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			if (ext[0] == '#') break;
+			if (add_extension(ext, strlen(ext), type) == 0) count++;
+		}
+	}
+	free(line);
+	fclose(f);
+	return count;
+}
+
+/**
+ * @brief Initialize MIME types
+ * @details Builds the extension table from built-in types and the types file.
+ *          Call before forking, so the workers share the table.
+ *
+ * @param types_path mime.types style file, its types override the built-in ones. May be NULL.
+ * @return 0 on success, < 0 on error
+ */
+int mime_init(const char *types_path) {
+	for (int i = 0; builtin_types[i][0] != NULL; i++) {
+		if (add_extension(builtin_types[i][0], strlen(builtin_types[i][0]), builtin_types[i][1]) < 0) return -1;
+	}
+	if (types_path != NULL) {
+		int count = load_types_file(types_path);
+		if (count < 0) {
+			zhttpd_log(LOG_WARN, "Can't read MIME types from \"%s\", using built-in types", types_path);
+		} else {
+			zhttpd_log(LOG_DEBUG, "Loaded %d MIME type extensions from \"%s\"", count, types_path);
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Get type by extension
+ * @details Looks up the extension of the last path component, case-insensitively
+ *
+ * @param path File path or name
+ * @return Media type or NULL if the extension is unknown
+ */
+const char * mime_type_by_extension(const char *path) {
+	if (ext_table == NULL) return NULL;
+	const char *name = strrchr(path, '/');
+	name = name != NULL ? name + 1 : path;
+	const char *dot = strrchr(name, '.');
+	if (dot == NULL || dot[1] == '\0') return NULL;
+	mime_ext_entry *e = find_slot(dot + 1, strlen(dot + 1));
+	return e->type;
+}
+
+/**
+ * @brief Get libmagic cookie
+ * @details Opens and loads the magic database once per process
+ *
+ * @return Cookie or NULL on error
+ */
+static magic_t get_magic_cookie(void) {
+	if (magic_cookie != NULL) return magic_cookie;
+
+	magic_t lm = magic_open(MAGIC_MIME_TYPE | MAGIC_MIME_ENCODING | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR | MAGIC_NO_CHECK_ELF | MAGIC_NO_CHECK_TOKENS | MAGIC_NO_CHECK_TROFF);
+	if (lm == NULL) {
+		zhttpd_log(LOG_ERROR, "Libmagic open failed!");
+		return NULL;
+	}
+	if (magic_load(lm, NULL) == -1) {
+		zhttpd_log(LOG_ERROR, "Libmagic load failed: %s", magic_error(lm));
+		magic_close(lm);
+		return NULL;
+	}
+	magic_cookie = lm;
+	return magic_cookie;
+}
+
+/**
+ * @brief Copy libmagic result
+ * @details Copies the detected type without "; charset=binary"
+ *
+ * @param desc libmagic result
+ * @param[out] out Buffer of #MIME_TYPE_MAX bytes
+ */
+static void copy_magic_type(const char *desc, char *out) {
+	size_t len = strlen(desc);
+	const char *binary = strstr(desc, "; charset=binary");
+	if (binary != NULL) len = binary - desc;
+	if (len >= MIME_TYPE_MAX) len = MIME_TYPE_MAX - 1;
+	memcpy(out, desc, len);
+	out[len] = '\0';
+}
+
+/**
+ * @brief Get type of file
+ * @details Uses the extension table first. Files with unknown extensions are detected with
+ *          libmagic from \p fd, and the result is cached by inode and modification time.
+ *
+ * @param path File path
+ * @param fd Open descriptor of the file
+ * @param st Status of \p fd
+ * @return Media type, valid until the next call, or NULL on error
+ */
+const char * mime_type_by_file(const char *path, int fd, const struct stat *st) {
+	const char *type = mime_type_by_extension(path);
+	if (type != NULL) return type;
+
+	mime_cache_entry *e = &type_cache[(st->st_ino ^ st->st_dev) & (MIME_CACHE_SIZE - 1)];
+	if (e->ino == st->st_ino && e->dev == st->st_dev &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+		// Cached, the file hasn't changed
+		return e->type;
+	}
+
+	magic_t lm = get_magic_cookie();
+	if (lm == NULL) return NULL;
+	const char *desc = magic_descriptor(lm, fd);
+	if (desc == NULL) {
+		zhttpd_log(LOG_ERROR, "Libmagic detect failed for \"%s\": %s", path, magic_error(lm));
+		return NULL;
+	}
+
+	copy_magic_type(desc, e->type);
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->mtime = st->st_mtim;
+	return e->type;
+}
+
+/**
+ * @brief Get type of buffer
+ * @details Detects the type of the data with libmagic
+ *
+ * @param buf Data to check
+ * @param len Length of \p buf
+ * @return Media type, valid until the next call, or NULL on error
+ */
+const char * mime_type_by_buffer(const unsigned char *buf, size_t len) {
+	magic_t lm = get_magic_cookie();
+	if (lm == NULL) return NULL;
+	const char *desc = magic_buffer(lm, buf, len);
+	if (desc == NULL) {
+		zhttpd_log(LOG_ERROR, "Libmagic buffer detect failed: %s", magic_error(lm));
+		return NULL;
+	}
+	copy_magic_type(desc, buffer_type);
+	return buffer_type;
+}
@@ -0,0 +1,238 @@
+#include "timer_wheel.h"
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_LEVEL_BITS)
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((uint64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_BITS))
+
+/**
+ * @brief Find next occupied slot
+ * @details Finds the first set bit in \p bitmap starting from \p start, wrapping around
+ *
+ * @param bitmap Slot bitmap
+ * @param start First slot to check
+ * @return Distance from \p start to the occupied slot, < 0 if there are none
+ */
+static int next_occupied(uint64_t bitmap, int start) {
+	if (bitmap == 0) return -1;
+	uint64_t rotated = (bitmap >> start) | (start > 0 ? bitmap << (TIMER_WHEEL_SLOTS - start) : 0);
+	return __builtin_ctzll(rotated);
+}
+
+/**
+ * @brief Put timer to its slot
+ * @details Links the timer to the slot matching its expiry tick
+ *
+ * @param tw Timer wheel
+ * @param timer Timer to place
+ */
+static void place_timer(timer_wheel *tw, timer_entry *timer) {
+	if (timer->expires < tw->current) timer->expires = tw->current;
+	uint64_t delta = timer->expires - tw->current;
+	if (delta >= MAX_DELTA) {
+		// Too far in the future, clamp to the wheel span
+		timer->expires = tw->current + MAX_DELTA - 1;
+		delta = MAX_DELTA - 1;
+	}
+
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << LEVEL_SHIFT(level + 1))) {
+		level++;
+	}
+	int slot = (timer->expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+
+	timer->level = level;
+	timer->slot = slot;
+	timer->prev = NULL;
+	timer->next = tw->slots[level][slot];
+	if (timer->next != NULL) timer->next->prev = timer;
+	tw->slots[level][slot] = timer;
+	tw->occupied[level] |= ((uint64_t)1 << slot);
+}
+
+/**
+ * @brief Remove timer from its slot
+ * @details Unlinks the timer without changing its armed state
+ *
+ * @param tw Timer wheel
+ * @param timer Timer to remove
+ */
+static void unlink_timer(timer_wheel *tw, timer_entry *timer) {
+	if (timer->prev != NULL) {
+		timer->prev->next = timer->next;
+	} else {
+		tw->slots[timer->level][timer->slot] = timer->next;
+	}
+	if (timer->next != NULL) timer->next->prev = timer->prev;
+	if (tw->slots[timer->level][timer->slot] == NULL) {
+		tw->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+	}
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+/**
+ * @brief Cascade slot
+ * @details Moves all timers in a higher level slot to lower levels
+ *
+ * @param tw Timer wheel
+ * @param level Level to cascade from
+ * @param slot Slot to cascade
+ */
+static void cascade(timer_wheel *tw, int level, int slot) {
+	timer_entry *timer = tw->slots[level][slot];
+	tw->slots[level][slot] = NULL;
+	tw->occupied[level] &= ~((uint64_t)1 << slot);
+	while (timer != NULL) {
+		timer_entry *next = timer->next;
+		place_timer(tw, timer);
+		timer = next;
+	}
+}
+
+/**
+ * @brief Initialize timer wheel
+ * @details Initializes empty \ref timer_wheel
+ *
+ * @param tw Timer wheel to initialize
+ * @param now_ms Current time in milliseconds
+ */
+void timer_wheel_init(timer_wheel *tw, uint64_t now_ms) {
+	memset(tw, 0, sizeof(timer_wheel));
+	tw->current = now_ms / TIMER_WHEEL_TICK_MS;
+}
+
+/**
+ * @brief Initialize timer
+ * @details Initializes unarmed \ref timer_entry
+ *
+ * @param timer Timer to initialize
+ * @param callback Function to call when the timer expires
+ * @param data User data passed to \p callback
+ */
+void timer_init(timer_entry *timer, timer_callback callback, void *data) {
+	memset(timer, 0, sizeof(timer_entry));
+	timer->callback = callback;
+	timer->data = data;
+}
+
+/**
+ * @brief Arm timer
+ * @details Arms the timer to expire at given time. Re-arms already armed timers.
+ *
+ * @param tw Timer wheel
+ * @param timer Timer to arm
+ * @param expires_ms Expiry time in milliseconds, in the same clock as given to timer_wheel_advance()
+ */
+void timer_arm(timer_wheel *tw, timer_entry *timer, uint64_t expires_ms) {
+	if (timer->armed) {
+		unlink_timer(tw, timer);
+	} else {
+		tw->count++;
+	}
+	// Round up so that the timer never expires early
+	timer->expires = (expires_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+	timer->armed = 1;
+	place_timer(tw, timer);
+}
+
+/**
+ * @brief Cancel timer
+ * @details Removes the timer from the wheel. Does nothing if the timer isn't armed.
+ *
+ * @param tw Timer wheel
+ * @param timer Timer to cancel
+ */
+void timer_cancel(timer_wheel *tw, timer_entry *timer) {
+	if (!timer->armed) return;
+	unlink_timer(tw, timer);
+	timer->armed = 0;
+	tw->count--;
+}
+
+/**
+ * @brief Advance timer wheel
+ * @details Expires all timers due at \p now_ms and calls their callbacks.
+ *          Callbacks may arm and cancel timers.
+ *
+ * @param tw Timer wheel
+ * @param now_ms Current time in milliseconds
+ */
+void timer_wheel_advance(timer_wheel *tw, uint64_t now_ms) {
+	uint64_t target = now_ms / TIMER_WHEEL_TICK_MS;
+
+	while (tw->current <= target) {
+		if (tw->count == 0) {
+			// Nothing to expire, jump straight to the target
+			tw->current = target + 1;
+			break;
+		}
+
+		int index = tw->current & SLOT_MASK;
+		if (index != 0) {
+			// Skip empty level 0 slots up to the next cascade point
+			uint64_t rest = tw->occupied[0] >> index;
+			uint64_t next = (rest != 0) ? tw->current + __builtin_ctzll(rest) : (tw->current | SLOT_MASK) + 1;
+			if (next > target) {
+				tw->current = target + 1;
+				break;
+			}
+			tw->current = next;
+			index = tw->current & SLOT_MASK;
+		}
+
+		if (index == 0) {
+			// Level 0 wrapped, pull timers down from the higher levels
+			for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+				int slot = (tw->current >> LEVEL_SHIFT(level)) & SLOT_MASK;
+				cascade(tw, level, slot);
+				if (slot != 0) break;
+			}
+		}
+
+		// Expire timers of the current tick
+		timer_entry *timer;
+		while ((timer = tw->slots[0][index]) != NULL) {
+			unlink_timer(tw, timer);
+			timer->armed = 0;
+			tw->count--;
+			if (timer->callback != NULL) timer->callback(timer, timer->data);
+		}
+		tw->current++;
+	}
+}
+
+/**
+ * @brief Get time until next expiry
+ * @details Gets how long the caller may sleep before calling timer_wheel_advance().
+ *          Timers on higher levels may cause an early wakeup for cascading.
+ *
+ * @param tw Timer wheel
+ * @param now_ms Current time in milliseconds
+ * @return Timeout in milliseconds or -1 if no timers are armed
+ */
+int timer_wheel_next_timeout(timer_wheel *tw, uint64_t now_ms) {
+	if (tw->count == 0) return -1;
+
+	uint64_t next = UINT64_MAX;
+
+	// Level 0 timers expire within the next TIMER_WHEEL_SLOTS ticks
+	int index = tw->current & SLOT_MASK;
+	int dist = next_occupied(tw->occupied[0], index);
+	if (dist >= 0) next = tw->current + dist;
+
+	// Higher levels need attention when their first non-empty slot cascades
+	for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		uint64_t unit = (uint64_t)1 << LEVEL_SHIFT(level);
+		uint64_t block = (tw->current + unit - 1) >> LEVEL_SHIFT(level);
+		dist = next_occupied(tw->occupied[level], block & SLOT_MASK);
+		if (dist < 0) continue;
+		uint64_t cascade_tick = (block + dist) << LEVEL_SHIFT(level);
+		if (cascade_tick < next) next = cascade_tick;
+	}
+
+	uint64_t next_ms = next * TIMER_WHEEL_TICK_MS;
+	if (next_ms <= now_ms) return 0;
+	uint64_t timeout = next_ms - now_ms;
+	if (timeout > INT32_MAX) timeout = INT32_MAX;
+	return (int)timeout;
+}
@@ -1,12 +1,5 @@
 #include "utils.h"
 
-static const char *index_names[] = {
-	"index.html",
-	"index.htm",
-	"index.php",
-	NULL	// Guard entry, must be last
-};
-
 /**
  * @brief Log strings to stdout
  * @details Logs formatted and possibly colored strings to stdout.
@@ -101,6 +94,19 @@ int make_socket_nonblocking(int sockfd) {
 	return 0;
 }
 
+/**
+ * @brief Get monotonic time
+ * @details Gets time from a clock that isn't affected by system time changes.
+ *          Use for timers and timeouts.
+ * 
+ * @return Monotonic time in milliseconds
+ */
+uint64_t monotonic_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**
  * @brief Get current date/time string
  * @details Produces string with given strftime() format.
@@ -123,18 +129,6 @@ int current_datetime_string2(char **str, const char *format) {
 	return len;
 }
 
-/**
- * @brief Get current date/time string
- * @details Produces Date-header formatted date string.
- *          Caller must free the string after use.
- * 
- * @param[out] str Non-allocated pointer where the result will be written
- * @return Length of \p str or < 0 on error
- */
-int current_datetime_string(char **str) {
-	return current_datetime_string2(str, HTTP_DATE_FORMAT);
-}
-
 /**
  * @brief Split text by delimiter
  * @details Tokenizes text by given delimiter. Ignores subsequent delimiters.
@@ -264,8 +258,10 @@ char * string_to_uppercase(char *str) {
 
 /**
  * @brief Create real filesystem path from webroot and request paths
- * @details Concatenates webroot and request paths securely
+ * @details Concatenates webroot and request paths securely. Doesn't touch the filesystem,
+ *          directories are resolved to their index files by resolved_file_open().
  * 
+ * @param a Arena the path is allocated from
  * @param webroot Webroot path
  * @param webroot_len Length of \p webroot
  * @param path Request path
@@ -273,8 +269,10 @@ char * string_to_uppercase(char *str) {
  * @param[out] out Pointer to non-allocated memory that will contain the concatenated path
  * @return Length of the concatenated path or < 0 on error
  */
-int create_real_path(const char *webroot, size_t webroot_len, const char *path, size_t path_len, char **out) {
-	char *real_path = calloc(webroot_len + path_len + 1, sizeof(char));
+int create_real_path(arena *a, const char *webroot, size_t webroot_len, const char *path, size_t path_len, char **out) {
+	// Room for an added slash and the null byte
+	char *real_path = arena_alloc(a, webroot_len + path_len + 2);
+	if (real_path == NULL) return ERROR_PATH_INVALID;
 	size_t real_path_pos = 0;
 	memcpy(real_path, webroot, webroot_len);
 	real_path_pos += webroot_len;
@@ -291,12 +289,10 @@ int create_real_path(const char *webroot, size_t webroot_len, const char *path,
 		char c = path[i];
 		if (c == '.' && prev == '.') {
 			// Not allowed, the user tries to traverse the filesystem (e.g. "/../../../../etc/passwd")
-			free(real_path);
 			return ERROR_PATH_EXPLOITING;
 		}
 		if ((c == '/' && prev == '/') || (c == '.' && prev == '/')) {
 			// Invalid path, two slashes "//" or '.' following '/' ("/.")
-			free(real_path);
 			return ERROR_PATH_INVALID;
 		}
 		if ((c >= '-' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_')) {
@@ -304,168 +300,18 @@ int create_real_path(const char *webroot, size_t webroot_len, const char *path,
 			real_path[real_path_pos++] = c;
 		} else {
 			// Not allowed character
-			free(real_path);
 			return ERROR_PATH_INVALID;
 		}
 
 		prev = c;
 	}
 
-	// Check if real_path is pointing to a directory and has no trailing slash
-	if (real_path[real_path_pos-1] != '/') {
-		struct stat path_stat;
-		stat(real_path, &path_stat);
-		if (stat(real_path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
-			// Is directory, append '/'
-			real_path[real_path_pos++] = '/';
-		}
-	}
-
-	// If the path ends with '/', add "index.html"
-	// TODO: Select between "index.htm" and "index.html", etc.
-	if (real_path[real_path_pos-1] == '/') {
-
-		int found_index_file = 0;
-		int idx_name_id = 0;
-		while (1) {
-			const char *idx_name = index_names[idx_name_id++];
-			if (idx_name == NULL) break;
-			int idx_name_len = strlen(idx_name);
-
-			char *test_path = calloc(real_path_pos + idx_name_len + 1, sizeof(char));
-			memcpy(test_path, real_path, real_path_pos);
-			memcpy(&test_path[real_path_pos], idx_name, idx_name_len);
-
-			struct stat idx_stat;
-			errno = 0;
-			if (stat(test_path, &idx_stat) == -1) {
-				if (errno != ENOENT) {
-					zhttpd_log(LOG_ERROR, "Can't stat \"%s\"", test_path);
-					perror("stat");
-				}
-			} else {
-				if (S_ISREG(idx_stat.st_mode)) {
-					// Is regular file
-					free(real_path);
-					real_path = test_path;
-					real_path_pos += idx_name_len;
-					found_index_file = 1;
-					break;
-				}
-			}
-			free(test_path);
-		}
-
-		if (found_index_file == 0) {
-			zhttpd_log(LOG_WARN, "No index file found");
-		}
-	}
-
-	// Realloc
-	real_path = realloc(real_path, (real_path_pos+1) * sizeof(char));
 	real_path[real_path_pos] = '\0';
 
 	*out = real_path;
 	return real_path_pos;
 }
 
-/**
- * @brief Get mimetype & charset string
- * @details Uses libmagic to obtain mimetype and charset for given buffer
- * 
- * @param buf Buffer to check
- * @param buf_len Length of \p buf
- * @param[out] out Pointer to non-allocated memory that will contain the mimetype & charset string
- * 
- * @return 0 on success, < 0 on error
- */
-int libmagic_get_mimetype(const unsigned char *buf, size_t buf_len, char **out) {
-
-	char *desc_out;
-
-	magic_t lm = magic_open(MAGIC_MIME_TYPE | MAGIC_MIME_ENCODING | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR | MAGIC_NO_CHECK_ELF | MAGIC_NO_CHECK_TOKENS | MAGIC_NO_CHECK_TROFF);
-	if (lm == NULL) {
-		zhttpd_log(LOG_ERROR, "Libmagic open failed: %s", magic_error(lm));
-		return -1;
-	}
-	if (magic_load(lm, NULL) == 1) {
-		zhttpd_log(LOG_ERROR, "Libmagic load failed: %s", magic_error(lm));
-		magic_close(lm);
-		return -1;
-	}
-
-	const char *desc = magic_buffer(lm, buf, buf_len);
-	if (desc == NULL) {
-		zhttpd_log(LOG_ERROR, "Libmagic buffer detect failed: %s", magic_error(lm));
-		magic_close(lm);
-		return -1;
-	}
-	desc_out = strdup(desc);
-
-	magic_close(lm);
-
-	// Remove "charset=binary" if needed
-	char *p = strstr(desc_out, "; charset=binary");
-	if (p != NULL) {
-		*p = '\0';
-		// "Realloc"
-		char *tmp = strdup(desc_out);
-		free(desc_out);
-		desc_out = tmp;
-	}
-
-	*out = desc_out;
-	return 0;
-}
-
-/**
- * @brief Get mimetype & charset string from file
- * @details Uses libmagic to obtain mimetype and charset for given file path
- * 
- * @param path File path to check
- * @param[out] out Pointer to non-allocated memory that will contain the mimetype & charset string
- * 
- * @return 0 on success, < 0 on error
- */
-int libmagic_get_mimetype2(const char *path, char **out) {
-
-	char *desc_out;
-
-	magic_t lm = magic_open(MAGIC_MIME_TYPE | MAGIC_MIME_ENCODING | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR | MAGIC_NO_CHECK_ELF | MAGIC_NO_CHECK_TOKENS | MAGIC_NO_CHECK_TROFF);
-	if (lm == NULL) {
-		zhttpd_log(LOG_ERROR, "Libmagic open failed: %s", magic_error(lm));
-		return -1;
-	}
-	if (magic_load(lm, NULL) == 1) {
-		zhttpd_log(LOG_ERROR, "Libmagic load failed: %s", magic_error(lm));
-		magic_close(lm);
-		return -1;
-	}
-
-	const char *desc = magic_file(lm, path);
-	if (desc == NULL) {
-		zhttpd_log(LOG_ERROR, "Libmagic file detect failed: %s", magic_error(lm));
-		magic_close(lm);
-		return -1;
-	}
-	desc_out = strdup(desc);
-
-	magic_close(lm);
-
-	// Remove "charset=binary" if needed
-	char *p = strstr(desc_out, "; charset=binary");
-	if (p != NULL) {
-		*p = '\0';
-		// "Realloc"
-		char *tmp = strdup(desc_out);
-		free(desc_out);
-		desc_out = tmp;
-	}
-
-	*out = desc_out;
-	return 0;
-}
-
 /**
  * @brief URL decode
  * @details Decode URL-encoded text
@@ -524,6 +370,51 @@ int url_decode(const char *in, size_t in_len, char **out) {
 	return out_pos;
 }
 
+/**
+ * @brief Get hex digit value
+ * 
+ * @param c Character to convert
+ * @return Value of the hex digit or -1 if \p c isn't one
+ */
+static int hex_digit_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * @brief URL decode in place
+ * @details Decodes URL-encoded text over itself. The decoded text is never longer than the input.
+ *          The result isn't null-terminated.
+ * 
+ * @param str String to decode
+ * @param len Length of \p str
+ * @return Length of the decoded string or < 0 on error
+ */
+int url_decode_in_place(char *str, size_t len) {
+	size_t out_pos = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (str[i] == '%') {
+			// Decode hex to char
+			if (i + 2 >= len) return -1;	// Malformed input string
+			int high = hex_digit_value(str[i+1]);
+			int low = hex_digit_value(str[i+2]);
+			if (high < 0 || low < 0) return -1;
+			// TODO: Handle null bytes
+			str[out_pos++] = (char)((high << 4) | low);
+			i += 2;
+		} else if (str[i] == '+') {
+			str[out_pos++] = ' ';
+		} else {
+			str[out_pos++] = str[i];
+		}
+	}
+
+	return out_pos;
+}
+
 /**
  * @brief URL encode
  * @details Encode text with "URL encoding"